@@ -3,12 +3,15 @@
 #include "BBox.hpp"
 #include "Scene.hpp"
 #include "Utils.hpp"
+#include "VehicleSystem.hpp"
 
 #include <glm/glm.hpp>
 #include <glm/gtx/string_cast.hpp>
 
 #include <deque>
+#include <functional>
 #include <iostream>
+#include <random>
 #include <vector>
 
 struct AssetMesh {
@@ -34,49 +37,29 @@ struct AssetMesh {
 
 struct PhysicalAssetMesh : AssetMesh {
 
-    glm::vec3 pos, vel, accel;
-    glm::vec3 rot, rotvel, rotaccel;
+    // kinematic state, as of the last physics step
+    // (simulated by VehicleSystem; these are copies for gameplay code to read)
+    glm::vec3 pos, vel;
+    glm::vec3 rot;
 
+    // collision response to apply in the next physics step
     glm::vec3 collision_force;
-    constexpr static glm::vec3 gravity = glm::vec3(0, 0, -9.8);
+
+    // hit another vehicle since the last collision cue was played (see PlayMode::play_collision_cues)
+    bool collided = false;
 
     PhysicalAssetMesh(const std::string& nameIn)
         : AssetMesh(nameIn)
     {
         pos = glm::vec3(0, 0, 0);
         vel = glm::vec3(0, 0, 0);
-        accel = gravity;
         rot = glm::vec3(0, 0, 0);
-        rotvel = glm::vec3(0, 0, 0);
-        rotaccel = glm::vec3(0, 0, 0);
         collision_force = glm::vec3(0, 0, 0);
     }
 
-    void update(const float dt)
-    {
-        // update positional kinematics
-        vel += dt * accel;
-        vel += dt * collision_force;
-
-        // reset collision force until next collision
-        collision_force = glm::vec3(0, 0, 0);
-
-        if (pos.z <= 0) {
-            // downward velocity is 0 when on the ground
-            vel.z = std::max(0.f, vel.z);
-        }
-        // std::cout << glm::to_string(vel) << std::endl;
-        pos += dt * vel;
-        pos.z = std::max(0.f, pos.z);
-
-        // update rotational/angular kinematics
-        rotvel += dt * rotaccel;
-        rot += dt * rotvel;
-        normalize(rot);
-
-        // update bounds based off position and rotation
-        bounds.update(pos, rot.z); // only rotate with yaw
-    }
+    // state before the last physics step (for interpolating between physics steps):
+    glm::vec3 prev_pos = glm::vec3(0, 0, 0);
+    glm::vec3 prev_rot = glm::vec3(0, 0, 0);
 };
 
 struct FourWheeledVehicle : PhysicalAssetMesh {
@@ -87,6 +70,7 @@ struct FourWheeledVehicle : PhysicalAssetMesh {
     }
 
     bool bIsPlayer = false;
+    std::mt19937 rng; // for AI decisions (per vehicle, so vehicles can think in parallel)
     Scene::Transform *all, *chassis, *wheel_FL, *wheel_FR, *wheel_BL, *wheel_BR;
 
     void initialize_components()
@@ -115,10 +99,10 @@ struct FourWheeledVehicle : PhysicalAssetMesh {
             const std::string key = s.first;
             // only add suffix if not searching for the name of the object itself
             const std::string search = key + ((key == name) ? "" : suffix);
-            for (auto& transform : scene.transforms) {
-                if (transform.name == search) { // contains key
-                    // std::cout << "found match for " << search << " to be " << transform.name << std::endl;
-                    (*s.second) = &transform;
+            for (uint32_t i = 0; i < scene.transforms.size(); ++i) {
+                if (scene.transforms.names[i] == search) { // contains key
+                    // std::cout << "found match for " << search << " to be " << scene.transforms.names[i] << std::endl;
+                    (*s.second) = &scene.transforms[i];
                     break;
                 }
             }
@@ -133,13 +117,36 @@ struct FourWheeledVehicle : PhysicalAssetMesh {
 
         auto* mesh = Scene::all_meshes["body" + suffix];
         if (mesh == nullptr) {
-            throw std::runtime_error("null mesh in chassis (\"" + chassis->name + "\") \"" + name + "\"!");
+            throw std::runtime_error("null mesh in chassis (\"" + scene.transforms.name(*chassis) + "\") \"" + name + "\"!");
         }
 
         bounds = BBox(mesh->min, mesh->max);
 
         pos = all->position;
         rot = glm::eulerAngles(all->rotation);
+        prev_pos = pos;
+        prev_rot = rot;
+    }
+
+    // set up as a copy of 'source', using the transforms that copy_of() returns for source's transforms
+    // (the copies are made by PlayMode::add_vehicle_copies; the mesh, and so the bounds, are shared)
+    void initialize_as_copy(const FourWheeledVehicle& source,
+        const std::function<Scene::Transform*(Scene::Transform const*)>& copy_of)
+    {
+        initialize_components();
+        all = copy_of(source.all);
+        chassis = copy_of(source.chassis);
+        wheel_FL = copy_of(source.wheel_FL);
+        wheel_FR = copy_of(source.wheel_FR);
+        wheel_BL = copy_of(source.wheel_BL);
+        wheel_BR = copy_of(source.wheel_BR);
+
+        bounds = source.bounds;
+
+        pos = all->position;
+        rot = glm::eulerAngles(all->rotation);
+        prev_pos = pos;
+        prev_rot = rot;
     }
 
     glm::vec3 get_heading(bool raw = false) const
@@ -149,7 +156,7 @@ struct FourWheeledVehicle : PhysicalAssetMesh {
     }
 
     FourWheeledVehicle* target = nullptr;
-    void think(const float dt, const std::vector<FourWheeledVehicle*>& others)
+    void think(const float dt, const std::vector<FourWheeledVehicle*>& others, std::mt19937& rng)
     {
         if (others.size() <= 1) {
             return;
@@ -157,7 +164,7 @@ struct FourWheeledVehicle : PhysicalAssetMesh {
 
         // randomly choose another target
         while ((target == nullptr || target == this || !target->enabled)) {
-            target = others[std::rand() % others.size()];
+            target = others[rng() % others.size()];
         }
 
         // get direction to target
@@ -182,55 +189,57 @@ struct FourWheeledVehicle : PhysicalAssetMesh {
         this->steer = angle;
     }
 
-    void update(const float dt)
+    // slot in the VehicleSystem that simulates this vehicle (see attach())
+    uint32_t slot = -1U;
+
+    void attach(VehicleSystem& system)
+    {
+        slot = system.add(pos, rot);
+    }
+
+    // hand this step's controls (and collision response) to the system
+    void write_controls(VehicleSystem& system)
+    {
+        system.throttle[slot] = throttle;
+        system.brake[slot] = brake;
+        system.steer[slot] = steer;
+        system.force_x[slot] = collision_force.x;
+        system.force_y[slot] = collision_force.y;
+        system.force_z[slot] = collision_force.z;
+        // reset collision force until next collision
+        collision_force = glm::vec3(0, 0, 0);
+    }
+
+    // pick up the state computed by VehicleSystem::step
+    void read_state(const VehicleSystem& system)
     {
-        woggle += 2 * dt;
-        woggle -= std::floor(woggle);
+        prev_pos = pos;
+        prev_rot = rot;
+        pos = glm::vec3(system.pos_x[slot], system.pos_y[slot], system.pos_z[slot]);
+        vel = glm::vec3(system.vel_x[slot], system.vel_y[slot], system.vel_z[slot]);
+        rot = glm::vec3(system.roll[slot], system.pitch[slot], system.yaw[slot]);
 
+        // update bounds based off position and rotation
+        bounds.update(pos, rot.z); // only rotate with yaw
+
+        // animate the parts:
+        const float woggle = system.woggle[slot];
+        const float wheel_rot = system.wheel_rot[slot];
         if (throttle > 0) {
             chassis->rotation = glm::angleAxis(glm::radians(std::sin(woggle * 2 * float(M_PI))), glm::vec3(0.0f, 1.0f, 0.0f));
         }
-        // create 3D acceleration vector
-        auto heading = get_heading();
-        accel = heading * (throttle_force * throttle - brake_force * brake) + glm::vec3(0, 0, accel.z);
-
-        // compute forward speed
-        glm::vec3 vel_2D = glm::vec3(vel.x, vel.y, 0);
-        int velocity_sign = glm::sign(glm::dot(vel_2D, heading));
-        float signed_speed = velocity_sign * glm::length(vel_2D);
-
-        wheel_rot -= dt * signed_speed;
         wheel_FL->rotation = glm::angleAxis(steer, glm::vec3(0, 0, 1)) * glm::angleAxis(wheel_rot, glm::vec3(1, 0, 0));
         wheel_FR->rotation = glm::angleAxis(steer, glm::vec3(0, 0, 1)) * glm::angleAxis(wheel_rot, glm::vec3(1, 0, 0));
         // these (rear) wheels are not on a z-axis rotation
         wheel_BL->rotation = glm::angleAxis(wheel_rot, glm::vec3(1, 0, 0));
         wheel_BR->rotation = glm::angleAxis(wheel_rot, glm::vec3(1, 0, 0));
+    }
 
-        if (pos.z <= 0) { // ground update
-            // inspiration for this physics update was taken from this code:
-            // https://github.com/winstxnhdw/KinematicBicycleModel
-
-            // compute friction
-            float friction = signed_speed * (c_r + c_a * signed_speed);
-            accel -= vel_2D * friction; // scale forward velocity by friction
-            const float MAX_ACCEL = 100;
-            accel.x = std::min(std::max(accel.x, -MAX_ACCEL), MAX_ACCEL);
-            accel.y = std::min(std::max(accel.y, -MAX_ACCEL), MAX_ACCEL);
-
-            // ensure velocity in x/y is linked to heading
-            vel.x = signed_speed * heading.x;
-            vel.y = signed_speed * heading.y;
-
-            // compute angular velocity (only along yaw)
-            rotvel = (signed_speed * glm::tan(steer_force * steer) / wheel_diameter_m) * glm::vec3(0, 0, 1);
-        } else { // in the air
-            accel = gravity;
-        }
-
-        // finally perform the physics update
-        PhysicalAssetMesh::update(dt);
-        all->position = pos;
-        all->rotation = glm::quat(rot); // euler to Quat!
+    // move the scene transform to 'alpha' of the way from the previous physics state to the current one
+    void apply_render_state(const float alpha)
+    {
+        all->position = glm::mix(prev_pos, pos, alpha);
+        all->rotation = glm::slerp(glm::quat(prev_rot), glm::quat(rot), alpha); // euler to Quat!
     }
 
     void turn_wheel(const float delta)
@@ -239,19 +248,9 @@ struct FourWheeledVehicle : PhysicalAssetMesh {
         this->steer = std::min(wheel_bounds.y, std::max(wheel_bounds.x, steer + delta));
     }
 
-    // how strong these effects get scaled
-    float throttle_force = 10.f;
-    float brake_force = 5.f; // brake or reverse?
-    float steer_force = 1.f;
+    // (forces and other tuning constants live in VehicleSystem::Params)
     glm::vec2 wheel_bounds = glm::vec2(-M_PI / 4.f, M_PI / 4.f); // [LB, UB]
 
-    // constants
-    float wheel_diameter_m = 1.0f;
-    float c_r = 0.02f; // coefficient of resistance
-    float c_a = 0.025f; // drag coefficient
-    float woggle = 0;
-    float wheel_rot = 0;
-
     float timeLastHit = -1e5; // when was the player last hit? (init to negative inf)
     float health = 2; // maximum number of bumps
 
@@ -6,6 +6,9 @@
 #include <glm/gtx/quaternion.hpp>
 #include <glm/gtx/string_cast.hpp>
 
+#include <algorithm>
+#include <array>
+#include <cmath>
 #include <iostream>
 #include <vector>
 
@@ -58,6 +61,60 @@ public:
         return within_x && within_y && within_z;
     }
 
+    // result of a separating-axis test:
+    struct Contact {
+        glm::vec3 normal = glm::vec3(0, 0, 0); // unit axis of least overlap, pointing from other toward this
+        float depth = 0.f; // how far this must move along normal to stop overlapping
+    };
+
+    // exact box-vs-box test (separating axis theorem), using each box's yaw-rotated
+    // extent around its midpt; if the boxes overlap and contact != nullptr, fills contact
+    bool overlaps(const BBox& other, Contact* contact = nullptr) const
+    {
+        const glm::vec3 d = midpt - other.midpt;
+        const glm::vec3 half_a = extent / 2.f;
+        const glm::vec3 half_b = other.extent / 2.f;
+
+        // yaw-only boxes: the candidate axes are z plus each box's local x and y in the ground plane
+        const float ca = std::cos(rot.z), sa = std::sin(rot.z);
+        const float cb = std::cos(other.rot.z), sb = std::sin(other.rot.z);
+        const glm::vec2 axes[4] = {
+            glm::vec2(ca, sa), glm::vec2(-sa, ca), // this box's local x, y
+            glm::vec2(cb, sb), glm::vec2(-sb, cb), // other box's local x, y
+        };
+
+        // vertical overlap:
+        float best_depth = (half_a.z + half_b.z) - std::abs(d.z);
+        if (best_depth < 0.f) {
+            return false;
+        }
+        glm::vec3 best_normal = glm::vec3(0, 0, d.z < 0.f ? -1.f : 1.f);
+
+        // horizontal overlap along each axis:
+        for (const glm::vec2& axis : axes) {
+            // projected half-widths of each box on this axis
+            const float ra = half_a.x * std::abs(glm::dot(axis, axes[0])) + half_a.y * std::abs(glm::dot(axis, axes[1]));
+            const float rb = half_b.x * std::abs(glm::dot(axis, axes[2])) + half_b.y * std::abs(glm::dot(axis, axes[3]));
+            const float dist = glm::dot(axis, glm::vec2(d));
+            const float depth = (ra + rb) - std::abs(dist);
+            if (depth < 0.f) {
+                return false; // found a separating axis
+            }
+            if (depth < best_depth) {
+                best_depth = depth;
+                best_normal = glm::vec3(dist < 0.f ? -axis : axis, 0.f);
+            }
+        }
+
+        if (contact != nullptr) {
+            contact->normal = best_normal;
+            contact->depth = best_depth;
+        }
+        return true;
+    }
+
+    // (older point-containment test; misses boxes that cross without containing each
+    // other's corners -- use overlaps() instead. kept for comparison in bench.cpp)
     bool collides_with(const BBox& other) const
     {
         /// NOTE: this impl is kinda buggy in that it fails if the two boxes are
@@ -67,7 +124,7 @@ public:
         // check if this bbox contains any of the 9 points (vertices + midpt) of other
         const glm::vec3 size = other.extent / 2.f;
         const float other_yaw = other.rot.z;
-        std::vector<glm::vec3> check_points = {
+        const std::array<glm::vec3, 9> check_points = {
             other.midpt, // midpt
             other.midpt + rotate_yaw(other_yaw, (size * glm::vec3(1, 1, -1))), // front right bottom
             other.midpt + rotate_yaw(other_yaw, (size * glm::vec3(1, 1, 1))), // front right top
@@ -87,6 +144,21 @@ public:
         return false;
     }
 
+    // world-space axis-aligned box containing everything overlaps/collides_with can test for this
+    // bbox (the yaw-rotated box, and the region contains_pt accepts), at any yaw.
+    // boxes whose broad bounds don't overlap can't collide, so this is used for broad-phase culling
+    void get_broad_bounds(glm::vec3& min, glm::vec3& max) const
+    {
+        // yaw-independent radius in the xy plane:
+        float r2 = glm::dot(glm::vec2(extent) / 2.f, glm::vec2(extent) / 2.f);
+        for (const glm::vec2 corner : { glm::vec2(min0.x, min0.y), glm::vec2(min0.x, max0.y), glm::vec2(max0.x, min0.y), glm::vec2(max0.x, max0.y) }) {
+            r2 = std::max(r2, glm::dot(corner, corner));
+        }
+        const float r = std::sqrt(r2);
+        min = glm::vec3(midpt.x - r, midpt.y - r, midpt.z - extent.z / 2.f);
+        max = glm::vec3(midpt.x + r, midpt.y + r, midpt.z + extent.z / 2.f);
+    }
+
     void update(const glm::vec3& pos, const float yaw)
     {
         /// NOTE: for now these bboxes only support rotation along yaw
@@ -0,0 +1,173 @@
+#include "BVH.hpp"
+
+#include <algorithm>
+#include <cassert>
+
+namespace {
+	BVH::Box merge(BVH::Box const &a, BVH::Box const &b) {
+		BVH::Box ret;
+		ret.min = glm::min(a.min, b.min);
+		ret.max = glm::max(a.max, b.max);
+		return ret;
+	}
+
+	float surface_area(BVH::Box const &box) {
+		if (!(box.min.x <= box.max.x)) return 0.0f; //empty box
+		glm::vec3 e = box.max - box.min;
+		return 2.0f * (e.x * e.y + e.y * e.z + e.z * e.x);
+	}
+}
+
+void BVH::build(std::vector< Box > const &boxes) {
+	nodes.clear();
+	items.resize(boxes.size());
+	for (uint32_t i = 0; i < items.size(); ++i) {
+		items[i] = i;
+	}
+
+	nodes.emplace_back();
+	nodes[0].first = 0;
+	nodes[0].count = uint32_t(items.size());
+
+	//split nodes (depth-first, so that children are always appended after their parent):
+	std::vector< uint32_t > to_split;
+	to_split.emplace_back(0);
+	while (!to_split.empty()) {
+		uint32_t n = to_split.back();
+		to_split.pop_back();
+
+		uint32_t first = nodes[n].first;
+		uint32_t count = nodes[n].count;
+
+		//bounds of the items and of their centers:
+		Box bounds, centers;
+		for (uint32_t i = first; i < first + count; ++i) {
+			Box const &box = boxes[items[i]];
+			bounds = merge(bounds, box);
+			glm::vec3 c = 0.5f * (box.min + box.max);
+			centers.min = glm::min(centers.min, c);
+			centers.max = glm::max(centers.max, c);
+		}
+		nodes[n].box = bounds;
+
+		if (count <= LeafSize) continue;
+
+		//split at the median center along the axis where centers are most spread out:
+		glm::vec3 spread = centers.max - centers.min;
+		uint32_t axis = 0;
+		if (spread.y > spread[axis]) axis = 1;
+		if (spread.z > spread[axis]) axis = 2;
+		if (!(spread[axis] > 0.0f)) continue; //all centers coincide; splitting won't help
+
+		uint32_t mid = first + count / 2;
+		std::nth_element(items.begin() + first, items.begin() + mid, items.begin() + first + count, [&](uint32_t a, uint32_t b) {
+			return boxes[a].min[axis] + boxes[a].max[axis] < boxes[b].min[axis] + boxes[b].max[axis];
+		});
+
+		uint32_t left = uint32_t(nodes.size());
+		nodes.emplace_back();
+		nodes.emplace_back();
+		nodes[left].first = first;
+		nodes[left].count = mid - first;
+		nodes[left + 1].first = mid;
+		nodes[left + 1].count = first + count - mid;
+
+		nodes[n].first = left;
+		nodes[n].count = 0;
+
+		to_split.emplace_back(left + 1);
+		to_split.emplace_back(left);
+	}
+
+	built_cost = 0.0f;
+	for (auto const &node : nodes) {
+		built_cost += surface_area(node.box);
+	}
+}
+
+bool BVH::refit(std::vector< Box > const &boxes) {
+	assert(boxes.size() == items.size() && "refit() needs the same items as build()");
+
+	float cost = 0.0f;
+	//children come after parents, so a reverse sweep updates children first:
+	for (uint32_t n = uint32_t(nodes.size()) - 1; n < nodes.size(); --n) {
+		Node &node = nodes[n];
+		if (node.count != 0) {
+			node.box = Box();
+			for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+				node.box = merge(node.box, boxes[items[i]]);
+			}
+		} else if (n != 0 || !items.empty()) {
+			node.box = merge(nodes[node.first].box, nodes[node.first + 1].box);
+		}
+		cost += surface_area(node.box);
+	}
+
+	//boxes that moved apart make interior nodes overlap more; rebuild once that doubles the total:
+	return cost <= 2.0f * built_cost || cost == 0.0f;
+}
+
+float BVH::ray_box(glm::vec3 const &origin, glm::vec3 const &inv_direction, Box const &box, float max_t) {
+	float t_min = 0.0f;
+	float t_max = max_t;
+	for (uint32_t a = 0; a < 3; ++a) {
+		float t0 = (box.min[a] - origin[a]) * inv_direction[a];
+		float t1 = (box.max[a] - origin[a]) * inv_direction[a];
+		if (t0 > t1) std::swap(t0, t1);
+		//(written so that NaNs -- from 0 * inf when the ray lies in a slab plane -- keep the old bound)
+		t_min = (t0 > t_min ? t0 : t_min);
+		t_max = (t1 < t_max ? t1 : t_max);
+		if (t_min > t_max) return std::numeric_limits< float >::infinity();
+	}
+	return t_min;
+}
+
+uint32_t BVH::ray_cast(glm::vec3 const &origin, glm::vec3 const &direction, float &max_t,
+	std::function< float(uint32_t item, float max_t) > const &test) const {
+
+	if (nodes.empty() || items.empty()) return -1U;
+
+	glm::vec3 inv_direction = 1.0f / direction;
+	uint32_t best = -1U;
+
+	//(ray_box returns +infinity for misses, which would pass a "<= max_t" check when max_t is unbounded)
+	auto reachable = [&max_t](float t) {
+		return t < std::numeric_limits< float >::infinity() && t <= max_t;
+	};
+
+	//stack of (node, entry distance):
+	std::vector< std::pair< uint32_t, float > > stack;
+	float root_t = ray_box(origin, inv_direction, nodes[0].box, max_t);
+	if (reachable(root_t)) stack.emplace_back(0, root_t);
+
+	while (!stack.empty()) {
+		uint32_t n = stack.back().first;
+		float entry = stack.back().second;
+		stack.pop_back();
+		if (!reachable(entry)) continue; //something closer was hit since this was pushed
+
+		Node const &node = nodes[n];
+		if (node.count != 0) {
+			for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+				float t = test(items[i], max_t);
+				if (t < max_t) {
+					max_t = t;
+					best = items[i];
+				}
+			}
+		} else {
+			//push the farther child first, so the nearer one is visited first:
+			float t0 = ray_box(origin, inv_direction, nodes[node.first].box, max_t);
+			float t1 = ray_box(origin, inv_direction, nodes[node.first + 1].box, max_t);
+			if (t0 < t1) {
+				if (reachable(t1)) stack.emplace_back(node.first + 1, t1);
+				if (reachable(t0)) stack.emplace_back(node.first, t0);
+			} else {
+				if (reachable(t0)) stack.emplace_back(node.first, t0);
+				if (reachable(t1)) stack.emplace_back(node.first + 1, t1);
+			}
+		}
+	}
+
+	return best;
+}
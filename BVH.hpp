@@ -0,0 +1,63 @@
+#pragma once
+
+/*
+ * A BVH is a bounding volume hierarchy over a set of axis-aligned boxes (identified by index).
+ *
+ * Typical use (e.g., by Scene::ray_cast):
+ *  - build() once over the items' current boxes;
+ *  - as items move, refit() with their new boxes (cheap: no re-sorting);
+ *  - refit() reports when the tree has degraded enough that a build() would pay off.
+ *
+ * Queries visit nodes nearest-first and skip subtrees that can't beat the best hit so far,
+ *  so a ray query touches O(log n) nodes for typical scenes.
+ *
+ */
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <vector>
+
+struct BVH {
+	struct Box {
+		glm::vec3 min = glm::vec3( std::numeric_limits< float >::infinity());
+		glm::vec3 max = glm::vec3(-std::numeric_limits< float >::infinity());
+	};
+
+	//(re)build the hierarchy over boxes[0 .. boxes.size()-1]:
+	void build(std::vector< Box > const &boxes);
+
+	//update node bounds for new item boxes (same items, in the same order, as the last build()):
+	// returns 'false' if the tree has become loose enough that calling build() is recommended.
+	bool refit(std::vector< Box > const &boxes);
+
+	//find the nearest item hit by the ray origin + t * direction, for t in [0, max_t]:
+	// 'test(item, max_t)' is called for items whose box the ray enters before max_t; it should do an
+	//  exact test and return the hit distance (if less than max_t) or +infinity for a miss.
+	// returns the index of the nearest item hit (or -1U if none), and sets 'max_t' to its distance.
+	uint32_t ray_cast(glm::vec3 const &origin, glm::vec3 const &direction, float &max_t,
+		std::function< float(uint32_t item, float max_t) > const &test) const;
+
+	//ray vs. box slab test; returns the entry distance (clamped to 0), or +infinity if the
+	// ray misses the box or only reaches it after max_t:
+	static float ray_box(glm::vec3 const &origin, glm::vec3 const &inv_direction, Box const &box, float max_t);
+
+	size_t size() const { return items.size(); }
+
+	//--- internals ---
+	enum : uint32_t { LeafSize = 4 }; //maximum items per leaf
+
+	struct Node {
+		Box box;
+		//leaves: items[first .. first+count-1]
+		//interior nodes: count == 0, children are nodes[first] and nodes[first+1]
+		uint32_t first = 0;
+		uint32_t count = 0;
+	};
+	std::vector< Node > nodes; //nodes[0] is the root; children always come after their parent
+	std::vector< uint32_t > items; //item indices, grouped by leaf
+
+	float built_cost = 0.0f; //summed surface area of all nodes, as of the last build()
+};
@@ -0,0 +1,44 @@
+#include "BroadPhase.hpp"
+
+#include <algorithm>
+
+std::vector<std::pair<uint32_t, uint32_t>> const& BroadPhase::update(std::vector<Box> const& boxes)
+{
+    // objects were added/removed: start over from index order
+    if (order.size() != boxes.size()) {
+        order.resize(boxes.size());
+        for (uint32_t i = 0; i < order.size(); ++i) {
+            order[i] = i;
+        }
+    }
+
+    // insertion sort by min.x (nearly sorted already, thanks to frame-to-frame coherence)
+    for (size_t i = 1; i < order.size(); ++i) {
+        const uint32_t b = order[i];
+        const float x = boxes[b].min.x;
+        size_t j = i;
+        while (j > 0 && boxes[order[j - 1]].min.x > x) {
+            order[j] = order[j - 1];
+            --j;
+        }
+        order[j] = b;
+    }
+
+    // sweep: each box only needs checking against the boxes that start before it ends
+    pairs.clear();
+    for (size_t i = 0; i < order.size(); ++i) {
+        Box const& a = boxes[order[i]];
+        for (size_t j = i + 1; j < order.size(); ++j) {
+            Box const& b = boxes[order[j]];
+            if (b.min.x > a.max.x) {
+                break;
+            }
+            if (a.min.y <= b.max.y && b.min.y <= a.max.y && a.min.z <= b.max.z && b.min.z <= a.max.z) {
+                pairs.emplace_back(std::min(order[i], order[j]), std::max(order[i], order[j]));
+            }
+        }
+    }
+    std::sort(pairs.begin(), pairs.end());
+
+    return pairs;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Sweep-and-prune broad phase: finds all pairs of overlapping axis-aligned boxes.
+//
+// Boxes are swept along x. The x order from the previous update() is kept and re-sorted
+// with an insertion sort, which is ~O(n) when objects move a little each frame, so
+// finding pairs costs O(n + overlaps along x) instead of O(n^2).
+struct BroadPhase {
+    struct Box {
+        glm::vec3 min;
+        glm::vec3 max;
+    };
+
+    // find every (i, j), i < j, for which boxes[i] and boxes[j] overlap.
+    // pairs are returned sorted, so results don't depend on the sweep order.
+    // (call once per frame; boxes[i] should refer to the same object from frame to frame)
+    std::vector<std::pair<uint32_t, uint32_t>> const& update(std::vector<Box> const& boxes);
+
+    // box indices, sorted by min.x as of the last update()
+    std::vector<uint32_t> order;
+    // result of the last update()
+    std::vector<std::pair<uint32_t, uint32_t>> pairs;
+};
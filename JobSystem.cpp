@@ -0,0 +1,118 @@
+#include "JobSystem.hpp"
+
+#include <algorithm>
+#include <cassert>
+
+uint32_t JobSystem::default_worker_count() {
+	uint32_t cores = std::thread::hardware_concurrency();
+	return (cores > 1 ? cores - 1 : 0);
+}
+
+JobSystem::JobSystem(uint32_t worker_count) {
+	for (uint32_t i = 0; i < worker_count + 1; ++i) {
+		queues.emplace_back(std::make_unique< Queue >());
+	}
+	for (uint32_t i = 0; i < worker_count; ++i) {
+		workers.emplace_back(&JobSystem::worker_loop, this, i + 1);
+	}
+}
+
+JobSystem::~JobSystem() {
+	{
+		std::unique_lock< std::mutex > lock(wake_mutex);
+		quit = true;
+	}
+	wake.notify_all();
+	for (auto &worker : workers) {
+		worker.join();
+	}
+}
+
+void JobSystem::parallel_for(uint32_t count, uint32_t grain, std::function< void(uint32_t begin, uint32_t end) > const &fn) {
+	if (count == 0) return;
+	grain = std::max(1U, grain);
+
+	//not worth waking anyone up for a single range:
+	if (count <= grain || workers.empty()) {
+		for (uint32_t begin = 0; begin < count; begin += grain) {
+			fn(begin, std::min(count, begin + grain));
+		}
+		return;
+	}
+
+	assert(remaining.load() == 0 && "parallel_for isn't reentrant");
+
+	//deal ranges out to the queues in turn:
+	uint32_t range_count = (count + grain - 1) / grain;
+	remaining.store(range_count, std::memory_order_relaxed);
+	for (uint32_t q = 0; q < queues.size(); ++q) {
+		std::unique_lock< std::mutex > lock(queues[q]->mutex);
+		for (uint32_t r = q; r < range_count; r += uint32_t(queues.size())) {
+			Range range;
+			range.fn = &fn;
+			range.begin = r * grain;
+			range.end = std::min(count, range.begin + grain);
+			queues[q]->ranges.emplace_back(range);
+		}
+	}
+	{
+		std::unique_lock< std::mutex > lock(wake_mutex);
+		generation += 1;
+	}
+	wake.notify_all();
+
+	//help out until everything is finished:
+	// (the acquire pairs with the release in run(), so all ranges' writes are visible on return)
+	Range range;
+	while (remaining.load(std::memory_order_acquire) != 0) {
+		if (take(0, &range)) {
+			run(range);
+		} else {
+			std::this_thread::yield(); //last ranges are running on workers
+		}
+	}
+}
+
+bool JobSystem::take(uint32_t self, Range *range) {
+	{ //own queue, newest first:
+		Queue &queue = *queues[self];
+		std::unique_lock< std::mutex > lock(queue.mutex);
+		if (!queue.ranges.empty()) {
+			*range = queue.ranges.back();
+			queue.ranges.pop_back();
+			return true;
+		}
+	}
+	//steal from the others, oldest first:
+	for (uint32_t i = 1; i < queues.size(); ++i) {
+		Queue &queue = *queues[(self + i) % queues.size()];
+		std::unique_lock< std::mutex > lock(queue.mutex);
+		if (!queue.ranges.empty()) {
+			*range = queue.ranges.front();
+			queue.ranges.pop_front();
+			return true;
+		}
+	}
+	return false;
+}
+
+void JobSystem::run(Range const &range) {
+	(*range.fn)(range.begin, range.end);
+	remaining.fetch_sub(1, std::memory_order_acq_rel);
+}
+
+void JobSystem::worker_loop(uint32_t self) {
+	uint32_t seen = 0;
+	while (true) {
+		{ //sleep until there is a new batch of ranges:
+			std::unique_lock< std::mutex > lock(wake_mutex);
+			wake.wait(lock, [&](){ return quit || generation != seen; });
+			if (quit) return;
+			seen = generation;
+		}
+		Range range;
+		while (take(self, &range)) {
+			run(range);
+		}
+	}
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+/*
+ * JobSystem runs data-parallel loops across a pool of worker threads.
+ *
+ * Work is split into ranges; each worker has its own queue of ranges and, when that
+ * runs dry, steals from the other queues, so uneven ranges still balance out.
+ * The thread calling parallel_for() works on ranges too, and returns once all are done.
+ *
+ * Determinism: ranges may run in any order, on any thread. Loop bodies should only write
+ *  to per-index outputs; anything order-dependent (e.g., merging events) should be done
+ *  after parallel_for() returns, in index order.
+ *
+ * Loop bodies must not throw, and parallel_for() must not be called from a loop body.
+ */
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct JobSystem {
+	//start 'workers' threads (default: one per core, less one for the calling thread):
+	JobSystem(uint32_t workers = default_worker_count());
+	~JobSystem();
+
+	JobSystem(JobSystem const &) = delete;
+	JobSystem &operator=(JobSystem const &) = delete;
+
+	//call fn(begin, end) for consecutive ranges covering [0, count), each at most 'grain' long;
+	// returns once every range has been run:
+	void parallel_for(uint32_t count, uint32_t grain, std::function< void(uint32_t begin, uint32_t end) > const &fn);
+
+	//number of threads that run ranges (workers plus the calling thread):
+	uint32_t thread_count() const { return uint32_t(workers.size()) + 1; }
+
+	static uint32_t default_worker_count();
+
+	//--- internals ---
+	struct Range {
+		std::function< void(uint32_t, uint32_t) > const *fn = nullptr;
+		uint32_t begin = 0;
+		uint32_t end = 0;
+	};
+	struct Queue {
+		std::mutex mutex;
+		std::deque< Range > ranges;
+	};
+	std::vector< std::unique_ptr< Queue > > queues; //queues[0] is the calling thread's, queues[1+i] is workers[i]'s
+
+	//take a range -- from the back of queues[self], or else from the front of another queue:
+	bool take(uint32_t self, Range *range);
+	void run(Range const &range);
+
+	std::atomic< uint32_t > remaining{0}; //ranges not yet finished in the current parallel_for
+	std::mutex wake_mutex;
+	std::condition_variable wake; //signalled when ranges are queued (or on shutdown)
+	uint32_t generation = 0; //(guarded by wake_mutex) bumped per parallel_for, so sleeping workers notice new work
+	bool quit = false; //(guarded by wake_mutex)
+
+	std::vector< std::thread > workers;
+	void worker_loop(uint32_t self);
+};
@@ -3,7 +3,50 @@
 #include "gl_compile_program.hpp"
 #include "gl_errors.hpp"
 
+#include <cstddef>
+
 Scene::Drawable::Pipeline lit_color_texture_program_pipeline;
+Scene::Drawable::Pipeline lit_color_texture_instanced_program_pipeline;
+
+//fragment shader shared by the plain and instanced versions of the program:
+static char const *lit_color_texture_fragment_shader =
+	"#version 330\n"
+	"uniform sampler2D TEX;\n"
+	"uniform int LIGHT_TYPE;\n"
+	"uniform vec3 LIGHT_LOCATION;\n"
+	"uniform vec3 LIGHT_DIRECTION;\n"
+	"uniform vec3 LIGHT_ENERGY;\n"
+	"uniform float LIGHT_CUTOFF;\n"
+	"in vec3 position;\n"
+	"in vec3 normal;\n"
+	"in vec4 color;\n"
+	"in vec2 texCoord;\n"
+	"out vec4 fragColor;\n"
+	"void main() {\n"
+	"	vec3 n = normalize(normal);\n"
+	"	vec3 e;\n"
+	"	if (LIGHT_TYPE == 0) { //point light \n"
+	"		vec3 l = (LIGHT_LOCATION - position);\n"
+	"		float dis2 = dot(l,l);\n"
+	"		l = normalize(l);\n"
+	"		float nl = max(0.0, dot(n, l)) / max(1.0, dis2);\n"
+	"		e = nl * LIGHT_ENERGY;\n"
+	"	} else if (LIGHT_TYPE == 1) { //hemi light \n"
+	"		e = (dot(n,-LIGHT_DIRECTION) * 0.5 + 0.5) * LIGHT_ENERGY;\n"
+	"	} else if (LIGHT_TYPE == 2) { //spot light \n"
+	"		vec3 l = (LIGHT_LOCATION - position);\n"
+	"		float dis2 = dot(l,l);\n"
+	"		l = normalize(l);\n"
+	"		float nl = max(0.0, dot(n, l)) / max(1.0, dis2);\n"
+	"		float c = dot(l,-LIGHT_DIRECTION);\n"
+	"		nl *= smoothstep(LIGHT_CUTOFF,mix(LIGHT_CUTOFF,1.0,0.1), c);\n"
+	"		e = nl * LIGHT_ENERGY;\n"
+	"	} else { //(LIGHT_TYPE == 3) //directional light \n"
+	"		e = max(0.0, dot(n,-LIGHT_DIRECTION)) * LIGHT_ENERGY;\n"
+	"	}\n"
+	"	vec4 albedo = texture(TEX, texCoord) * color;\n"
+	"	fragColor = vec4(e*albedo.rgb, albedo.a);\n"
+	"}\n";
 
 Load< LitColorTextureProgram > lit_color_texture_program(LoadTagEarly, []() -> LitColorTextureProgram const * {
 	LitColorTextureProgram *ret = new LitColorTextureProgram();
@@ -68,43 +111,7 @@ LitColorTextureProgram::LitColorTextureProgram() {
 		"}\n"
 	,
 		//fragment shader:
-		"#version 330\n"
-		"uniform sampler2D TEX;\n"
-		"uniform int LIGHT_TYPE;\n"
-		"uniform vec3 LIGHT_LOCATION;\n"
-		"uniform vec3 LIGHT_DIRECTION;\n"
-		"uniform vec3 LIGHT_ENERGY;\n"
-		"uniform float LIGHT_CUTOFF;\n"
-		"in vec3 position;\n"
-		"in vec3 normal;\n"
-		"in vec4 color;\n"
-		"in vec2 texCoord;\n"
-		"out vec4 fragColor;\n"
-		"void main() {\n"
-		"	vec3 n = normalize(normal);\n"
-		"	vec3 e;\n"
-		"	if (LIGHT_TYPE == 0) { //point light \n"
-		"		vec3 l = (LIGHT_LOCATION - position);\n"
-		"		float dis2 = dot(l,l);\n"
-		"		l = normalize(l);\n"
-		"		float nl = max(0.0, dot(n, l)) / max(1.0, dis2);\n"
-		"		e = nl * LIGHT_ENERGY;\n"
-		"	} else if (LIGHT_TYPE == 1) { //hemi light \n"
-		"		e = (dot(n,-LIGHT_DIRECTION) * 0.5 + 0.5) * LIGHT_ENERGY;\n"
-		"	} else if (LIGHT_TYPE == 2) { //spot light \n"
-		"		vec3 l = (LIGHT_LOCATION - position);\n"
-		"		float dis2 = dot(l,l);\n"
-		"		l = normalize(l);\n"
-		"		float nl = max(0.0, dot(n, l)) / max(1.0, dis2);\n"
-		"		float c = dot(l,-LIGHT_DIRECTION);\n"
-		"		nl *= smoothstep(LIGHT_CUTOFF,mix(LIGHT_CUTOFF,1.0,0.1), c);\n"
-		"		e = nl * LIGHT_ENERGY;\n"
-		"	} else { //(LIGHT_TYPE == 3) //directional light \n"
-		"		e = max(0.0, dot(n,-LIGHT_DIRECTION)) * LIGHT_ENERGY;\n"
-		"	}\n"
-		"	vec4 albedo = texture(TEX, texCoord) * color;\n"
-		"	fragColor = vec4(e*albedo.rgb, albedo.a);\n"
-		"}\n"
+		lit_color_texture_fragment_shader
 	);
 	//As you can see above, adjacent strings in C/C++ are concatenated.
 	// this is very useful for writing long shader programs inline.
@@ -142,3 +149,116 @@ LitColorTextureProgram::~LitColorTextureProgram() {
 	program = 0;
 }
 
+
+//------------------------------------------
+
+Load< LitColorTextureInstancedProgram > lit_color_texture_instanced_program(LoadTagEarly, []() -> LitColorTextureInstancedProgram const * {
+	LitColorTextureInstancedProgram *ret = new LitColorTextureInstancedProgram();
+
+	//----- build the pipeline template -----
+	lit_color_texture_instanced_program_pipeline.program = ret->program;
+	lit_color_texture_instanced_program_pipeline.instance_buffer = ret->instance_buffer;
+
+	lit_color_texture_instanced_program_pipeline.WORLD_TO_CLIP_mat4 = ret->WORLD_TO_CLIP_mat4;
+	lit_color_texture_instanced_program_pipeline.WORLD_TO_LIGHT_mat4x3 = ret->WORLD_TO_LIGHT_mat4x3;
+	lit_color_texture_instanced_program_pipeline.NORMAL_WORLD_TO_LIGHT_mat3 = ret->NORMAL_WORLD_TO_LIGHT_mat3;
+
+	//share the 1-pixel white texture made for the non-instanced program (loaded just above):
+	lit_color_texture_instanced_program_pipeline.textures[0] = lit_color_texture_program_pipeline.textures[0];
+
+	return ret;
+});
+
+LitColorTextureInstancedProgram::LitColorTextureInstancedProgram() {
+	program = gl_compile_program(
+		//vertex shader -- like LitColorTextureProgram, but object matrices come from per-instance attributes:
+		"#version 330\n"
+		"uniform mat4 WORLD_TO_CLIP;\n"
+		"uniform mat4x3 WORLD_TO_LIGHT;\n"
+		"uniform mat3 NORMAL_WORLD_TO_LIGHT;\n"
+		"in vec4 Position;\n"
+		"in vec3 Normal;\n"
+		"in vec4 Color;\n"
+		"in vec2 TexCoord;\n"
+		"in mat4x3 OBJECT_TO_WORLD;\n" //per-instance
+		"in mat3 NORMAL_TO_WORLD;\n" //per-instance
+		"out vec3 position;\n"
+		"out vec3 normal;\n"
+		"out vec4 color;\n"
+		"out vec2 texCoord;\n"
+		"void main() {\n"
+		"	vec4 world_position = vec4(OBJECT_TO_WORLD * Position, 1.0);\n"
+		"	gl_Position = WORLD_TO_CLIP * world_position;\n"
+		"	position = WORLD_TO_LIGHT * world_position;\n"
+		"	normal = NORMAL_WORLD_TO_LIGHT * (NORMAL_TO_WORLD * Normal);\n"
+		"	color = Color;\n"
+		"	texCoord = TexCoord;\n"
+		"}\n"
+	,
+		//fragment shader:
+		lit_color_texture_fragment_shader
+	);
+
+	//look up the locations of vertex attributes:
+	Position_vec4 = glGetAttribLocation(program, "Position");
+	Normal_vec3 = glGetAttribLocation(program, "Normal");
+	Color_vec4 = glGetAttribLocation(program, "Color");
+	TexCoord_vec2 = glGetAttribLocation(program, "TexCoord");
+
+	OBJECT_TO_WORLD_mat4x3 = glGetAttribLocation(program, "OBJECT_TO_WORLD");
+	NORMAL_TO_WORLD_mat3 = glGetAttribLocation(program, "NORMAL_TO_WORLD");
+
+	//look up the locations of uniforms:
+	WORLD_TO_CLIP_mat4 = glGetUniformLocation(program, "WORLD_TO_CLIP");
+	WORLD_TO_LIGHT_mat4x3 = glGetUniformLocation(program, "WORLD_TO_LIGHT");
+	NORMAL_WORLD_TO_LIGHT_mat3 = glGetUniformLocation(program, "NORMAL_WORLD_TO_LIGHT");
+
+	LIGHT_TYPE_int = glGetUniformLocation(program, "LIGHT_TYPE");
+	LIGHT_LOCATION_vec3 = glGetUniformLocation(program, "LIGHT_LOCATION");
+	LIGHT_DIRECTION_vec3 = glGetUniformLocation(program, "LIGHT_DIRECTION");
+	LIGHT_ENERGY_vec3 = glGetUniformLocation(program, "LIGHT_ENERGY");
+	LIGHT_CUTOFF_float = glGetUniformLocation(program, "LIGHT_CUTOFF");
+
+	GLuint TEX_sampler2D = glGetUniformLocation(program, "TEX");
+
+	//set TEX to always refer to texture binding zero:
+	glUseProgram(program);
+	glUniform1i(TEX_sampler2D, 0);
+	glUseProgram(0);
+
+	//buffer for per-instance data (filled by Scene::draw):
+	glGenBuffers(1, &instance_buffer);
+
+	GL_ERRORS();
+}
+
+LitColorTextureInstancedProgram::~LitColorTextureInstancedProgram() {
+	glDeleteBuffers(1, &instance_buffer);
+	instance_buffer = 0;
+	glDeleteProgram(program);
+	program = 0;
+}
+
+GLuint LitColorTextureInstancedProgram::make_vao(MeshBuffer const &buffer) const {
+	//per-vertex attributes come from the mesh buffer:
+	GLuint vao = buffer.make_vao_for_program(program, {"OBJECT_TO_WORLD", "NORMAL_TO_WORLD"});
+
+	//per-instance attributes come from instance_buffer, advancing once per instance:
+	glBindVertexArray(vao);
+	glBindBuffer(GL_ARRAY_BUFFER, instance_buffer);
+	auto bind_columns = [](GLuint location, uint32_t columns, size_t offset) {
+		for (uint32_t c = 0; c < columns; ++c) {
+			glVertexAttribPointer(location + c, 3, GL_FLOAT, GL_FALSE, sizeof(Scene::Instance), (GLbyte *)0 + offset + c * sizeof(glm::vec3));
+			glEnableVertexAttribArray(location + c);
+			glVertexAttribDivisor(location + c, 1);
+		}
+	};
+	bind_columns(OBJECT_TO_WORLD_mat4x3, 4, offsetof(Scene::Instance, OBJECT_TO_WORLD));
+	bind_columns(NORMAL_TO_WORLD_mat3, 3, offsetof(Scene::Instance, NORMAL_TO_WORLD));
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindVertexArray(0);
+
+	GL_ERRORS();
+
+	return vao;
+}
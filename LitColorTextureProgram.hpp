@@ -38,3 +38,48 @@ extern Load< LitColorTextureProgram > lit_color_texture_program;
 //For convenient scene-graph setup, copy this object:
 // NOTE: by default, has texture bound to 1-pixel white texture -- so it's okay to use with vertex-color-only meshes.
 extern Scene::Drawable::Pipeline lit_color_texture_program_pipeline;
+
+//Instanced variant of the above; Scene::draw batches drawables that share a mesh into one draw call,
+// reading each object's matrices (a Scene::Instance) from 'instance_buffer':
+struct LitColorTextureInstancedProgram {
+	LitColorTextureInstancedProgram();
+	~LitColorTextureInstancedProgram();
+
+	GLuint program = 0;
+
+	//buffer that Scene::draw streams per-instance data into:
+	GLuint instance_buffer = 0;
+
+	//Attribute (per-vertex variable) locations:
+	GLuint Position_vec4 = -1U;
+	GLuint Normal_vec3 = -1U;
+	GLuint Color_vec4 = -1U;
+	GLuint TexCoord_vec2 = -1U;
+
+	//Attribute (per-instance variable) locations:
+	GLuint OBJECT_TO_WORLD_mat4x3 = -1U; //(four consecutive locations, one per column)
+	GLuint NORMAL_TO_WORLD_mat3 = -1U; //(three consecutive locations)
+
+	//Uniform (per-invocation variable) locations:
+	GLuint WORLD_TO_CLIP_mat4 = -1U;
+	GLuint WORLD_TO_LIGHT_mat4x3 = -1U;
+	GLuint NORMAL_WORLD_TO_LIGHT_mat3 = -1U;
+
+	//lighting (same as LitColorTextureProgram):
+	GLuint LIGHT_TYPE_int = -1U;
+	GLuint LIGHT_LOCATION_vec3 = -1U;
+	GLuint LIGHT_DIRECTION_vec3 = -1U;
+	GLuint LIGHT_ENERGY_vec3 = -1U;
+	GLuint LIGHT_CUTOFF_float = -1U;
+
+	//Textures:
+	//TEXTURE0 - texture that is accessed by TexCoord
+
+	//build a vertex array object that reads vertices from 'buffer' and instances from 'instance_buffer':
+	GLuint make_vao(MeshBuffer const &buffer) const;
+};
+
+extern Load< LitColorTextureInstancedProgram > lit_color_texture_instanced_program;
+
+//Pipeline template for the instanced program (with the same 1-pixel white texture as above):
+extern Scene::Drawable::Pipeline lit_color_texture_instanced_program_pipeline;
@@ -1,32 +1,212 @@
 #include "Load.hpp"
 
+#include <algorithm>
 #include <array>
-#include <list>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <iomanip>
+#include <iostream>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 namespace {
-	std::array< std::list< std::function< void() > >, MaxLoadTag > &get_load_lists() {
-		static std::array< std::list< std::function< void() > >, MaxLoadTag > load_lists;
+	struct LoadFunction {
+		std::string name;
+		std::function< void() > work; //run on a worker thread (may be empty)
+		std::function< void() > main; //run on the main thread after 'work' (may be empty)
+	};
+
+	std::array< std::list< LoadFunction >, MaxLoadTag > &get_load_lists() {
+		static std::array< std::list< LoadFunction >, MaxLoadTag > load_lists;
 		return load_lists;
 	}
+
+	//guards the load lists, since background loading functions may add more loading functions:
+	std::mutex &get_load_lists_mutex() {
+		static std::mutex load_lists_mutex;
+		return load_lists_mutex;
+	}
+
+	//tag currently being loaded by call_load_functions (guarded by the load lists mutex):
+	uint32_t loading_tag = 0;
+
+	char const *tag_name(uint32_t tag) {
+		switch (tag) {
+			case LoadTagEarly: return "Early";
+			case LoadTagDefault: return "Default";
+			case LoadTagLate: return "Late";
+			default: return "?";
+		}
+	}
+
+	LoadMode current_mode = LoadEverything;
+
+	double seconds_since(std::chrono::high_resolution_clock::time_point const &before) {
+		return std::chrono::duration< double >(std::chrono::high_resolution_clock::now() - before).count();
+	}
+}
+
+void add_load_function(LoadTag tag, std::function< void() > const &fn, std::string const &name) {
+	add_load_function(tag, nullptr, fn, name);
 }
 
-void add_load_function(LoadTag tag, std::function< void() > const &fn) {
+void add_load_function(LoadTag tag, std::function< void() > const &work_fn, std::function< void() > const &main_fn, std::string const &name) {
+	std::unique_lock< std::mutex > lock(get_load_lists_mutex());
 	auto &load_lists = get_load_lists();
 	assert(tag < load_lists.size());
-	load_lists[tag].emplace_back(fn);
+	assert(tag >= loading_tag && "loading functions can't be added for a tag that has already been loaded");
+	LoadFunction fn;
+	fn.name = name;
+	if (fn.name.empty()) {
+		fn.name = std::string(tag_name(tag)) + " #" + std::to_string(load_lists[tag].size());
+	}
+	fn.work = work_fn;
+	fn.main = main_fn;
+	load_lists[tag].emplace_back(std::move(fn));
+}
+
+LoadMode load_mode() {
+	return current_mode;
 }
 
-void call_load_functions() {
+void call_load_functions(LoadMode mode) {
 	static bool has_been_called = false;
 	assert(!has_been_called && "call_load_functions should only be called *once*");
 	has_been_called = true;
+	current_mode = mode;
+
+	//timing for the report at the end:
+	struct Timing {
+		std::string name;
+		uint32_t tag;
+		double work = 0.0; //seconds spent in 'work' (on a worker)
+		double main = 0.0; //seconds spent in 'main' (on the main thread)
+	};
+	std::vector< Timing > timings;
+	auto load_before = std::chrono::high_resolution_clock::now();
+
+	uint32_t worker_count = std::max(1U, std::thread::hardware_concurrency());
 
 	auto &load_lists = get_load_lists();
-	for (auto &fn_list : load_lists) {
-		while (!fn_list.empty()) {
-			(*fn_list.begin())(); //call first function in the list
-			fn_list.pop_front(); //remove from list
+	//take the functions currently listed for a tag:
+	auto take_list = [&load_lists](uint32_t tag) {
+		std::unique_lock< std::mutex > lock(get_load_lists_mutex());
+		loading_tag = tag;
+		std::list< LoadFunction > list;
+		list.swap(load_lists[tag]);
+		return list;
+	};
+	for (uint32_t tag = 0; tag < load_lists.size(); ++tag) {
+		//(loading functions -- on any thread -- may add more loading functions, so repeat until the list is empty)
+		for (std::list< LoadFunction > list = take_list(tag); !list.empty(); list = take_list(tag)) {
+			std::vector< LoadFunction > fns;
+			for (auto &fn : list) {
+				//main-thread-only functions may need OpenGL:
+				if (mode == LoadWithoutGL && !fn.work) continue;
+				fns.emplace_back(std::move(fn));
+			}
+
+			//per-function state shared with the workers:
+			struct Job {
+				std::exception_ptr error; //set if 'work' threw
+				double work = 0.0;
+				bool done = false;
+			};
+			std::vector< Job > jobs(fns.size());
+			std::vector< uint32_t > to_work; //indices of functions with a 'work' part
+			for (uint32_t i = 0; i < fns.size(); ++i) {
+				if (fns[i].work) to_work.emplace_back(i);
+				else jobs[i].done = true;
+			}
+
+			std::mutex mutex;
+			std::condition_variable cv; //signalled when a job is done
+			std::atomic< uint32_t > next{0}; //index into to_work of the next job to claim
+			std::atomic< bool > quit{false}; //set if the main thread is bailing out with an exception
+
+			std::vector< std::thread > workers;
+			for (uint32_t w = 0; w < std::min< size_t >(worker_count, to_work.size()); ++w) {
+				workers.emplace_back([&](){
+					while (!quit.load(std::memory_order_relaxed)) {
+						uint32_t n = next.fetch_add(1, std::memory_order_relaxed);
+						if (n >= to_work.size()) break;
+						uint32_t i = to_work[n];
+						auto before = std::chrono::high_resolution_clock::now();
+						std::exception_ptr error;
+						try {
+							fns[i].work();
+						} catch (...) {
+							error = std::current_exception();
+						}
+						double elapsed = seconds_since(before);
+						{
+							std::unique_lock< std::mutex > lock(mutex);
+							jobs[i].error = error;
+							jobs[i].work = elapsed;
+							jobs[i].done = true;
+						}
+						cv.notify_all();
+					}
+				});
+			}
+			auto join_workers = [&](){
+				for (auto &worker : workers) worker.join();
+				workers.clear();
+			};
+
+			//run main-thread parts in order, each as soon as its work is done:
+			try {
+				for (uint32_t i = 0; i < fns.size(); ++i) {
+					{
+						std::unique_lock< std::mutex > lock(mutex);
+						cv.wait(lock, [&](){ return jobs[i].done; });
+						if (jobs[i].error) std::rethrow_exception(jobs[i].error);
+					}
+					Timing timing;
+					timing.name = fns[i].name;
+					timing.tag = tag;
+					timing.work = jobs[i].work;
+					if (fns[i].main) {
+						auto before = std::chrono::high_resolution_clock::now();
+						fns[i].main();
+						timing.main = seconds_since(before);
+					}
+					timings.emplace_back(timing);
+				}
+			} catch (...) {
+				quit.store(true, std::memory_order_relaxed);
+				join_workers();
+				throw;
+			}
+			join_workers();
 		}
 	}
+
+	double wall = seconds_since(load_before);
+
+	//report:
+	std::sort(timings.begin(), timings.end(), [](Timing const &a, Timing const &b) {
+		return a.work + a.main > b.work + b.main;
+	});
+	double total_work = 0.0, total_main = 0.0;
+	for (auto const &timing : timings) {
+		total_work += timing.work;
+		total_main += timing.main;
+	}
+	std::cout << "Ran " << timings.size() << " load functions in " << std::fixed << std::setprecision(1) << (wall * 1000.0) << " ms"
+		<< " (up to " << worker_count << " worker threads):\n";
+	std::cout << "  " << std::setw(8) << "tag" << std::setw(10) << "work ms" << std::setw(10) << "main ms" << "  name\n";
+	for (auto const &timing : timings) {
+		std::cout << "  " << std::setw(8) << tag_name(timing.tag)
+			<< std::setw(10) << (timing.work * 1000.0)
+			<< std::setw(10) << (timing.main * 1000.0)
+			<< "  " << timing.name << "\n";
+	}
+	std::cout << "  " << std::setw(8) << "total" << std::setw(10) << (total_work * 1000.0) << std::setw(10) << (total_main * 1000.0) << std::endl;
+	std::cout << std::defaultfloat << std::setprecision(6);
 }
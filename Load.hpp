@@ -20,10 +20,26 @@
  * These functions are grouped by 'tags', which allow some sequencing of calls.
  * (particularly, this is useful for loading large data blobs [e.g. Meshes] before looking up individual elements within them.)
  *
+ * Loads that do a lot of CPU work (reading, decoding, parsing) can split that work off
+ *  to run on a pool of worker threads, with an optional second step on the main (OpenGL) thread:
+ *
+ * Load< MeshBuffer > meshes(LoadTagDefault, LoadInBackground, []() -> MeshBuffer * {
+ *     return new MeshBuffer(data_path("world.pnct"), MeshBuffer::DeferUpload); //worker thread
+ * }, [](MeshBuffer &buffer) {
+ *     buffer.upload(); //main thread
+ * }, "world.pnct");
+ *
+ * Each tag acts as a barrier: every function for a tag (background and main-thread parts)
+ *  finishes before any function for the next tag starts. Within a tag, background work runs
+ *  in any order, while main-thread parts run in the order they were added.
+ * So a background load may only use the results of loads with an *earlier* tag.
+ *
  */
 
 #include <functional>
+#include <memory>
 #include <stdexcept>
+#include <string>
 
 enum LoadTag : uint32_t {
 	LoadTagEarly,
@@ -33,13 +49,34 @@ enum LoadTag : uint32_t {
 };
 
 //Add a function to an internal list of loading functions:
-// (only call *before* "call_load_functions()")
-void add_load_function(LoadTag tag, std::function< void() > const &fn);
+// (call before "call_load_functions()", or from a loading function -- on any thread -- for the same or a later tag)
+// 'name' is used in the timing report (a name is made up if it is empty)
+void add_load_function(LoadTag tag, std::function< void() > const &fn, std::string const &name = "");
+
+//Add a two-part loading function: 'work_fn' runs on a worker thread,
+// then (once it finishes) 'main_fn' runs on the main thread.
+// (either may be empty)
+void add_load_function(LoadTag tag, std::function< void() > const &work_fn, std::function< void() > const &main_fn, std::string const &name = "");
+
+//Which loading functions to call:
+enum LoadMode : uint32_t {
+	LoadEverything, //normal startup (with an OpenGL context)
+	LoadWithoutGL, //headless runs: skip main-thread-only functions (which may use OpenGL), and
+	               // the 'main_fn' of background Load<>s; their background work still runs.
+};
 
 //Call all loading functions:
 // (loading functions may throw exceptions if they fail.)
 // (only call *once*)
-void call_load_functions();
+// (prints a table of per-function timings when done)
+void call_load_functions(LoadMode mode = LoadEverything);
+
+//The mode passed to call_load_functions():
+LoadMode load_mode();
+
+//Marker to select the background-loading Load<> constructor:
+struct LoadInBackground_t { };
+constexpr LoadInBackground_t const LoadInBackground{};
 
 
 //work-around for MSVC not accepting this as a lambda:
@@ -49,13 +86,31 @@ T const *new_T() { return new T; }
 template< typename T >
 struct Load {
 	//Constructing a Load< T > adds the passed function to the list of functions to call:
-	Load(LoadTag tag, const std::function< T const *() > &load_fn = new_T< T >) : value(nullptr) {
+	// (the function runs on the main thread, so it may use OpenGL)
+	Load(LoadTag tag, const std::function< T const *() > &load_fn = new_T< T >, std::string const &name = "") : value(nullptr) {
 		add_load_function(tag, [this,load_fn](){
 			this->value = load_fn();
 			if (!(this->value)) {
 				throw std::runtime_error("Loading failed.");
 			}
-		});
+		}, name);
+	}
+
+	//Background version: 'work_fn' runs on a worker thread (so must not use OpenGL),
+	// then 'main_fn' (if supplied) finishes the object on the main thread:
+	// (with LoadWithoutGL, 'main_fn' is skipped but the object is still available)
+	Load(LoadTag tag, LoadInBackground_t, const std::function< T *() > &work_fn, const std::function< void(T &) > &main_fn = nullptr, std::string const &name = "") : value(nullptr) {
+		//object being loaded, handed from the worker to the main thread:
+		auto staged = std::make_shared< T * >(nullptr);
+		add_load_function(tag, [staged,work_fn](){
+			*staged = work_fn();
+			if (!*staged) {
+				throw std::runtime_error("Loading failed.");
+			}
+		}, [this,staged,main_fn](){
+			if (main_fn && load_mode() != LoadWithoutGL) main_fn(**staged);
+			this->value = *staged;
+		}, name);
 	}
 
 	//Make a "Load< T >" behave like a "T const *":
@@ -73,8 +128,8 @@ struct Load {
 template< >
 struct Load< void > {
 	//Constructing a Load< T > adds the passed function to the list of functions to call:
-	Load( LoadTag tag, const std::function< void() > &load_fn) {
-		add_load_function(tag, load_fn);
+	Load( LoadTag tag, const std::function< void() > &load_fn, std::string const &name = "") {
+		add_load_function(tag, load_fn, name);
 	}
 };
 
@@ -121,6 +121,14 @@ if (maek.OS === 'windows') {
 // cppFile: name of c++ file to compile
 // objFileBase (optional): base name object file to produce (if not supplied, set to options.objDir + '/' + cppFile without the extension)
 //returns objFile: objFileBase + a platform-dependant suffix ('.o' or '.obj')
+//code shared between the game and the benchmarks:
+const mixer_names = [
+	maek.CPP('mix_kernel.cpp')
+];
+const vehicle_names = [
+	maek.CPP('VehicleSystem.cpp')
+];
+
 const game_names = [
 	maek.CPP('PlayMode.cpp'),
 	maek.CPP('main.cpp'),
@@ -128,7 +136,10 @@ const game_names = [
 	//maek.CPP('ColorTextureProgram.cpp'),  //not used right now, but you might want it
 	maek.CPP('Sound.cpp'),
 	maek.CPP('load_wav.cpp'),
-	maek.CPP('load_opus.cpp')
+	maek.CPP('load_opus.cpp'),
+	maek.CPP('pcm_cache.cpp'),
+	maek.CPP('OpusStream.cpp'),
+	maek.CPP('BroadPhase.cpp')
 ];
 
 const common_names = [
@@ -143,7 +154,11 @@ const common_names = [
 	maek.CPP('gl_compile_program.cpp'),
 	maek.CPP('Mode.cpp'),
 	maek.CPP('GL.cpp'),
-	maek.CPP('Load.cpp')
+	maek.CPP('Load.cpp'),
+	maek.CPP('JobSystem.cpp'),
+	maek.CPP('MappedFile.cpp'),
+	maek.CPP('BVH.cpp'),
+	maek.CPP('Profiler.cpp')
 ];
 
 const show_meshes_names = [
@@ -158,16 +173,21 @@ const show_scene_names = [
 	maek.CPP('ShowSceneMode.cpp')
 ];
 
+const bench_names = [
+	maek.CPP('bench.cpp')
+];
+
 //the '[exeFile =] LINK(objFiles, exeFileBase, [, options])' links an array of objects into an executable:
 // objFiles: array of objects to link
 // exeFileBase: name of executable file to produce
 //returns exeFile: exeFileBase + a platform-dependant suffix (e.g., '.exe' on windows)
-const game_exe = maek.LINK([...game_names, ...common_names], 'dist/game');
+const game_exe = maek.LINK([...game_names, ...mixer_names, ...vehicle_names, ...common_names], 'dist/game');
 const show_meshes_exe = maek.LINK([...show_meshes_names, ...common_names], 'scenes/show-meshes');
 const show_scene_exe = maek.LINK([...show_scene_names, ...common_names], 'scenes/show-scene');
+const bench_exe = maek.LINK([...bench_names, ...mixer_names, ...vehicle_names], 'bench');
 
 //set the default target to the game (and copy the readme files):
-maek.TARGETS = [game_exe, show_meshes_exe, show_scene_exe, ...copies];
+maek.TARGETS = [game_exe, show_meshes_exe, show_scene_exe, bench_exe, ...copies];
 
 //the '[targets =] RULE(targets, prerequisites[, recipe])' rule defines a Makefile-style task
 // targets: array of targets the task produces (can include both files and ':abstract targets')
@@ -178,6 +198,25 @@ maek.RULE([':run'], [game_exe], [
 	[game_exe, '--some-command-line-option']
 ]);
 
+maek.RULE([':bench'], [bench_exe], [
+	[bench_exe]
+]);
+
+//simulation-only timing run (no window/GL/audio device -- audio is mixed offline; reproducible for a given seed):
+maek.RULE([':headless'], [game_exe], [
+	[game_exe, '--headless', '12000', '--seed', '1']
+]);
+
+//thread scaling of the physics step: thousands of vehicles at 1 .. 8 threads (fails if the final states differ):
+maek.RULE([':headless-threads'], [game_exe], [
+	[game_exe, '--headless', '1200', '--seed', '1', '--vehicles', '4096', '--threads', '8']
+]);
+
+//offline mixer run (no audio device): renders a scripted sequence of sounds and prints mix timings:
+maek.RULE([':render-audio'], [game_exe], [
+	[game_exe, '--render-audio', 'render-audio.wav']
+]);
+
 //Note that tasks that produce ':abstract targets' are never cached.
 // This is similar to how .PHONY targets behave in make.
 
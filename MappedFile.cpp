@@ -0,0 +1,87 @@
+#include "MappedFile.hpp"
+
+#include <stdexcept>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#endif
+
+#if defined(_WIN32)
+
+MappedFile::MappedFile(std::string const &filename_) : filename(filename_) {
+	HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (file == INVALID_HANDLE_VALUE) {
+		throw std::runtime_error("Failed to open '" + filename + "' for mapping (error " + std::to_string(GetLastError()) + ").");
+	}
+
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(file, &file_size)) {
+		CloseHandle(file);
+		throw std::runtime_error("Failed to get size of '" + filename + "' (error " + std::to_string(GetLastError()) + ").");
+	}
+	size = size_t(file_size.QuadPart);
+
+	if (size != 0) { //(can't map an empty file)
+		HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mapping == NULL) {
+			CloseHandle(file);
+			throw std::runtime_error("Failed to create mapping of '" + filename + "' (error " + std::to_string(GetLastError()) + ").");
+		}
+		data = reinterpret_cast< uint8_t const * >(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+		//the view keeps the mapping (and file) alive, so the handles can be closed right away:
+		CloseHandle(mapping);
+		if (!data) {
+			CloseHandle(file);
+			throw std::runtime_error("Failed to map '" + filename + "' (error " + std::to_string(GetLastError()) + ").");
+		}
+	}
+	CloseHandle(file);
+}
+
+MappedFile::~MappedFile() {
+	if (data) UnmapViewOfFile(data);
+}
+
+#else
+
+MappedFile::MappedFile(std::string const &filename_) : filename(filename_) {
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd == -1) {
+		throw std::runtime_error("Failed to open '" + filename + "' for mapping: " + std::strerror(errno));
+	}
+
+	struct stat info;
+	if (fstat(fd, &info) != 0) {
+		int err = errno;
+		close(fd);
+		throw std::runtime_error("Failed to get size of '" + filename + "': " + std::strerror(err));
+	}
+	size = size_t(info.st_size);
+
+	if (size != 0) { //(can't map an empty file)
+		void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (mapped == MAP_FAILED) {
+			int err = errno;
+			close(fd);
+			throw std::runtime_error("Failed to map '" + filename + "': " + std::strerror(err));
+		}
+		//files are generally parsed front-to-back:
+		posix_madvise(mapped, size, POSIX_MADV_SEQUENTIAL);
+		data = reinterpret_cast< uint8_t const * >(mapped);
+	}
+	//the mapping stays valid after the descriptor is closed:
+	close(fd);
+}
+
+MappedFile::~MappedFile() {
+	if (data) munmap(const_cast< uint8_t * >(data), size);
+}
+
+#endif
@@ -0,0 +1,28 @@
+#pragma once
+
+/*
+ * MappedFile maps an entire file read-only into memory, so large assets can be
+ *  parsed in place instead of being copied through a stream.
+ *
+ * The mapping lives as long as the MappedFile; pair it with a ChunkReader
+ *  (read_write_chunk.hpp) to get typed views of chunk data.
+ *
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+struct MappedFile {
+	//map a file:
+	// note: will throw if the file can't be opened or mapped.
+	MappedFile(std::string const &filename);
+	~MappedFile();
+
+	MappedFile(MappedFile const &) = delete;
+	MappedFile &operator=(MappedFile const &) = delete;
+
+	std::string filename;
+	uint8_t const *data = nullptr; //(nullptr for an empty file)
+	size_t size = 0;
+};
@@ -1,20 +1,20 @@
 #include "Mesh.hpp"
 #include "read_write_chunk.hpp"
+#include "MappedFile.hpp"
 
 #include <glm/glm.hpp>
 
 #include <stdexcept>
-#include <fstream>
 #include <iostream>
 #include <vector>
 #include <string>
 #include <set>
+#include <algorithm>
 #include <cstddef>
 
-MeshBuffer::MeshBuffer(std::string const &filename) {
-	glGenBuffers(1, &buffer);
-
-	std::ifstream file(filename, std::ios::binary);
+MeshBuffer::MeshBuffer(std::string const &filename, Upload upload_) {
+	//chunks are read in place from the mapped file (no copies for aligned data):
+	ChunkReader file(std::make_shared< MappedFile const >(filename));
 
 	GLuint total = 0;
 
@@ -25,18 +25,18 @@ MeshBuffer::MeshBuffer(std::string const &filename) {
 		glm::vec2 TexCoord;
 	};
 	static_assert(sizeof(Vertex) == 3*4+3*4+4*1+2*4, "Vertex is packed.");
-	std::vector< Vertex > data;
+	Span< Vertex > data;
 
-	//read + upload data chunk:
+	//read data chunk:
 	if (filename.size() >= 5 && filename.substr(filename.size()-5) == ".pnct") {
-		read_chunk(file, "pnct", &data);
+		data = file.read< Vertex >("pnct");
 
-		//upload data:
-		glBindBuffer(GL_ARRAY_BUFFER, buffer);
-		glBufferData(GL_ARRAY_BUFFER, data.size() * sizeof(Vertex), data.data(), GL_STATIC_DRAW);
-		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		//keep data (and the mapping) around for upload:
+		pending.data = reinterpret_cast< uint8_t const * >(data.data);
+		pending.size = data.size * sizeof(Vertex);
+		pending.storage = data.storage;
 
-		total = GLuint(data.size()); //store total for later checks on index
+		total = GLuint(data.size); //store total for later checks on index
 
 		//store attrib locations:
 		Position = Attrib(3, GL_FLOAT, GL_FALSE, sizeof(Vertex), offsetof(Vertex, Position));
@@ -47,8 +47,7 @@ MeshBuffer::MeshBuffer(std::string const &filename) {
 		throw std::runtime_error("Unknown file type '" + filename + "'");
 	}
 
-	std::vector< char > strings;
-	read_chunk(file, "str0", &strings);
+	Span< char > strings = file.read< char >("str0");
 
 	{ //read index chunk, add to meshes:
 		struct IndexEntry {
@@ -57,17 +56,16 @@ MeshBuffer::MeshBuffer(std::string const &filename) {
 		};
 		static_assert(sizeof(IndexEntry) == 16, "Index entry should be packed");
 
-		std::vector< IndexEntry > index;
-		read_chunk(file, "idx0", &index);
+		Span< IndexEntry > index = file.read< IndexEntry >("idx0");
 
 		for (auto const &entry : index) {
-			if (!(entry.name_begin <= entry.name_end && entry.name_end <= strings.size())) {
+			if (!(entry.name_begin <= entry.name_end && entry.name_end <= strings.size)) {
 				throw std::runtime_error("index entry has out-of-range name begin/end");
 			}
 			if (!(entry.vertex_begin <= entry.vertex_end && entry.vertex_end <= total)) {
 				throw std::runtime_error("index entry has out-of-range vertex start/count");
 			}
-			std::string name(&strings[0] + entry.name_begin, &strings[0] + entry.name_end);
+			std::string name(strings.begin() + entry.name_begin, strings.begin() + entry.name_end);
 			Mesh mesh;
 			mesh.type = GL_TRIANGLES;
 			mesh.start = entry.vertex_begin;
@@ -83,10 +81,12 @@ MeshBuffer::MeshBuffer(std::string const &filename) {
 		}
 	}
 
-	if (file.peek() != EOF) {
+	if (file.remaining() != 0) {
 		std::cerr << "WARNING: trailing data in mesh file '" << filename << "'" << std::endl;
 	}
 
+	if (upload_ == UploadNow) upload();
+
 	/* //DEBUG:
 	std::cout << "File '" << filename << "' contained meshes";
 	for (auto const &m : meshes) {
@@ -98,6 +98,17 @@ MeshBuffer::MeshBuffer(std::string const &filename) {
 	*/
 }
 
+void MeshBuffer::upload() {
+	if (buffer == 0) glGenBuffers(1, &buffer);
+
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
+	glBufferData(GL_ARRAY_BUFFER, pending.size, pending.data, GL_STATIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	//release the mapping:
+	pending = Span< uint8_t >();
+}
+
 const Mesh &MeshBuffer::lookup(std::string const &name) const {
 	auto f = meshes.find(name);
 	if (f == meshes.end()) {
@@ -106,7 +117,7 @@ const Mesh &MeshBuffer::lookup(std::string const &name) const {
 	return f->second;
 }
 
-GLuint MeshBuffer::make_vao_for_program(GLuint program) const {
+GLuint MeshBuffer::make_vao_for_program(GLuint program, std::vector< std::string > const &bound_elsewhere) const {
 	//create a new vertex array object:
 	GLuint vao = 0;
 	glGenVertexArrays(1, &vao);
@@ -140,6 +151,7 @@ GLuint MeshBuffer::make_vao_for_program(GLuint program) const {
 		GLenum type = 0;
 		glGetActiveAttrib(program, i, 100, NULL, &size, &type, name);
 		name[99] = '\0';
+		if (std::find(bound_elsewhere.begin(), bound_elsewhere.end(), std::string(name)) != bound_elsewhere.end()) continue;
 		GLint location = glGetAttribLocation(program, name);
 		if (!bound.count(GLuint(location))) {
 			throw std::runtime_error("ERROR: active attribute '" + std::string(name) + "' in program is not bound.");
@@ -10,10 +10,12 @@
  */
 
 #include "GL.hpp"
+#include "read_write_chunk.hpp"
 #include <glm/glm.hpp>
 #include <map>
 #include <limits>
 #include <string>
+#include <vector>
 
 
 struct Mesh {
@@ -32,7 +34,13 @@ struct Mesh {
 struct MeshBuffer {
 	//construct from a file:
 	// note: will throw if file fails to read.
-	MeshBuffer(std::string const &filename);
+	// note: with DeferUpload, the constructor makes no OpenGL calls (so it can run on a
+	//  loading thread), and upload() must be called on the GL thread before drawing.
+	enum Upload { UploadNow, DeferUpload };
+	MeshBuffer(std::string const &filename, Upload upload = UploadNow);
+
+	//copy vertex data read by the constructor into 'buffer':
+	void upload();
 
 	//look up a particular mesh by name:
 	// note: will throw if mesh not found.
@@ -40,7 +48,8 @@ struct MeshBuffer {
 	
 	//build a vertex array object that links this vbo to attributes to a program:
 	// note: will throw if program defines attributes not contained in this buffer
-	GLuint make_vao_for_program(GLuint program) const;
+	//  (other than those named in 'bound_elsewhere', e.g., per-instance attributes the caller binds itself)
+	GLuint make_vao_for_program(GLuint program, std::vector< std::string > const &bound_elsewhere = {}) const;
 
 	//This is the OpenGL vertex buffer object containing the mesh data:
 	GLuint buffer = 0;
@@ -50,6 +59,9 @@ struct MeshBuffer {
 	//used by the lookup() function:
 	std::map< std::string, Mesh > meshes;
 
+	//vertex data waiting for upload(), viewed directly in the mapped file (empty once uploaded):
+	Span< uint8_t > pending;
+
 	//These 'Attrib' structures describe the location of various attributes within the buffer (in exactly format wanted by glVertexAttribPointer). They are set when the file is loaded and are used by the "make_vao_for_program" call:
 	struct Attrib {
 		GLint size = 0;
@@ -0,0 +1,179 @@
+#include "OpusStream.hpp"
+
+#include <opusfile.h>
+
+#include <algorithm>
+#include <cassert>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
+OpusStream::OpusStream(std::string const &filename_) : filename(filename_) {
+	int err = 0;
+	file = op_open_file(filename.c_str(), &err);
+	if (err != 0 || !file) {
+		throw std::runtime_error("opusfile error " + std::to_string(err) + " opening \"" + filename + "\" for streaming.");
+	}
+
+	ogg_int64_t total = op_pcm_total(file, -1);
+	if (total >= 0) {
+		length = uint64_t(total);
+	} else {
+		std::cerr << "WARNING: cannot determine length of '" << filename << "'; seeking will not wrap." << std::endl;
+	}
+
+	thread = std::thread(&OpusStream::decode_loop, this);
+}
+
+OpusStream::~OpusStream() {
+	{
+		std::unique_lock< std::mutex > lock(wake_mutex);
+		quit.store(true, std::memory_order_relaxed);
+	}
+	wake.notify_one();
+	if (thread.joinable()) thread.join();
+	op_free(file);
+	file = nullptr;
+}
+
+void OpusStream::start(bool loop_) {
+	loop.store(loop_, std::memory_order_release);
+	//the stream is prefilled from the beginning, so only restart if that data is no longer usable:
+	if (consumed || ended || (loop_ && reached_end.load(std::memory_order_acquire))) {
+		restart(0);
+	}
+}
+
+void OpusStream::seek(uint64_t frame) {
+	restart(frame);
+}
+
+void OpusStream::restart(uint64_t frame) {
+	seek_frame.store(frame, std::memory_order_relaxed);
+	mixer_epoch += 1;
+	epoch.store(mixer_epoch, std::memory_order_release);
+	has_current = false;
+	consumed = false;
+	ended = false;
+	wake_decoder();
+}
+
+void OpusStream::wake_decoder() {
+	//the decoder checks for work while holding wake_mutex, so a notify sent during that check could be missed;
+	// holding the mutex (even briefly) rules that out, but the mixer can't wait for it -- so if it's busy, try again later:
+	if (wake_mutex.try_lock()) {
+		wake_mutex.unlock();
+		wake_pending = false;
+		wake.notify_one();
+	} else {
+		wake_pending = true;
+	}
+}
+
+uint32_t OpusStream::read(float *out, uint32_t count, bool wait) {
+	if (wake_pending) wake_decoder();
+
+	uint32_t copied = 0;
+	bool popped = false;
+	while (copied < count && !ended) {
+		if (!has_current) {
+			if (!blocks.pop(&current)) {
+				if (!wait) break; //decoder has fallen behind
+				std::unique_lock< std::mutex > lock(wake_mutex);
+				wake.notify_one(); //(with the mutex held, so this can't be missed)
+				filled.wait(lock, [this](){ return !blocks.empty(); });
+				continue;
+			}
+			popped = true;
+			if (current.epoch != mixer_epoch) continue; //decoded before the latest restart; discard
+			has_current = true;
+			current_offset = 0;
+		}
+		uint32_t n = std::min(count - copied, current.count - current_offset);
+		std::copy(current.data + current_offset, current.data + current_offset + n, out + copied);
+		copied += n;
+		current_offset += n;
+		consumed = true;
+		if (current_offset == current.count) {
+			has_current = false;
+			if (current.last) ended = true;
+		}
+	}
+	//there's room in the ring for the decoder to fill:
+	if (popped) wake_decoder();
+	return copied;
+}
+
+void OpusStream::decode_loop() {
+	uint32_t decode_epoch = epoch.load(std::memory_order_acquire);
+	bool at_end = false;
+
+	std::vector< float > pcm(2 * BlockFrames, 0.0f); //stereo, as returned by op_read_float_stereo
+	Block block;
+	block.epoch = decode_epoch;
+
+	while (!quit.load(std::memory_order_relaxed)) {
+		//handle restart requests from the mixer:
+		uint32_t requested_epoch = epoch.load(std::memory_order_acquire);
+		if (requested_epoch != decode_epoch) {
+			decode_epoch = requested_epoch;
+			uint64_t frame = seek_frame.load(std::memory_order_relaxed);
+			if (length != 0) frame %= length;
+			int ret = op_pcm_seek(file, ogg_int64_t(frame));
+			if (ret != 0) {
+				std::cerr << "WARNING: opusfile error " << ret << " seeking in '" << filename << "'." << std::endl;
+			}
+			at_end = false;
+			reached_end.store(false, std::memory_order_release);
+			block.epoch = decode_epoch;
+			block.count = 0;
+			block.last = false;
+		}
+
+		//nothing to do until the mixer consumes a block (or asks for a restart):
+		if (at_end || blocks.size() >= BlockCount) {
+			std::unique_lock< std::mutex > lock(wake_mutex);
+			wake.wait(lock, [&](){
+				return quit.load(std::memory_order_relaxed)
+					|| epoch.load(std::memory_order_acquire) != decode_epoch
+					|| (!at_end && blocks.size() < BlockCount);
+			});
+			continue;
+		}
+
+		int ret = op_read_float_stereo(file, pcm.data(), int(2 * (BlockFrames - block.count)));
+		if (ret > 0) {
+			//positive return values are the number of samples read per channel; downmix to mono by averaging:
+			for (uint32_t i = 0; i < uint32_t(ret); ++i) {
+				block.data[block.count + i] = (pcm[2*i] + pcm[2*i+1]) * 0.5f;
+			}
+			block.count += uint32_t(ret);
+		} else if (ret == 0) {
+			//end of file:
+			if (loop.load(std::memory_order_acquire)) {
+				op_pcm_seek(file, 0);
+				continue;
+			}
+			block.last = true;
+			at_end = true;
+		} else {
+			std::cerr << "WARNING: opusfile read error " << ret << " streaming '" << filename << "'; stopping." << std::endl;
+			block.last = true;
+			at_end = true;
+		}
+
+		if (block.count == BlockFrames || block.last) {
+			//(only this thread adds blocks, and there was room above, so this can't fail)
+			bool pushed = blocks.push(std::move(block));
+			assert(pushed);
+			(void)pushed;
+			if (at_end) reached_end.store(true, std::memory_order_release);
+			block.count = 0;
+			block.last = false;
+			{ //(an offline read() may be waiting for this block)
+				std::unique_lock< std::mutex > lock(wake_mutex);
+				filled.notify_one();
+			}
+		}
+	}
+}
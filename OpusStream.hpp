@@ -0,0 +1,87 @@
+#pragma once
+
+/*
+ * OpusStream decodes an '.opus' file incrementally on a background thread, so long
+ *  tracks (e.g. music) don't need to be decoded into memory up front.
+ *
+ * Decoded audio (48kHz, mono, floating-point) is handed to the audio mixer through a
+ *  small ring of fixed-size blocks; memory use is constant regardless of track length.
+ *
+ * Threading:
+ *  - the constructor/destructor run on the loading thread;
+ *  - start(), seek(), and read() are for the mixer (they never block or allocate,
+ *    except for read() with 'wait' set, which is meant for offline mixing);
+ *  - everything else happens on the decoding thread, which sleeps while the ring is full.
+ *
+ */
+
+#include "spsc_ring.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+
+struct OggOpusFile;
+
+struct OpusStream {
+	//opens the file (throws on error) and starts decoding from the beginning:
+	OpusStream(std::string const &filename);
+	~OpusStream();
+
+	OpusStream(OpusStream const &) = delete;
+	OpusStream &operator=(OpusStream const &) = delete;
+
+	//(mixer) prepare for a voice to start playing from the beginning:
+	void start(bool loop);
+	//(mixer) continue playback from 'frame' (wrapped to the track length):
+	void seek(uint64_t frame);
+	//(mixer) copy up to 'count' frames into 'out'; returns the number of frames copied.
+	// fewer than 'count' frames means either the decoder fell behind or the (non-looping) stream ended.
+	// with 'wait' set, waits for the decoder rather than falling behind, so output doesn't depend on timing:
+	uint32_t read(float *out, uint32_t count, bool wait = false);
+	//(mixer) has a non-looping stream played all of its data?
+	bool finished() const { return ended; }
+
+	std::string filename;
+	uint64_t length = 0; //in frames (0 if unknown)
+
+	//--- internals ---
+	enum : uint32_t { BlockFrames = 1024, BlockCount = 16 }; //~340ms of buffered audio
+	struct Block {
+		uint32_t epoch = 0; //blocks decoded before the most recent start()/seek() are discarded
+		uint32_t count = 0; //number of valid frames in 'data'
+		bool last = false; //final block of a non-looping stream
+		float data[BlockFrames];
+	};
+	SPSCRing< Block, BlockCount > blocks;
+
+	//requests from the mixer to the decoder:
+	std::atomic< uint32_t > epoch{0}; //bumped on every restart
+	std::atomic< uint64_t > seek_frame{0}; //where to restart decoding
+	std::atomic< bool > loop{false}; //should decoding wrap around at the end of the file?
+	std::atomic< bool > reached_end{false}; //(decoder) stopped at the end of a non-looping stream
+	std::atomic< bool > quit{false}; //(destructor) stop decoding thread
+
+	//the decoder sleeps on 'wake' when it has nothing to do; read(..., true) sleeps on 'filled' until a block arrives:
+	std::mutex wake_mutex;
+	std::condition_variable wake;
+	std::condition_variable filled;
+
+	//mixer-side state:
+	uint32_t mixer_epoch = 0;
+	Block current; //block currently being read
+	uint32_t current_offset = 0; //frames of 'current' already read
+	bool has_current = false;
+	bool consumed = false; //has any data been read since the last restart?
+	bool ended = false;
+	bool wake_pending = false; //last wake_decoder() couldn't be delivered, so retry on the next read()
+
+	OggOpusFile *file = nullptr;
+	std::thread thread;
+	void decode_loop(); //(decoder thread)
+	void restart(uint64_t frame); //(mixer)
+	void wake_decoder(); //(mixer) without blocking
+};
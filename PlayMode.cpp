@@ -5,6 +5,7 @@
 #include "DrawLines.hpp"
 #include "Load.hpp"
 #include "Mesh.hpp"
+#include "Profiler.hpp"
 #include "data_path.hpp"
 #include "gl_errors.hpp"
 
@@ -13,47 +14,54 @@
 #include <glm/gtx/string_cast.hpp>
 
 #include <algorithm>
+#include <chrono>
+#include <cmath>
 #include <random>
 
 GLuint program = 0;
-Load<MeshBuffer> load_meshes(LoadTagDefault, []() -> MeshBuffer const* {
-    MeshBuffer const* ret = new MeshBuffer(data_path("world.pnct"));
-    program = ret->make_vao_for_program(lit_color_texture_program->program);
-    return ret;
-});
+GLuint instanced_vao = 0; // same meshes, bound for lit_color_texture_instanced_program
+Load<MeshBuffer> load_meshes(LoadTagDefault, LoadInBackground, []() -> MeshBuffer* {
+    return new MeshBuffer(data_path("world.pnct"), MeshBuffer::DeferUpload);
+}, [](MeshBuffer& meshes) {
+    meshes.upload();
+    program = meshes.make_vao_for_program(lit_color_texture_program->program);
+    instanced_vao = lit_color_texture_instanced_program->make_vao(meshes);
+}, "world.pnct");
 
 // define static variable
 std::unordered_map<std::string, const Mesh*> Scene::all_meshes = {};
 
-Load<Scene> load_scene(LoadTagDefault, []() -> Scene const* {
+// (uses load_meshes, so must come in a later tag)
+Load<Scene> load_scene(LoadTagLate, LoadInBackground, []() -> Scene* {
     return new Scene(data_path("world.scene"), [&](Scene& scene, Scene::Transform* transform, std::string const& mesh_name) {
         Mesh const& mesh = load_meshes->lookup(mesh_name);
 
         // assign this mesh to the corresponding scene transform
-        Scene::all_meshes[transform->name] = &mesh;
+        Scene::all_meshes[scene.transforms.name(*transform)] = &mesh;
 
         scene.drawables.emplace_back(transform);
         Scene::Drawable& drawable = scene.drawables.back();
 
-        drawable.pipeline = lit_color_texture_program_pipeline;
+        // (many transforms share a mesh, so draw them as instanced batches)
+        drawable.pipeline = lit_color_texture_instanced_program_pipeline;
 
-        drawable.pipeline.vao = program;
-        drawable.pipeline.type = mesh.type;
-        drawable.pipeline.start = mesh.start;
-        drawable.pipeline.count = mesh.count;
+        drawable.pipeline.vao = instanced_vao;
+        drawable.set_mesh(mesh);
     });
-});
+}, nullptr, "world.scene");
 
-Load<Sound::Sample> bow_sample(LoadTagDefault, []() -> Sound::Sample const* {
+Load<Sound::Sample> bow_sample(LoadTagDefault, LoadInBackground, []() -> Sound::Sample* {
     return new Sound::Sample(data_path("pew.opus"));
-});
+}, nullptr, "pew.opus");
 
-Load<Sound::Sample> pew_sample(LoadTagDefault, []() -> Sound::Sample const* {
+Load<Sound::Sample> pew_sample(LoadTagDefault, LoadInBackground, []() -> Sound::Sample* {
     return new Sound::Sample(data_path("bow.opus"));
-});
+}, nullptr, "bow.opus");
 
-PlayMode::PlayMode()
+PlayMode::PlayMode(uint32_t seed_, uint32_t vehicle_count, uint32_t thread_count)
     : scene(*load_scene)
+    , seed(seed_)
+    , rng(seed_)
 {
 
     std::vector<std::string> vehicle_names = {
@@ -76,18 +84,28 @@ PlayMode::PlayMode()
         "car.016",
         /// TODO: add cars in code, not model
     };
-    std::random_device rd;
-    std::mt19937 rng(rd());
     std::shuffle(std::begin(vehicle_names), std::end(vehicle_names), rng);
 
     // make is so the target is always the previous guy
     for (const std::string& name : vehicle_names) {
         FourWheeledVehicle* FWV = new FourWheeledVehicle(name);
         FWV->initialize_from_scene(scene);
+        FWV->attach(vehicles);
+        FWV->rng.seed(rng());
         vehicle_map.push_back(FWV);
         // the first vehicle will be the target
     }
 
+    if (vehicle_count > vehicle_map.size()) {
+        add_vehicle_copies(vehicle_count - uint32_t(vehicle_map.size()));
+    }
+
+    // (the scene's own 17 cars don't fill a single job, so by default they are stepped without any worker threads)
+    if (thread_count == 0) {
+        thread_count = std::min(JobSystem::default_worker_count() + 1, std::max(1u, uint32_t(vehicle_map.size()) / VehicleGrain));
+    }
+    jobs = std::make_unique<JobSystem>(thread_count - 1);
+
     target = vehicle_map[0];
     // std::cout << "Determined target to be \"" << target->name << "\"" << std::endl;
 
@@ -101,6 +119,69 @@ PlayMode::~PlayMode()
 {
 }
 
+void PlayMode::add_vehicle_copies(uint32_t count)
+{
+    const uint32_t originals = uint32_t(vehicle_map.size());
+    const uint32_t scene_transforms = uint32_t(scene.transforms.size());
+    std::vector<Scene::Drawable const*> scene_drawables;
+    for (Scene::Drawable const& drawable : scene.drawables) {
+        scene_drawables.push_back(&drawable);
+    }
+
+    glm::vec3 center = glm::vec3(0.0f);
+    for (FourWheeledVehicle const* FWV : vehicle_map) {
+        center += FWV->pos / float(originals);
+    }
+    const float Spacing = 8.0f; // meters between copies
+    const uint32_t side = uint32_t(std::ceil(std::sqrt(float(count))));
+    std::uniform_real_distribution<float> random_yaw(-float(M_PI), float(M_PI));
+
+    std::vector<uint32_t> copy_index(scene_transforms); // copy of each scene transform (or -1U if not copied)
+    for (uint32_t c = 0; c < count; ++c) {
+        FourWheeledVehicle const& source = *vehicle_map[c % originals];
+        const std::string tag = ".copy" + std::to_string(c);
+
+        // copy the source's subtree (parents come before children, so one pass in index order finds it all):
+        std::fill(copy_index.begin(), copy_index.end(), -1U);
+        const uint32_t root = source.all->index;
+        for (uint32_t i = root; i < scene_transforms; ++i) {
+            Scene::Transform const& transform = scene.transforms[i];
+            const bool in_subtree = (i == root)
+                || (transform.parent_index != Scene::Transform::NoParent && copy_index[transform.parent_index] != -1U);
+            if (!in_subtree) {
+                continue;
+            }
+            Scene::Transform& copy = scene.transforms.emplace_back();
+            copy.position = transform.position;
+            copy.rotation = transform.rotation;
+            copy.scale = transform.scale;
+            copy.parent_index = (i == root ? transform.parent_index : copy_index[transform.parent_index]);
+            scene.transforms.names[copy.index] = scene.transforms.names[i] + tag;
+            copy_index[i] = copy.index;
+        }
+        for (Scene::Drawable const* drawable : scene_drawables) {
+            if (copy_index[drawable->transform->index] != -1U) {
+                scene.drawables.emplace_back(*drawable);
+                scene.drawables.back().transform = &scene.transforms[copy_index[drawable->transform->index]];
+            }
+        }
+
+        // place it on the grid, facing a random direction:
+        Scene::Transform& all = scene.transforms[copy_index[root]];
+        all.position = center + Spacing * glm::vec3(float(c % side) - 0.5f * float(side - 1), float(c / side) - 0.5f * float(side - 1), 0.0f);
+        all.position.z = source.all->position.z;
+        all.rotation = glm::angleAxis(random_yaw(rng), glm::vec3(0.0f, 0.0f, 1.0f));
+
+        FourWheeledVehicle* FWV = new FourWheeledVehicle(source.name + tag);
+        FWV->initialize_as_copy(source, [&](Scene::Transform const* transform) {
+            return &scene.transforms[copy_index[transform->index]];
+        });
+        FWV->attach(vehicles);
+        FWV->rng.seed(rng());
+        vehicle_map.push_back(FWV);
+    }
+}
+
 bool PlayMode::handle_event(SDL_Event const& evt, glm::uvec2 const& window_size)
 {
 
@@ -169,9 +250,12 @@ void PlayMode::check_if_clicked(const glm::vec2& mouse_rel)
     // std::cout << "(" << m.x << " x " << m.y << ")" << std::endl;
     // create vector from camera to point
     glm::vec3 ray = glm::vec3(0, 0, 0);
+    glm::vec3 ray_origin = glm::vec3(0, 0, 0);
     {
-        // update listener to camera position:
-        glm::mat4x3 frame = camera->transform->make_local_to_parent();
+        // camera frame in world space (from the scene's cached world matrices):
+        scene.update_world_matrices();
+        glm::mat4x3 const& frame = camera->transform->get_local_to_world();
+        ray_origin = frame[3];
         glm::vec3 cam_right = frame[0];
         glm::vec3 cam_up = frame[1];
         glm::vec3 cam_forward = -frame[2];
@@ -182,9 +266,24 @@ void PlayMode::check_if_clicked(const glm::vec2& mouse_rel)
         ray = cam_forward + cam_right * dX + cam_up * dY;
     }
 
-    // process ray-box intersection
+    // find the nearest thing under the cursor (via the scene's BVH):
+    Scene::RayHit hit;
+    if (!scene.ray_cast(ray_origin, ray, &hit)) {
+        return;
+    }
+
+    // ..and the vehicle (if any) that it is part of:
+    auto is_part_of = [this](Scene::Transform const* t, FourWheeledVehicle const* FWV) {
+        for (; t != nullptr; t = scene.transforms.parent(*t)) {
+            if (t == FWV->all || t == FWV->chassis || t == FWV->wheel_FL || t == FWV->wheel_FR
+                || t == FWV->wheel_BL || t == FWV->wheel_BR) {
+                return true;
+            }
+        }
+        return false;
+    };
     for (FourWheeledVehicle* FWV : vehicle_map) {
-        FWV->bounds.collided = FWV->bounds.intersects(camera->transform->position, ray);
+        FWV->bounds.collided = is_part_of(hit.transform, FWV);
         if (FWV->bounds.collided) {
             FWV->die();
             if (FWV == target) {
@@ -207,35 +306,23 @@ void PlayMode::update(float elapsed)
     //     win = true;
     // }
 
-    // update all the vehicles
-    for (FourWheeledVehicle* FWV : vehicle_map) {
-        if (!FWV->bIsPlayer) {
-            FWV->think(elapsed, vehicle_map); // determine target & controls
-        }
-        FWV->update(elapsed);
-        // check collisions
-        // FWV->bounds.collided = false; // no need bc ray-box intersection
-        // glm::vec3 heading = FWV->get_heading();
-        for (FourWheeledVehicle* otherFWV : vehicle_map) {
-            bool was_collision = (FWV->bounds.collides_with(otherFWV->bounds) || otherFWV->bounds.collides_with(FWV->bounds));
-            if (otherFWV != FWV && was_collision) {
-                // FWV->bounds.collided = true;
-
-                glm::vec3 dir = FWV->pos - otherFWV->pos;
-                FWV->collision_force = 0.5f * dir / elapsed;
-                const float volume = 10.f;
-                const float radius = 0.1f;
-                if (FWV == target) {
-                    sound = Sound::play_3D(*bow_sample, volume, target->pos, radius);
-                } else {
-                    sound = Sound::play_3D(*pew_sample, volume, target->pos, radius);
-                }
-                sound->set_position(FWV->pos, 1.0f / 60.0f);
-                break;
-            }
-        }
+    // run as many fixed physics steps as the elapsed time covers (but no more than MaxPhysicsSteps,
+    // so a slow frame can't snowball into ever-slower frames):
+    physics_accumulator += elapsed;
+    uint32_t steps = 0;
+    while (physics_accumulator >= PhysicsStep && steps < MaxPhysicsSteps) {
+        step_physics(PhysicsStep);
+        physics_accumulator -= PhysicsStep;
+        ++steps;
+    }
+    if (steps == MaxPhysicsSteps) {
+        // fell behind; drop the backlog rather than trying to catch up later
+        physics_accumulator = std::min(physics_accumulator, PhysicsStep);
     }
 
+    // (before disabled vehicles are removed, so a vehicle's last collision is still heard)
+    play_collision_cues();
+
     {
         // delete all disabled vehicles
         std::vector<FourWheeledVehicle*> alive_vehicles = {};
@@ -246,12 +333,21 @@ void PlayMode::update(float elapsed)
                 /// TODO: figure out a better/proper way to destroy
                 // move it to under the screen so it is invis
                 FWV->all->position = glm::vec3(0, 0, -100);
+                vehicles.active[FWV->slot] = 0;
             }
         }
 
         vehicle_map = std::move(alive_vehicles);
     }
 
+    // place vehicles between their last two physics states, so motion is smooth at any frame rate:
+    {
+        const float alpha = physics_accumulator / PhysicsStep;
+        for (FourWheeledVehicle* FWV : vehicle_map) {
+            FWV->apply_render_state(alpha);
+        }
+    }
+
     {
         // std::cout << Player->steer << std::endl;
 
@@ -287,17 +383,127 @@ void PlayMode::update(float elapsed)
     down.downs = 0;
 }
 
+void PlayMode::step_physics(float dt)
+{
+    PROFILE_ZONE("step_physics");
+    // each phase below is spread across cores; vehicles only write their own state within a phase,
+    // and anything order-dependent is merged serially afterwards, so results don't depend on thread count
+    const uint32_t count = uint32_t(vehicle_map.size());
+
+    // (per-phase timing, reported by headless runs)
+    auto phase_start = std::chrono::steady_clock::now();
+    auto end_phase = [&phase_start](double& total) {
+        auto now = std::chrono::steady_clock::now();
+        total += std::chrono::duration<double>(now - phase_start).count();
+        phase_start = now;
+    };
+
+    // update all the vehicles
+    // (think() reads other vehicles' positions from the last step, which nobody writes in this phase)
+    jobs->parallel_for(count, VehicleGrain, [&](uint32_t begin, uint32_t end) {
+        PROFILE_ZONE("ai");
+        for (uint32_t i = begin; i < end; ++i) {
+            FourWheeledVehicle* FWV = vehicle_map[i];
+            if (!FWV->bIsPlayer) {
+                FWV->think(dt, vehicle_map, FWV->rng); // determine target & controls
+            }
+            FWV->write_controls(vehicles);
+        }
+    });
+    end_phase(step_timings.ai);
+    jobs->parallel_for(uint32_t(vehicles.size()), StepGrain, [&](uint32_t begin, uint32_t end) {
+        PROFILE_ZONE("vehicles");
+        vehicles.step(dt, begin, end);
+    });
+    broad_boxes.resize(count);
+    jobs->parallel_for(count, VehicleGrain, [&](uint32_t begin, uint32_t end) {
+        for (uint32_t i = begin; i < end; ++i) {
+            vehicle_map[i]->read_state(vehicles);
+            vehicle_map[i]->bounds.get_broad_bounds(broad_boxes[i].min, broad_boxes[i].max);
+        }
+    });
+    end_phase(step_timings.physics);
+
+    // check collisions
+    // FWV->bounds.collided = false; // no need bc ray-box intersection
+    {
+        // broad phase: only pairs whose bounds overlap need the exact (SAT) test
+        auto const& pairs = broad_phase.update(broad_boxes);
+        pair_hits.assign(pairs.size(), 0);
+        jobs->parallel_for(uint32_t(pairs.size()), PairGrain, [&](uint32_t begin, uint32_t end) {
+            PROFILE_ZONE("collision pairs");
+            for (uint32_t p = begin; p < end; ++p) {
+                BBox const& a = vehicle_map[pairs[p].first]->bounds;
+                BBox const& b = vehicle_map[pairs[p].second]->bounds;
+                pair_hits[p] = a.overlaps(b);
+            }
+        });
+
+        // merge collision events in pair order:
+        first_collision.assign(count, -1U);
+        for (size_t p = 0; p < pairs.size(); ++p) {
+            if (!pair_hits[p]) {
+                continue;
+            }
+            // (each vehicle reacts to its lowest-indexed partner, as the old first-match loop did)
+            first_collision[pairs[p].first] = std::min(first_collision[pairs[p].first], pairs[p].second);
+            first_collision[pairs[p].second] = std::min(first_collision[pairs[p].second], pairs[p].first);
+        }
+    }
+    end_phase(step_timings.collision);
+    for (size_t i = 0; i < vehicle_map.size(); ++i) {
+        if (first_collision[i] == -1U) {
+            continue;
+        }
+        FourWheeledVehicle* FWV = vehicle_map[i];
+        FourWheeledVehicle* otherFWV = vehicle_map[first_collision[i]];
+        // FWV->bounds.collided = true;
+
+        // push apart at a fixed rate, so the response doesn't depend on the step length
+        glm::vec3 dir = FWV->pos - otherFWV->pos;
+        FWV->collision_force = CollisionPush * dir;
+        FWV->collided = true; // (the sound is played by play_collision_cues)
+    }
+    end_phase(step_timings.response);
+
+    physics_ticks += 1;
+}
+
+void PlayMode::play_collision_cues()
+{
+    for (FourWheeledVehicle* FWV : vehicle_map) {
+        if (!FWV->collided) {
+            continue;
+        }
+        FWV->collided = false;
+        const float volume = 10.f;
+        const float radius = 0.1f;
+        if (FWV == target) {
+            // the imposter's cue is the whole game, so never let it be culled first
+            const float priority = 4.f;
+            sound = Sound::play_3D(*bow_sample, volume, target->pos, radius, priority);
+        } else {
+            sound = Sound::play_3D(*pew_sample, volume, target->pos, radius);
+        }
+        sound.set_position(FWV->pos, 1.0f / 60.0f);
+    }
+}
+
 void PlayMode::draw(glm::uvec2 const& drawable_size)
 {
     // update camera aspect ratio for drawable:
     camera->aspect = float(drawable_size.x) / float(drawable_size.y);
 
-    // set up light type and position for lit_color_texture_program:
+    // set up light type and position for lit_color_texture_program (and its instanced variant):
     //  TODO: consider using the Light(s) in the scene to do this
     glUseProgram(lit_color_texture_program->program);
     glUniform1i(lit_color_texture_program->LIGHT_TYPE_int, 1);
     glUniform3fv(lit_color_texture_program->LIGHT_DIRECTION_vec3, 1, glm::value_ptr(glm::vec3(0.0f, 0.0f, -1.0f)));
     glUniform3fv(lit_color_texture_program->LIGHT_ENERGY_vec3, 1, glm::value_ptr(glm::vec3(1.0f, 1.0f, 0.95f)));
+    glUseProgram(lit_color_texture_instanced_program->program);
+    glUniform1i(lit_color_texture_instanced_program->LIGHT_TYPE_int, 1);
+    glUniform3fv(lit_color_texture_instanced_program->LIGHT_DIRECTION_vec3, 1, glm::value_ptr(glm::vec3(0.0f, 0.0f, -1.0f)));
+    glUniform3fv(lit_color_texture_instanced_program->LIGHT_ENERGY_vec3, 1, glm::value_ptr(glm::vec3(1.0f, 1.0f, 0.95f)));
     glUseProgram(0);
 
     glClearColor(0.5f, 0.5f, 0.5f, 1.0f);
@@ -352,7 +558,7 @@ void PlayMode::draw(glm::uvec2 const& drawable_size)
     // draw lines in 3D space
     if (false) {
         glDisable(GL_DEPTH_TEST);
-        glm::mat4 world_to_clip = camera->make_projection() * glm::mat4(camera->transform->make_world_to_local());
+        glm::mat4 world_to_clip = camera->make_projection() * glm::mat4(scene.transforms.make_world_to_local(*camera->transform));
 
         DrawLines lines(world_to_clip);
         for (FourWheeledVehicle* FWV : vehicle_map) {
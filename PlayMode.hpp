@@ -2,16 +2,24 @@
 
 #include "AssetMesh.hpp"
 #include "BBox.hpp"
+#include "BroadPhase.hpp"
+#include "JobSystem.hpp"
 #include "Scene.hpp"
 #include "Sound.hpp"
+#include "VehicleSystem.hpp"
 
 #include <glm/glm.hpp>
 
 #include <deque>
+#include <memory>
+#include <random>
 #include <vector>
 
 struct PlayMode : Mode {
-    PlayMode();
+    // all gameplay randomness comes from 'seed', so a given seed (and input) always plays out the same way
+    // vehicle_count: total vehicles; any beyond the scene's cars are copies of them (see add_vehicle_copies)
+    // thread_count: threads for the physics step (0: as many as the vehicle count can keep busy, up to one per core)
+    PlayMode(uint32_t seed = std::random_device()(), uint32_t vehicle_count = 0, uint32_t thread_count = 0);
     virtual ~PlayMode();
 
     // functions called by main loop:
@@ -30,17 +38,59 @@ struct PlayMode : Mode {
     void check_if_clicked(const glm::vec2& mouse);
 
     // music coming from the sound cue
-    std::shared_ptr<Sound::PlayingSample> sound;
+    Sound::PlayingSample sound;
 
     // local copy of the game scene (so code can change it during gameplay):
     Scene scene;
     bool game_over = false;
     bool win = true;
 
+    // gameplay randomness:
+    uint32_t seed;
+    std::mt19937 rng;
+
+    // physics runs in fixed steps, decoupled from the frame rate:
+    static constexpr float PhysicsStep = 1.0f / 120.0f; // seconds per step
+    static constexpr uint32_t MaxPhysicsSteps = 8; // per update(); any more time than that is dropped
+    static constexpr float CollisionPush = 30.0f; // colliding vehicles accelerate apart at this many (m/s^2) per meter between them
+    float physics_accumulator = 0.0f; // time not yet simulated (always < PhysicsStep after update())
+    uint32_t physics_ticks = 0; // steps taken so far
+    void step_physics(float dt);
+
+    // seconds spent in each phase of step_physics (summed over all steps):
+    struct StepTimings {
+        double ai = 0.0; // think() + handing controls to the vehicle system
+        double physics = 0.0; // vehicle system step + reading state back
+        double collision = 0.0; // broad + narrow phase
+        double response = 0.0; // collision response
+    } step_timings;
+
+    // play one collision cue for each vehicle that collided since the last call
+    // (called once per rendered frame, so catching up on physics steps doesn't pile up sounds)
+    void play_collision_cues();
+
+    // kinematics for all vehicles, stepped as a batch:
+    VehicleSystem vehicles;
+
+    // threads for the physics step (created once the vehicle count is known):
+    std::unique_ptr<JobSystem> jobs;
+    // jobs are sized so each is worth waking a thread for (a few tens of microseconds):
+    static constexpr uint32_t VehicleGrain = 256; // vehicles per job for think() and read_state()
+    static constexpr uint32_t StepGrain = 2048; // slots per job for VehicleSystem::step (a multiple of four; see step())
+    static constexpr uint32_t PairGrain = 256; // collision pairs per job
+
     // all the vehicles in the scene
     std::vector<FourWheeledVehicle*> vehicle_map;
+    // add 'count' copies of the scene's cars (transforms and drawables included), on a grid around them
+    void add_vehicle_copies(uint32_t count);
     FourWheeledVehicle* target = nullptr;
 
+    // vehicle-vehicle collision candidates (boxes are indexed like vehicle_map):
+    BroadPhase broad_phase;
+    std::vector<BroadPhase::Box> broad_boxes;
+    std::vector<uint8_t> pair_hits; // per broad-phase pair: did the exact test find a collision?
+    std::vector<uint32_t> first_collision; // per vehicle: lowest-indexed vehicle it collided with (or -1U)
+
     // camera:
     glm::vec2 move = glm::vec2(0, 0);
     float camera_arm_length = 25.f; // "distance" from camera to player
@@ -0,0 +1,280 @@
+#include "Profiler.hpp"
+
+#include "DrawLines.hpp"
+#include "spsc_ring.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace {
+	struct Event {
+		char const *name = nullptr;
+		uint64_t begin = 0; //ns since profiler start
+		uint64_t end = 0;
+		uint32_t thread = 0;
+		uint32_t depth = 0; //number of enclosing zones (on the same thread)
+	};
+
+	//each thread records into its own ring; only the main thread (in end_frame) reads them:
+	struct ThreadBuffer {
+		uint32_t index = 0; //used as the thread id in traces
+		std::atomic< bool > in_use{false}; //claimed by a running thread?
+		SPSCRing< Event, 4096 > events;
+	};
+
+	std::atomic< uint32_t > dropped{0}; //events lost because a thread's ring was full
+
+	std::mutex buffers_mutex; //guards 'buffers' (only locked on thread start/exit and in end_frame)
+	std::vector< std::unique_ptr< ThreadBuffer > > buffers;
+
+	//claims a buffer for the calling thread on first use; releases it (for reuse) when the thread exits:
+	struct ThreadState {
+		ThreadBuffer *buffer = nullptr;
+		uint32_t depth = 0;
+		ThreadState() {
+			std::unique_lock< std::mutex > lock(buffers_mutex);
+			for (auto &b : buffers) {
+				if (!b->in_use.load(std::memory_order_acquire)) { //(pairs with the release on exit, so the old owner's pushes are visible)
+					buffer = b.get();
+					break;
+				}
+			}
+			if (!buffer) {
+				buffers.emplace_back(std::make_unique< ThreadBuffer >());
+				buffers.back()->index = uint32_t(buffers.size()) - 1;
+				buffer = buffers.back().get();
+			}
+			buffer->in_use.store(true, std::memory_order_relaxed);
+		}
+		~ThreadState() {
+			//(events left in the ring are still collected by the next end_frame)
+			buffer->in_use.store(false, std::memory_order_release);
+		}
+	};
+	thread_local ThreadState thread_state;
+
+	uint64_t now_ns() {
+		static auto const start = std::chrono::steady_clock::now();
+		return uint64_t(std::chrono::duration_cast< std::chrono::nanoseconds >(std::chrono::steady_clock::now() - start).count());
+	}
+
+	//--- main-thread state ---
+
+	constexpr uint32_t StatFrames = 120; //frames of history for statistics
+	constexpr uint32_t TraceFrames = 240; //frames of history for traces
+
+	struct ZoneStats {
+		char const *name = nullptr;
+		uint32_t depth = 0;
+		float history[StatFrames] = {}; //ms per frame (summed over all threads)
+		float this_frame = 0.0f;
+	};
+	std::vector< ZoneStats > zone_stats; //in order of first appearance
+	float frame_history[StatFrames] = {}; //ms between end_frame calls
+	uint32_t frame_index = 0; //number of end_frame calls
+	uint64_t last_frame_end = 0;
+
+	std::deque< std::vector< Event > > trace_frames;
+
+	ZoneStats &stats_for(Event const &event) {
+		for (auto &stats : zone_stats) {
+			if (stats.name == event.name || std::strcmp(stats.name, event.name) == 0) return stats;
+		}
+		zone_stats.emplace_back();
+		zone_stats.back().name = event.name;
+		zone_stats.back().depth = event.depth;
+		return zone_stats.back();
+	}
+}
+
+Profiler::Zone::Zone(char const *name_) : name(name_), begin(now_ns()) {
+	thread_state.depth += 1;
+}
+
+Profiler::Zone::~Zone() {
+	ThreadState &state = thread_state;
+	state.depth -= 1;
+	Event event;
+	event.name = name;
+	event.begin = begin;
+	event.end = now_ns();
+	event.thread = state.buffer->index;
+	event.depth = state.depth;
+	if (!state.buffer->events.push(std::move(event))) {
+		//ring full (end_frame isn't being called often enough), so the event is lost:
+		dropped.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+void Profiler::end_frame() {
+	uint64_t now = now_ns();
+	uint32_t slot = frame_index % StatFrames;
+	frame_history[slot] = (last_frame_end ? float(now - last_frame_end) * 1e-6f : 0.0f);
+	last_frame_end = now;
+
+	for (auto &stats : zone_stats) {
+		stats.this_frame = 0.0f;
+	}
+
+	//collect events from every thread:
+	std::vector< Event > events;
+	{
+		std::unique_lock< std::mutex > lock(buffers_mutex);
+		for (auto &buffer : buffers) {
+			Event event;
+			while (buffer->events.pop(&event)) {
+				events.emplace_back(event);
+			}
+		}
+	}
+	for (auto const &event : events) {
+		ZoneStats &stats = stats_for(event);
+		stats.this_frame += float(event.end - event.begin) * 1e-6f;
+		stats.depth = std::min(stats.depth, event.depth);
+	}
+	for (auto &stats : zone_stats) {
+		stats.history[slot] = stats.this_frame;
+	}
+
+	trace_frames.emplace_back(std::move(events));
+	while (trace_frames.size() > TraceFrames) {
+		trace_frames.pop_front();
+	}
+
+	frame_index += 1;
+}
+
+void Profiler::draw_overlay(glm::uvec2 const &drawable_size) {
+	uint32_t frames = std::min(frame_index, StatFrames);
+	if (frames == 0) return;
+
+	auto summarize = [frames](float const *history, float *avg, float *max) {
+		*avg = 0.0f;
+		*max = 0.0f;
+		for (uint32_t i = 0; i < frames; ++i) {
+			*avg += history[i];
+			*max = std::max(*max, history[i]);
+		}
+		*avg /= float(frames);
+	};
+
+	float aspect = float(drawable_size.x) / float(drawable_size.y);
+	DrawLines lines(glm::mat4(
+		1.0f / aspect, 0.0f, 0.0f, 0.0f,
+		0.0f, 1.0f, 0.0f, 0.0f,
+		0.0f, 0.0f, 1.0f, 0.0f,
+		0.0f, 0.0f, 0.0f, 1.0f
+	), true);
+
+	constexpr float H = 0.045f; //text height
+	constexpr float BudgetMs = 1000.0f / 60.0f; //bars are scaled so this is BarWidth long
+	constexpr float BarWidth = 0.5f;
+	glm::u8vec4 const text_color(0xff, 0xff, 0xff, 0xff);
+	glm::u8vec4 const bar_color(0x88, 0xdd, 0x44, 0xff);
+	glm::u8vec4 const over_color(0xff, 0x44, 0x44, 0xff);
+
+	float x = -aspect + 0.5f * H;
+	float y = 1.0f - 1.5f * H;
+	float bar_x = x + 26.0f * 0.6f * H;
+
+	auto row = [&](std::string const &label, float avg, float max, uint32_t depth) {
+		char text[128];
+		depth = std::min(depth, 8U);
+		std::snprintf(text, sizeof(text), "%s%-*s %6.2f %6.2f", std::string(2 * depth, ' ').c_str(), int(20 - 2 * depth), label.c_str(), avg, max);
+		lines.draw_text(text, glm::vec3(x, y, 0.0f), glm::vec3(H, 0.0f, 0.0f), glm::vec3(0.0f, H, 0.0f), text_color);
+		//average (filled) and max (tick) as bars:
+		float width = std::min(1.0f, avg / BudgetMs) * BarWidth;
+		glm::u8vec4 color = (avg > BudgetMs ? over_color : bar_color);
+		for (float t = 0.15f; t < 0.85f; t += 0.1f) {
+			lines.draw(glm::vec3(bar_x, y + t * H, 0.0f), glm::vec3(bar_x + width, y + t * H, 0.0f), color);
+		}
+		float max_x = bar_x + std::min(1.0f, max / BudgetMs) * BarWidth;
+		lines.draw(glm::vec3(max_x, y, 0.0f), glm::vec3(max_x, y + H, 0.0f), text_color);
+		y -= 1.2f * H;
+	};
+
+	{
+		char text[64];
+		std::snprintf(text, sizeof(text), "%-20s %6s %6s", "zone (ms)", "avg", "max");
+		lines.draw_text(text, glm::vec3(x, y, 0.0f), glm::vec3(H, 0.0f, 0.0f), glm::vec3(0.0f, H, 0.0f), text_color);
+		y -= 1.2f * H;
+	}
+	float avg, max;
+	summarize(frame_history, &avg, &max);
+	row("frame", avg, max, 0);
+	for (auto const &stats : zone_stats) {
+		summarize(stats.history, &avg, &max);
+		row(stats.name, avg, max, stats.depth);
+	}
+
+	{ //frame-time graph (oldest on the left), with a line at the 60Hz budget:
+		float const graph_w = bar_x + BarWidth - x;
+		float const graph_h = 4.0f * H;
+		float const bottom = y - graph_h;
+		auto to_y = [&](float ms) { return bottom + std::min(2.0f, ms / BudgetMs) * 0.5f * graph_h; };
+		lines.draw(glm::vec3(x, to_y(BudgetMs), 0.0f), glm::vec3(x + graph_w, to_y(BudgetMs), 0.0f), over_color);
+		lines.draw(glm::vec3(x, bottom, 0.0f), glm::vec3(x + graph_w, bottom, 0.0f), text_color);
+		glm::vec3 prev(0.0f);
+		for (uint32_t i = 0; i < frames; ++i) {
+			uint32_t slot = (frame_index - frames + i) % StatFrames;
+			glm::vec3 at(x + graph_w * float(i) / float(StatFrames - 1), to_y(frame_history[slot]), 0.0f);
+			if (i > 0) lines.draw(prev, at, bar_color);
+			prev = at;
+		}
+		y = bottom - 1.5f * H;
+	}
+
+	if (uint32_t lost = dropped.load(std::memory_order_relaxed)) {
+		lines.draw_text("dropped " + std::to_string(lost) + " zones", glm::vec3(x, y, 0.0f), glm::vec3(H, 0.0f, 0.0f), glm::vec3(0.0f, H, 0.0f), over_color);
+	}
+}
+
+bool Profiler::write_chrome_trace(std::string const &filename) {
+	std::ofstream out(filename, std::ios::binary);
+	if (!out) {
+		std::cerr << "Failed to open '" << filename << "' for writing a trace." << std::endl;
+		return false;
+	}
+
+	auto write_escaped = [&out](char const *str) {
+		for (char const *c = str; *c; ++c) {
+			if (*c == '"' || *c == '\\') out << '\\';
+			if (uint8_t(*c) < 0x20) continue; //(zone names shouldn't contain control characters)
+			out << *c;
+		}
+	};
+
+	out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+	bool first = true;
+	char number[64];
+	for (auto const &frame : trace_frames) {
+		for (auto const &event : frame) {
+			if (!first) out << ",\n";
+			first = false;
+			out << "{\"name\":\"";
+			write_escaped(event.name);
+			//(timestamps are in microseconds)
+			std::snprintf(number, sizeof(number), "%.3f", double(event.begin) * 1e-3);
+			out << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << event.thread << ",\"ts\":" << number;
+			std::snprintf(number, sizeof(number), "%.3f", double(event.end - event.begin) * 1e-3);
+			out << ",\"dur\":" << number << "}";
+		}
+	}
+	out << "\n]}\n";
+
+	if (!out) {
+		std::cerr << "Failed to write trace to '" << filename << "'." << std::endl;
+		return false;
+	}
+	std::cout << "Wrote " << trace_frames.size() << " frames of profile zones to '" << filename << "'." << std::endl;
+	return true;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+/*
+ * Lightweight CPU profiler.
+ *
+ * Mark a scope to time with PROFILE_ZONE:
+ *
+ *   void PlayMode::update(float elapsed) {
+ *       PROFILE_ZONE("PlayMode::update");
+ *       ...
+ *   }
+ *
+ * Zones nest, and may be used on any thread. Each thread records finished zones into
+ *  its own fixed-size ring (no locks or allocation on the recording side); the main thread
+ *  collects them in end_frame(), keeps rolling per-zone statistics, and keeps the last
+ *  few seconds of events so they can be written out as a Chrome trace
+ *  (open in chrome://tracing or https://ui.perfetto.dev).
+ *
+ * Zone names must be string literals (or otherwise outlive the profiler).
+ *
+ */
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <string>
+
+#define PROFILE_ZONE_CONCAT2(a, b) a ## b
+#define PROFILE_ZONE_CONCAT(a, b) PROFILE_ZONE_CONCAT2(a, b)
+#define PROFILE_ZONE(name) Profiler::Zone PROFILE_ZONE_CONCAT(profile_zone_, __LINE__)(name)
+
+namespace Profiler {
+	//times its own lifetime (use via PROFILE_ZONE):
+	struct Zone {
+		Zone(char const *name);
+		~Zone();
+		Zone(Zone const &) = delete;
+		Zone &operator=(Zone const &) = delete;
+
+		char const *name;
+		uint64_t begin; //ns since profiler start
+	};
+
+	//(main thread) call once per frame, outside of any zone:
+	// collects zones recorded by all threads since the last call and updates statistics.
+	void end_frame();
+
+	//(main thread, with OpenGL) draw rolling per-zone statistics and a frame-time graph:
+	void draw_overlay(glm::uvec2 const &drawable_size);
+
+	//(main thread) write recent frames as a Chrome trace event file; returns false on failure:
+	bool write_chrome_trace(std::string const &filename);
+}
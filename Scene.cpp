@@ -2,10 +2,15 @@
 
 #include "gl_errors.hpp"
 #include "read_write_chunk.hpp"
+#include "MappedFile.hpp"
+#include "Profiler.hpp"
 
 #include <glm/gtc/type_ptr.hpp>
 
-#include <fstream>
+#include <algorithm>
+#include <functional>
+#include <istream>
+#include <streambuf>
 
 //-------------------------
 
@@ -56,18 +61,58 @@ glm::mat4x3 Scene::Transform::make_parent_to_local() const {
 	);
 }
 
-glm::mat4x3 Scene::Transform::make_local_to_world() const {
-	if (!parent) {
-		return make_local_to_parent();
+Scene::Transform &Scene::TransformStorage::emplace_back() {
+	if (count == chunks.size() * ChunkSize) {
+		chunks.emplace_back(new Transform[ChunkSize]);
+	}
+	Transform &transform = (*this)[count++];
+	//slots may be reused after clear(), so reset to a fresh transform:
+	transform = Transform();
+	transform.index = count - 1;
+	names.emplace_back();
+	return transform;
+}
+
+void Scene::TransformStorage::clear() {
+	count = 0;
+	names.clear();
+}
+
+void Scene::TransformStorage::assign(TransformStorage const &other) {
+	assert(&other != this);
+	while (chunks.size() * ChunkSize < other.count) {
+		chunks.emplace_back(new Transform[ChunkSize]);
+	}
+	//(Transform is trivially copyable, so this is a memcpy per chunk)
+	for (uint32_t begin = 0; begin < other.count; begin += ChunkSize) {
+		std::copy_n(other.chunks[begin / ChunkSize].get(), std::min< uint32_t >(ChunkSize, other.count - begin), chunks[begin / ChunkSize].get());
+	}
+	count = other.count;
+	names = other.names;
+}
+
+Scene::Transform const *Scene::TransformStorage::parent(Transform const &t) const {
+	assert(owns(t) && "transform belongs to this storage");
+	if (t.parent_index == Transform::NoParent) return nullptr;
+	assert(t.parent_index < t.index && "parents come before their children");
+	return &(*this)[t.parent_index];
+}
+
+glm::mat4x3 Scene::TransformStorage::make_local_to_world(Transform const &t) const {
+	Transform const *p = parent(t);
+	if (!p) {
+		return t.make_local_to_parent();
 	} else {
-		return parent->make_local_to_world() * glm::mat4(make_local_to_parent()); //note: glm::mat4(glm::mat4x3) pads with a (0,0,0,1) row
+		return make_local_to_world(*p) * glm::mat4(t.make_local_to_parent()); //note: glm::mat4(glm::mat4x3) pads with a (0,0,0,1) row
 	}
 }
-glm::mat4x3 Scene::Transform::make_world_to_local() const {
-	if (!parent) {
-		return make_parent_to_local();
+
+glm::mat4x3 Scene::TransformStorage::make_world_to_local(Transform const &t) const {
+	Transform const *p = parent(t);
+	if (!p) {
+		return t.make_parent_to_local();
 	} else {
-		return make_parent_to_local() * glm::mat4(parent->make_world_to_local()); //note: glm::mat4(glm::mat4x3) pads with a (0,0,0,1) row
+		return t.make_parent_to_local() * glm::mat4(make_world_to_local(*p)); //note: glm::mat4(glm::mat4x3) pads with a (0,0,0,1) row
 	}
 }
 
@@ -79,17 +124,181 @@ glm::mat4 Scene::Camera::make_projection() const {
 
 //-------------------------
 
+void Scene::update_world_matrices() const {
+	world_pass += 1;
+	if (world_pass == 0) world_pass = 1; //(0 is the 'never changed' stamp)
+
+	//parents come before their children, so each parent's cache is already up to date when its children are visited:
+	for (uint32_t i = 0; i < transforms.size(); ++i) {
+		Transform const &transform = transforms[i];
+		Transform::WorldCache &cache = transform.world_cache;
+
+		Transform const *parent = nullptr;
+		if (transform.parent_index != Transform::NoParent) {
+			assert(transform.parent_index < i && "parents come before their children");
+			parent = &transforms[transform.parent_index];
+		}
+		bool parent_changed = (parent && parent->world_cache.changed_pass == world_pass);
+
+		if (!cache.valid || parent_changed
+		 || cache.parent_index != transform.parent_index
+		 || cache.position != transform.position
+		 || cache.rotation != transform.rotation
+		 || cache.scale != transform.scale) {
+			cache.position = transform.position;
+			cache.rotation = transform.rotation;
+			cache.scale = transform.scale;
+			cache.parent_index = transform.parent_index;
+			if (parent) {
+				cache.local_to_world = parent->world_cache.local_to_world * glm::mat4(transform.make_local_to_parent()); //note: glm::mat4(glm::mat4x3) pads with a (0,0,0,1) row
+			} else {
+				cache.local_to_world = transform.make_local_to_parent();
+			}
+			cache.valid = true;
+			cache.changed_pass = world_pass;
+		}
+	}
+}
+
+void Scene::Drawable::set_mesh(Mesh const &mesh) {
+	pipeline.type = mesh.type;
+	pipeline.start = mesh.start;
+	pipeline.count = mesh.count;
+	min = mesh.min;
+	max = mesh.max;
+}
+
+namespace {
+	//helper: the six clip-space planes of a world_to_clip matrix, as world-space half-spaces:
+	struct Frustum {
+		glm::vec4 planes[6]; //dot(plane, vec4(p,1)) >= 0 for points p inside
+
+		Frustum(glm::mat4 const &world_to_clip) {
+			//rows of the matrix (glm is column-major):
+			glm::vec4 r[4];
+			for (uint32_t i = 0; i < 4; ++i) {
+				r[i] = glm::vec4(world_to_clip[0][i], world_to_clip[1][i], world_to_clip[2][i], world_to_clip[3][i]);
+			}
+			// -w <= x,y,z <= w:
+			planes[0] = r[3] + r[0];
+			planes[1] = r[3] - r[0];
+			planes[2] = r[3] + r[1];
+			planes[3] = r[3] - r[1];
+			planes[4] = r[3] + r[2];
+			planes[5] = r[3] - r[2];
+		}
+
+		//does the box [min,max], placed in the world by 'local_to_world', (possibly) touch the frustum?
+		// (conservative: boxes near frustum corners may be reported as overlapping)
+		bool overlaps(glm::mat4x3 const &local_to_world, glm::vec3 const &min, glm::vec3 const &max) const {
+			//world-space center and half-extents of the box's world-space bounding box:
+			glm::vec3 center = local_to_world * glm::vec4(0.5f * (min + max), 1.0f);
+			glm::vec3 half = 0.5f * (max - min);
+			glm::vec3 extent =
+				  glm::abs(local_to_world[0]) * half.x
+				+ glm::abs(local_to_world[1]) * half.y
+				+ glm::abs(local_to_world[2]) * half.z;
+			for (auto const &plane : planes) {
+				glm::vec3 n = glm::vec3(plane);
+				float d = glm::dot(n, center) + plane.w;
+				float r = glm::dot(glm::abs(n), extent);
+				if (d + r < 0.0f) return false; //entirely on the outside of this plane
+			}
+			return true;
+		}
+	};
+}
+
+void Scene::update_bvh() const {
+	update_world_matrices();
+
+	//check whether the set of drawables (with bounds) still matches what the tree was built over:
+	bool same = true;
+	size_t count = 0;
+	for (auto const &drawable : drawables) {
+		if (!(drawable.min.x <= drawable.max.x)) continue;
+		if (count >= bvh_drawables.size() || bvh_drawables[count] != &drawable) {
+			same = false;
+			break;
+		}
+		++count;
+	}
+	if (count != bvh_drawables.size()) same = false;
+
+	if (!same) {
+		bvh_drawables.clear();
+		for (auto const &drawable : drawables) {
+			if (!(drawable.min.x <= drawable.max.x)) continue;
+			bvh_drawables.emplace_back(&drawable);
+		}
+	}
+
+	//world-space boxes around each drawable's (transformed) bounds:
+	bvh_boxes.resize(bvh_drawables.size());
+	for (size_t i = 0; i < bvh_drawables.size(); ++i) {
+		Drawable const &drawable = *bvh_drawables[i];
+		glm::mat4x3 const &local_to_world = drawable.transform->get_local_to_world();
+		glm::vec3 center = local_to_world * glm::vec4(0.5f * (drawable.min + drawable.max), 1.0f);
+		glm::vec3 half = 0.5f * (drawable.max - drawable.min);
+		glm::vec3 extent =
+			  glm::abs(local_to_world[0]) * half.x
+			+ glm::abs(local_to_world[1]) * half.y
+			+ glm::abs(local_to_world[2]) * half.z;
+		bvh_boxes[i].min = center - extent;
+		bvh_boxes[i].max = center + extent;
+	}
+
+	if (!same || !bvh.refit(bvh_boxes)) {
+		bvh.build(bvh_boxes);
+	}
+}
+
+bool Scene::ray_cast(glm::vec3 const &origin, glm::vec3 const &direction, RayHit *hit, float max_t) const {
+	update_bvh();
+
+	uint32_t item = bvh.ray_cast(origin, direction, max_t, [&](uint32_t i, float limit) -> float {
+		//exact test: move the ray into the drawable's local frame, where its box is axis-aligned:
+		// (the transform is affine, so distances along the ray are the same in both frames)
+		Drawable const &drawable = *bvh_drawables[i];
+		glm::mat4x3 const &local_to_world = drawable.transform->get_local_to_world();
+		glm::mat3 linear = glm::mat3(local_to_world);
+		if (glm::determinant(linear) == 0.0f) return std::numeric_limits< float >::infinity(); //(flattened to nothing)
+		glm::mat3 world_to_local = glm::inverse(linear);
+		glm::vec3 local_origin = world_to_local * (origin - local_to_world[3]);
+		glm::vec3 local_direction = world_to_local * direction;
+		BVH::Box box;
+		box.min = drawable.min;
+		box.max = drawable.max;
+		return BVH::ray_box(local_origin, 1.0f / local_direction, box, limit);
+	});
+
+	if (item == -1U) return false;
+
+	if (hit) {
+		hit->drawable = bvh_drawables[item];
+		hit->transform = bvh_drawables[item]->transform;
+		hit->t = max_t;
+	}
+	return true;
+}
 
 void Scene::draw(Camera const &camera) const {
 	assert(camera.transform);
-	glm::mat4 world_to_clip = camera.make_projection() * glm::mat4(camera.transform->make_world_to_local());
+	glm::mat4 world_to_clip = camera.make_projection() * glm::mat4(transforms.make_world_to_local(*camera.transform));
 	glm::mat4x3 world_to_light = glm::mat4x3(1.0f);
 	draw(world_to_clip, world_to_light);
 }
 
 void Scene::draw(glm::mat4 const &world_to_clip, glm::mat4x3 const &world_to_light) const {
+	PROFILE_ZONE("Scene::draw");
+	update_world_matrices();
+
+	draw_stats = DrawStats();
 
-	//Iterate through all drawables, sending each one to OpenGL:
+	Frustum frustum(world_to_clip);
+
+	//Build render queue of drawables that can actually be drawn:
+	render_queue.clear();
 	for (auto const &drawable : drawables) {
 		//Reference to drawable's pipeline for convenience:
 		Scene::Drawable::Pipeline const &pipeline = drawable.pipeline;
@@ -101,18 +310,143 @@ void Scene::draw(glm::mat4 const &world_to_clip, glm::mat4x3 const &world_to_lig
 		//skip any drawables that don't contain any vertices:
 		if (pipeline.count == 0) continue;
 
+		//skip any drawables whose bounds are entirely outside the view frustum:
+		if (drawable.min.x <= drawable.max.x) {
+			draw_stats.tested += 1;
+			assert(drawable.transform); //drawables *must* have a transform
+			if (!frustum.overlaps(drawable.transform->get_local_to_world(), drawable.min, drawable.max)) {
+				draw_stats.culled += 1;
+				continue;
+			}
+		}
+
+		render_queue.emplace_back(&drawable);
+	}
+	draw_stats.drawables = uint32_t(render_queue.size());
+
+	//Sort by state so that drawables sharing a program/vao/textures are adjacent:
+	// (and, within that, drawables of the same mesh, so they can be drawn as one instanced batch;
+	//  the drawable's address breaks ties, so order within a batch is stable frame-to-frame)
+	std::sort(render_queue.begin(), render_queue.end(), [](Drawable const *a, Drawable const *b) {
+		Drawable::Pipeline const &pa = a->pipeline;
+		Drawable::Pipeline const &pb = b->pipeline;
+		if (pa.program != pb.program) return pa.program < pb.program;
+		if (pa.vao != pb.vao) return pa.vao < pb.vao;
+		for (uint32_t i = 0; i < Drawable::Pipeline::TextureCount; ++i) {
+			if (pa.textures[i].texture != pb.textures[i].texture) return pa.textures[i].texture < pb.textures[i].texture;
+			if (pa.textures[i].target != pb.textures[i].target) return pa.textures[i].target < pb.textures[i].target;
+		}
+		if (pa.type != pb.type) return pa.type < pb.type;
+		if (pa.start != pb.start) return pa.start < pb.start;
+		if (pa.count != pb.count) return pa.count < pb.count;
+		return std::less< Drawable const * >()(a, b); //(built-in '<' isn't guaranteed to order pointers to unrelated objects)
+	});
+
+	//GL state as set by this function, so that only changes are sent:
+	GLuint current_program = 0;
+	GLuint current_vao = 0;
+	Drawable::Pipeline::TextureInfo current_textures[Drawable::Pipeline::TextureCount];
+
+	//helper: bind the textures a pipeline wants (only the units that differ from what's bound):
+	auto bind_textures = [&](Drawable::Pipeline const &pipeline) {
+		for (uint32_t i = 0; i < Drawable::Pipeline::TextureCount; ++i) {
+			auto const &want = pipeline.textures[i];
+			auto &have = current_textures[i];
+			if (want.texture == have.texture && want.target == have.target) continue;
+			if (want.texture == 0 && have.texture == 0) continue; //(nothing bound, nothing wanted)
+			glActiveTexture(GL_TEXTURE0 + i);
+			if (have.texture != 0 && (want.texture == 0 || want.target != have.target)) {
+				glBindTexture(have.target, 0); //(so the old texture doesn't linger on another target)
+			}
+			if (want.texture != 0) {
+				glBindTexture(want.target, want.texture);
+			}
+			have = want;
+			draw_stats.texture_changes += 1;
+		}
+	};
+
+	//helper: can drawables 'a' and 'b' go in the same instanced draw call?
+	auto same_instance_batch = [](Drawable::Pipeline const &a, Drawable::Pipeline const &b) {
+		if (a.program != b.program || a.vao != b.vao) return false;
+		if (a.type != b.type || a.start != b.start || a.count != b.count) return false;
+		if (a.instance_buffer != b.instance_buffer) return false;
+		if (b.set_uniforms) return false;
+		for (uint32_t i = 0; i < Drawable::Pipeline::TextureCount; ++i) {
+			if (a.textures[i].texture != b.textures[i].texture || a.textures[i].target != b.textures[i].target) return false;
+		}
+		return true;
+	};
+
+	//Send each drawable (or batch of instanced drawables) to OpenGL:
+	for (size_t q = 0; q < render_queue.size(); /* advanced below */) {
+		Drawable const &drawable = *render_queue[q];
+		//Reference to drawable's pipeline for convenience:
+		Scene::Drawable::Pipeline const &pipeline = drawable.pipeline;
 
 		//Set shader program:
-		glUseProgram(pipeline.program);
+		if (pipeline.program != current_program) {
+			glUseProgram(pipeline.program);
+			current_program = pipeline.program;
+			draw_stats.program_changes += 1;
+		}
 
 		//Set attribute sources:
-		glBindVertexArray(pipeline.vao);
+		if (pipeline.vao != current_vao) {
+			glBindVertexArray(pipeline.vao);
+			current_vao = pipeline.vao;
+			draw_stats.vao_changes += 1;
+		}
+
+		if (pipeline.instance_buffer != 0 && !pipeline.set_uniforms) {
+			//Instanced path: the run of drawables with this same mesh/state goes in one draw call,
+			// with per-object matrices passed as instance attributes:
+			size_t end = q + 1;
+			while (end < render_queue.size() && same_instance_batch(pipeline, render_queue[end]->pipeline)) ++end;
+
+			instance_data.clear();
+			for (size_t i = q; i < end; ++i) {
+				assert(render_queue[i]->transform); //drawables *must* have a transform
+				glm::mat4x3 const &object_to_world = render_queue[i]->transform->get_local_to_world();
+				instance_data.emplace_back();
+				instance_data.back().OBJECT_TO_WORLD = object_to_world;
+				instance_data.back().NORMAL_TO_WORLD = glm::inverse(glm::transpose(glm::mat3(object_to_world)));
+			}
+
+			//per-batch uniforms:
+			if (pipeline.WORLD_TO_CLIP_mat4 != -1U) {
+				glUniformMatrix4fv(pipeline.WORLD_TO_CLIP_mat4, 1, GL_FALSE, glm::value_ptr(world_to_clip));
+			}
+			if (pipeline.WORLD_TO_LIGHT_mat4x3 != -1U) {
+				glUniformMatrix4x3fv(pipeline.WORLD_TO_LIGHT_mat4x3, 1, GL_FALSE, glm::value_ptr(world_to_light));
+			}
+			if (pipeline.NORMAL_WORLD_TO_LIGHT_mat3 != -1U) {
+				glm::mat3 normal_world_to_light = glm::inverse(glm::transpose(glm::mat3(world_to_light)));
+				glUniformMatrix3fv(pipeline.NORMAL_WORLD_TO_LIGHT_mat3, 1, GL_FALSE, glm::value_ptr(normal_world_to_light));
+			}
+
+			//(orphan + refill, so the driver doesn't need to wait on last frame's use of the buffer)
+			glBindBuffer(GL_ARRAY_BUFFER, pipeline.instance_buffer);
+			glBufferData(GL_ARRAY_BUFFER, instance_data.size() * sizeof(Instance), instance_data.data(), GL_STREAM_DRAW);
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+			bind_textures(pipeline);
+
+			//draw all the objects:
+			glDrawArraysInstanced(pipeline.type, pipeline.start, pipeline.count, GLsizei(instance_data.size()));
+			draw_stats.draw_calls += 1;
+			draw_stats.instanced_draws += 1;
+			draw_stats.instances += uint32_t(instance_data.size());
+
+			q = end;
+			continue;
+		}
 
 		//Configure program uniforms:
 
 		//the object-to-world matrix is used in all three of these uniforms:
 		assert(drawable.transform); //drawables *must* have a transform
-		glm::mat4x3 object_to_world = drawable.transform->make_local_to_world();
+		glm::mat4x3 const &object_to_world = drawable.transform->get_local_to_world();
 
 		//OBJECT_TO_CLIP takes vertices from object space to clip space:
 		if (pipeline.OBJECT_TO_CLIP_mat4 != -1U) {
@@ -137,27 +471,23 @@ void Scene::draw(glm::mat4 const &world_to_clip, glm::mat4x3 const &world_to_lig
 		//set any requested custom uniforms:
 		if (pipeline.set_uniforms) pipeline.set_uniforms();
 
-		//set up textures:
-		for (uint32_t i = 0; i < Drawable::Pipeline::TextureCount; ++i) {
-			if (pipeline.textures[i].texture != 0) {
-				glActiveTexture(GL_TEXTURE0 + i);
-				glBindTexture(pipeline.textures[i].target, pipeline.textures[i].texture);
-			}
-		}
+		bind_textures(pipeline);
 
 		//draw the object:
 		glDrawArrays(pipeline.type, pipeline.start, pipeline.count);
+		draw_stats.draw_calls += 1;
 
-		//un-bind textures:
-		for (uint32_t i = 0; i < Drawable::Pipeline::TextureCount; ++i) {
-			if (pipeline.textures[i].texture != 0) {
-				glActiveTexture(GL_TEXTURE0 + i);
-				glBindTexture(pipeline.textures[i].target, 0);
-			}
-		}
-		glActiveTexture(GL_TEXTURE0);
+		q += 1;
+	}
 
+	//un-bind textures:
+	for (uint32_t i = 0; i < Drawable::Pipeline::TextureCount; ++i) {
+		if (current_textures[i].texture != 0) {
+			glActiveTexture(GL_TEXTURE0 + i);
+			glBindTexture(current_textures[i].target, 0);
+		}
 	}
+	glActiveTexture(GL_TEXTURE0);
 
 	glUseProgram(0);
 	glBindVertexArray(0);
@@ -166,13 +496,23 @@ void Scene::draw(glm::mat4 const &world_to_clip, glm::mat4x3 const &world_to_lig
 }
 
 
+namespace {
+	//helper: read-only std::streambuf over bytes in memory:
+	struct SpanStreamBuf : std::streambuf {
+		SpanStreamBuf(char const *data, size_t size) {
+			char *begin = const_cast< char * >(data); //(get area is never written through)
+			setg(begin, begin, begin + size);
+		}
+	};
+}
+
 void Scene::load(std::string const &filename,
 	std::function< void(Scene &, Transform *, std::string const &) > const &on_drawable) {
 
-	std::ifstream file(filename, std::ios::binary);
+	//chunks are read in place from the mapped file (no copies for aligned data):
+	ChunkReader file(std::make_shared< MappedFile const >(filename));
 
-	std::vector< char > names;
-	read_chunk(file, "str0", &names);
+	Span< char > names = file.read< char >("str0");
 
 	struct HierarchyEntry {
 		uint32_t parent;
@@ -183,8 +523,7 @@ void Scene::load(std::string const &filename,
 		glm::vec3 scale;
 	};
 	static_assert(sizeof(HierarchyEntry) == 4 + 4 + 4 + 4*3 + 4*4 + 4*3, "HierarchyEntry is packed.");
-	std::vector< HierarchyEntry > hierarchy;
-	read_chunk(file, "xfh0", &hierarchy);
+	Span< HierarchyEntry > hierarchy = file.read< HierarchyEntry >("xfh0");
 
 	struct MeshEntry {
 		uint32_t transform;
@@ -192,8 +531,7 @@ void Scene::load(std::string const &filename,
 		uint32_t name_end;
 	};
 	static_assert(sizeof(MeshEntry) == 4 + 4 + 4, "MeshEntry is packed.");
-	std::vector< MeshEntry > meshes;
-	read_chunk(file, "msh0", &meshes);
+	Span< MeshEntry > meshes = file.read< MeshEntry >("msh0");
 
 	struct CameraEntry {
 		uint32_t transform;
@@ -202,8 +540,7 @@ void Scene::load(std::string const &filename,
 		float clip_near, clip_far;
 	};
 	static_assert(sizeof(CameraEntry) == 4 + 4 + 4 + 4 + 4, "CameraEntry is packed.");
-	std::vector< CameraEntry > loaded_cameras;
-	read_chunk(file, "cam0", &loaded_cameras);
+	Span< CameraEntry > loaded_cameras = file.read< CameraEntry >("cam0");
 
 	struct LightEntry {
 		uint32_t transform;
@@ -214,45 +551,55 @@ void Scene::load(std::string const &filename,
 		float fov;
 	};
 	static_assert(sizeof(LightEntry) == 4 + 1 + 3 + 4 + 4 + 4, "LightEntry is packed.");
-	std::vector< LightEntry > loaded_lights;
-	read_chunk(file, "lmp0", &loaded_lights);
+	Span< LightEntry > loaded_lights = file.read< LightEntry >("lmp0");
 
 
 	//--------------------------------
 	//Now that file is loaded, create transforms for hierarchy entries:
 
-	std::vector< Transform * > hierarchy_transforms;
-	hierarchy_transforms.reserve(hierarchy.size());
-
-	for (auto const &h : hierarchy) {
-		transforms.emplace_back();
-		Transform *t = &transforms.back();
-		if (h.parent != -1U) {
-			if (h.parent >= hierarchy_transforms.size()) {
-				throw std::runtime_error("scene file '" + filename + "' did not contain transforms in topological-sort order.");
+	//transforms are stored parent-before-child, so entries are added in file order except that
+	// any entry whose parent hasn't been added yet waits for it:
+	std::vector< Transform * > hierarchy_transforms(hierarchy.size, nullptr); //(indexed like the file's entries)
+	std::vector< uint32_t > pending; //entry, then its parent, then its parent's parent, ... (none added yet)
+	for (uint32_t first = 0; first < hierarchy.size; ++first) {
+		for (uint32_t e = first; e != -1U && hierarchy_transforms[e] == nullptr; e = hierarchy[e].parent) {
+			if (hierarchy[e].parent != -1U && hierarchy[e].parent >= hierarchy.size) {
+				throw std::runtime_error("scene file '" + filename + "' contains hierarchy entry with invalid parent index (" + std::to_string(hierarchy[e].parent) + ")");
 			}
-			t->parent = hierarchy_transforms[h.parent];
+			if (pending.size() == hierarchy.size) {
+				throw std::runtime_error("scene file '" + filename + "' contains a cycle in its transform hierarchy.");
+			}
+			pending.emplace_back(e);
 		}
+		//add from the top down, so each parent is added before its child:
+		while (!pending.empty()) {
+			HierarchyEntry const &h = hierarchy[pending.back()];
+			Transform *t = &transforms.emplace_back();
+			if (h.parent != -1U) {
+				t->parent_index = hierarchy_transforms[h.parent]->index;
+			}
+			assert((t->parent_index == Transform::NoParent || t->parent_index < t->index) && "parents come before their children");
 
-		if (h.name_begin <= h.name_end && h.name_end <= names.size()) {
-			t->name = std::string(names.begin() + h.name_begin, names.begin() + h.name_end);
-		} else {
+			if (h.name_begin <= h.name_end && h.name_end <= names.size) {
+				transforms.names[t->index] = std::string(names.begin() + h.name_begin, names.begin() + h.name_end);
+			} else {
 				throw std::runtime_error("scene file '" + filename + "' contains hierarchy entry with invalid name indices");
-		}
+			}
 
-		t->position = h.position;
-		t->rotation = h.rotation;
-		t->scale = h.scale;
+			t->position = h.position;
+			t->rotation = h.rotation;
+			t->scale = h.scale;
 
-		hierarchy_transforms.emplace_back(t);
+			hierarchy_transforms[pending.back()] = t;
+			pending.pop_back();
+		}
 	}
-	assert(hierarchy_transforms.size() == hierarchy.size());
 
 	for (auto const &m : meshes) {
 		if (m.transform >= hierarchy_transforms.size()) {
 			throw std::runtime_error("scene file '" + filename + "' contains mesh entry with invalid transform index (" + std::to_string(m.transform) + ")");
 		}
-		if (!(m.name_begin <= m.name_end && m.name_end <= names.size())) {
+		if (!(m.name_begin <= m.name_end && m.name_end <= names.size)) {
 			throw std::runtime_error("scene file '" + filename + "' contains mesh entry with invalid name indices");
 		}
 		std::string name = std::string(names.begin() + m.name_begin, names.begin() + m.name_end);
@@ -301,10 +648,12 @@ void Scene::load(std::string const &filename,
 		light->spot_fov = l.fov / 180.0f * 3.1415926f; //FOV is stored in degrees; convert to radians.
 	}
 
-	//load any extra that a subclass wants:
-	load_extra(file, names, hierarchy_transforms);
+	//load any extra that a subclass wants (from a stream over the rest of the mapped file):
+	SpanStreamBuf extra_buf(reinterpret_cast< char const * >(file.current()), file.remaining());
+	std::istream extra(&extra_buf);
+	load_extra(extra, std::vector< char >(names.begin(), names.end()), hierarchy_transforms);
 
-	if (file.peek() != EOF) {
+	if (extra.peek() != EOF) {
 		std::cerr << "WARNING: trailing data in scene file '" << filename << "'" << std::endl;
 	}
 
@@ -327,51 +676,45 @@ Scene &Scene::operator=(Scene const &other) {
 	return *this;
 }
 
-void Scene::set(Scene const &other, std::unordered_map< Transform const *, Transform * > *transform_map_) {
-
-	std::unordered_map< Transform const *, Transform * > t2t_temp;
-	std::unordered_map< Transform const *, Transform * > &transform_to_transform = *(transform_map_ ? transform_map_ : &t2t_temp);
+void Scene::set(Scene const &other, std::unordered_map< Transform const *, Transform * > *transform_map) {
 
-	transform_to_transform.clear();
-
-	//null transform maps to itself:
-	transform_to_transform.insert(std::make_pair(nullptr, nullptr));
-
-	//Copy transforms and store mapping:
-	transforms.clear();
-	for (auto const &t : other.transforms) {
-		transforms.emplace_back();
-		transforms.back().name = t.name;
-		transforms.back().position = t.position;
-		transforms.back().rotation = t.rotation;
-		transforms.back().scale = t.scale;
-		transforms.back().parent = t.parent; //will update later
-
-		//store mapping between transforms old and new:
-		auto ret = transform_to_transform.insert(std::make_pair(&t, &transforms.back()));
-		assert(ret.second);
-	}
+	//transforms in 'other' map to transforms with the same index in this scene:
+	auto remap = [this,&other](Transform const *t) -> Transform * {
+		if (t == nullptr) return nullptr;
+		assert(other.transforms.owns(*t) && "transform belongs to other scene");
+		(void)other;
+		return &transforms[t->index];
+	};
 
-	//update transform parents:
-	for (auto &t : transforms) {
-		t.parent = transform_to_transform.at(t.parent);
+	//Copy transforms (parents are indices, so need no fixup; cached world matrices come along too):
+	transforms.assign(other.transforms);
+	world_pass = other.world_pass;
+
+	//store mapping between transforms old and new, if requested:
+	if (transform_map) {
+		transform_map->clear();
+		transform_map->reserve(transforms.size() + 1);
+		transform_map->insert(std::make_pair(nullptr, nullptr)); //null transform maps to itself
+		for (auto const &t : other.transforms) {
+			transform_map->insert(std::make_pair(&t, &transforms[t.index]));
+		}
 	}
 
 	//copy other's drawables, updating transform pointers:
 	drawables = other.drawables;
 	for (auto &d : drawables) {
-		d.transform = transform_to_transform.at(d.transform);
+		d.transform = remap(d.transform);
 	}
 
 	//copy other's cameras, updating transform pointers:
 	cameras = other.cameras;
 	for (auto &c : cameras) {
-		c.transform = transform_to_transform.at(c.transform);
+		c.transform = remap(c.transform);
 	}
 
 	//copy other's lights, updating transform pointers:
 	lights = other.lights;
 	for (auto &l : lights) {
-		l.transform = transform_to_transform.at(l.transform);
+		l.transform = remap(l.transform);
 	}
 }
@@ -12,49 +12,74 @@
 
 #include "GL.hpp"
 #include "Mesh.hpp"
+#include "BVH.hpp"
 
 #include <glm/glm.hpp>
 #include <glm/gtc/quaternion.hpp>
 
+#include <limits>
 #include <list>
 #include <memory>
 #include <functional>
 #include <string>
+#include <type_traits>
 #include <vector>
 #include <unordered_map>
 
 struct Scene {
 	struct Transform {
-		//Transform names are useful for debugging and looking up locations in a loaded scene:
-		std::string name;
-
 		//The core function of a transform is to store a transformation in the world:
 		glm::vec3 position = glm::vec3(0.0f, 0.0f, 0.0f);
 		glm::quat rotation = glm::quat(1.0f, 0.0f, 0.0f, 0.0f); //n.b. wxyz init order
 		glm::vec3 scale = glm::vec3(1.0f, 1.0f, 1.0f);
 
-		//The transform above may be relative to some parent transform:
-		Transform *parent = nullptr;
+		//The transform above may be relative to some parent transform, given by its index in the same Scene's 'transforms':
+		// (parents must come before their children -- parent_index < index -- see TransformStorage)
+		static constexpr uint32_t NoParent = -1U;
+		uint32_t parent_index = NoParent;
+
+		//Position of this transform in its Scene's 'transforms' (set by TransformStorage):
+		uint32_t index = -1U;
 
 		//It is often convenient to construct matrices representing this transformation:
 		// ..relative to its parent:
 		glm::mat4x3 make_local_to_parent() const;
 		glm::mat4x3 make_parent_to_local() const;
-		// ..relative to the world:
-		glm::mat4x3 make_local_to_world() const;
-		glm::mat4x3 make_world_to_local() const;
-
-		//since hierarchy is tracked through pointers, copy-constructing a transform  is not advised:
-		Transform(Transform const &) = delete;
-		//if we delete some constructors, we need to let the compiler know that the default constructor is still okay:
-		Transform() = default;	
+		// ..relative to the world: see TransformStorage::make_local_to_world() and make_world_to_local()
+
+		//Cached local-to-world matrix, as of the last Scene::update_world_matrices():
+		// (much cheaper than TransformStorage::make_local_to_world() for deep hierarchies)
+		glm::mat4x3 const &get_local_to_world() const { return world_cache.local_to_world; }
+
+		//internals:
+		//The cache keeps a copy of the local state it was computed from; it is refreshed when
+		// that state (or the parent's world matrix) changes, so position/rotation/scale/parent_index
+		// can still be assigned directly:
+		mutable struct WorldCache {
+			glm::mat4x3 local_to_world = glm::mat4x3(1.0f);
+			glm::vec3 position = glm::vec3(0.0f);
+			glm::quat rotation = glm::quat(1.0f, 0.0f, 0.0f, 0.0f);
+			glm::vec3 scale = glm::vec3(1.0f);
+			uint32_t parent_index = NoParent;
+			bool valid = false; //has local_to_world ever been computed?
+			uint32_t changed_pass = 0; //update pass in which local_to_world last changed
+		} world_cache;
 	};
+	//transforms hold no pointers or strings (names are kept in TransformStorage::names), so scenes copy them as plain bytes:
+	static_assert(std::is_trivially_copyable< Transform >::value, "Transform is trivially copyable.");
 
 	struct Drawable {
 		//a 'Drawable' attaches attribute data to a transform:
 		Drawable(Transform *transform_) : transform(transform_) { assert(transform); }
 		Transform * transform;
 
+		//Object-space bounding box of the vertices drawn, used for frustum culling:
+		// (the default -- empty -- box means "bounds unknown", and such drawables are never culled)
+		glm::vec3 min = glm::vec3( std::numeric_limits< float >::infinity());
+		glm::vec3 max = glm::vec3(-std::numeric_limits< float >::infinity());
+		//convenience: set pipeline.type/start/count and bounds from a mesh:
+		void set_mesh(Mesh const &mesh);
+
 		//Contains all the data needed to run the OpenGL pipeline:
 		struct Pipeline {
 			GLuint program = 0; //shader program; passed to glUseProgram
@@ -73,6 +98,16 @@ struct Scene {
 
 			std::function< void() > set_uniforms; //(optional) function to set any other useful uniforms
 
+			//instancing (optional):
+			// if instance_buffer is non-zero (and set_uniforms is empty), drawables that share this
+			// pipeline's program/vao/mesh/textures are drawn with one glDrawArraysInstanced call.
+			// Per-object matrices are written to instance_buffer as Scene::Instance records, which
+			// 'vao' should read as per-instance attributes; the OBJECT_TO_* uniforms above are unused.
+			GLuint instance_buffer = 0;
+			GLuint WORLD_TO_CLIP_mat4 = -1U; //uniform location for world to clip space matrix
+			GLuint WORLD_TO_LIGHT_mat4x3 = -1U; //uniform location for world to light space matrix
+			GLuint NORMAL_WORLD_TO_LIGHT_mat3 = -1U; //uniform location for world normal to light space matrix
+
 			//texture objects to bind for the first TextureCount textures:
 			enum : uint32_t { TextureCount = 4 };
 			struct TextureInfo {
@@ -82,6 +117,13 @@ struct Scene {
 		} pipeline;
 	};
 
+	//Per-instance data written to Pipeline::instance_buffer for instanced drawing:
+	struct Instance {
+		glm::mat4x3 OBJECT_TO_WORLD;
+		glm::mat3 NORMAL_TO_WORLD;
+	};
+	static_assert(sizeof(Instance) == 4*3*4 + 3*3*4, "Instance is packed.");
+
 	struct Camera {
 		//a 'Camera' attaches camera data to a transform:
 		Camera(Transform *transform_) : transform(transform_) { assert(transform); }
@@ -117,8 +159,72 @@ struct Scene {
 		float spot_fov = glm::radians(45.0f); //spot cone fov (in radians)
 	};
 
+	//TransformStorage keeps transforms in fixed-size contiguous chunks, parents before children:
+	// - addresses are stable (like std::list), so Transform pointers stay valid as transforms are added;
+	// - parents are referenced by index, and always have a lower index than their children
+	//   (Scene::load sorts file hierarchies this way), so Scene::update_world_matrices() is one sweep in index order;
+	// - transforms are trivially copyable, so copying a scene copies each chunk as a block.
+	struct TransformStorage {
+		enum : uint32_t { ChunkSize = 64 };
+
+		//add a default-constructed (unparented, unnamed) transform at index size():
+		Transform &emplace_back();
+		//remove all transforms (chunk memory is kept for reuse):
+		void clear();
+		//make this a copy of 'other' (transform indices -- and so parent indices -- are unchanged):
+		void assign(TransformStorage const &other);
+
+		//parent of a transform in this storage (nullptr if it has none):
+		Transform *parent(Transform const &t) { return const_cast< Transform * >(static_cast< TransformStorage const & >(*this).parent(t)); }
+		Transform const *parent(Transform const &t) const;
+		//name of a transform in this storage:
+		std::string const &name(Transform const &t) const { assert(owns(t)); return names[t.index]; }
+
+		//world-space matrices, computed by walking up the parent chain:
+		// (if the scene's cached matrices are up to date, Transform::get_local_to_world() is cheaper)
+		glm::mat4x3 make_local_to_world(Transform const &t) const;
+		glm::mat4x3 make_world_to_local(Transform const &t) const;
+
+		//Transform names are useful for debugging and looking up locations in a loaded scene:
+		// names[i] is the name of transform i (kept out of Transform so that transforms stay trivially copyable)
+		std::vector< std::string > names;
+
+		Transform &operator[](uint32_t i) { assert(i < count); return chunks[i / ChunkSize][i % ChunkSize]; }
+		Transform const &operator[](uint32_t i) const { assert(i < count); return chunks[i / ChunkSize][i % ChunkSize]; }
+		Transform &front() { return (*this)[0]; }
+		Transform &back() { return (*this)[count - 1]; }
+		size_t size() const { return count; }
+		bool empty() const { return count == 0; }
+
+		template< typename Storage, typename Value >
+		struct Iterator {
+			Storage *storage;
+			uint32_t i;
+			Value &operator*() const { return (*storage)[i]; }
+			Value *operator->() const { return &(*storage)[i]; }
+			Iterator &operator++() { ++i; return *this; }
+			bool operator==(Iterator const &o) const { return i == o.i; }
+			bool operator!=(Iterator const &o) const { return i != o.i; }
+		};
+		using iterator = Iterator< TransformStorage, Transform >;
+		using const_iterator = Iterator< TransformStorage const, Transform const >;
+		iterator begin() { return iterator{this, 0}; }
+		iterator end() { return iterator{this, count}; }
+		const_iterator begin() const { return const_iterator{this, 0}; }
+		const_iterator end() const { return const_iterator{this, count}; }
+
+		TransformStorage() = default;
+		TransformStorage(TransformStorage const &) = delete; //(use assign, or Scene::set, to copy)
+		TransformStorage &operator=(TransformStorage const &) = delete;
+
+		//internals:
+		bool owns(Transform const &t) const { return t.index < count && &(*this)[t.index] == &t; }
+		std::vector< std::unique_ptr< Transform[] > > chunks;
+		uint32_t count = 0;
+	};
+
 	//Scenes, of course, may have many of the above objects:
-	std::list< Transform > transforms;
+	TransformStorage transforms;
 	std::list< Drawable > drawables;
 	std::list< Camera > cameras;
 	std::list< Light > lights;
@@ -127,12 +233,57 @@ struct Scene {
 	static std::unordered_map<std::string, const Mesh *> all_meshes;
 		
 
+	//Refresh every transform's cached local-to-world matrix in one pass, in index order:
+	// (only transforms that changed -- or whose ancestors changed -- since the last call are recomputed)
+	// draw() calls this itself; call it before using Transform::get_local_to_world() elsewhere.
+	void update_world_matrices() const;
+	mutable uint32_t world_pass = 0; //counter for update_world_matrices()
+
 	//The "draw" function provides a convenient way to pass all the things in a scene to OpenGL:
+	// ('camera' must be one of this scene's cameras; to draw from elsewhere, use the world_to_clip version below)
 	void draw(Camera const &camera) const;
 
+	//draw() culls drawables outside the view frustum, then sorts the rest by (program, vao, textures, mesh)
+	// and only sends GL state when it changes.
+	//Counts from the most recent draw() call, to check how well that's working:
+	struct DrawStats {
+		uint32_t tested = 0; //drawables with bounds that were tested against the view frustum
+		uint32_t culled = 0; //drawables skipped because their bounds were outside the view frustum
+		uint32_t drawables = 0; //drawables drawn (passed the program/vao/count checks and culling)
+		uint32_t draw_calls = 0;
+		uint32_t instanced_draws = 0; //draw calls that drew a batch of instances
+		uint32_t instances = 0; //drawables drawn via instanced draw calls
+		uint32_t program_changes = 0; //glUseProgram calls
+		uint32_t vao_changes = 0; //glBindVertexArray calls
+		uint32_t texture_changes = 0; //texture units (re)bound
+		uint32_t state_changes() const { return program_changes + vao_changes + texture_changes; }
+	};
+	mutable DrawStats draw_stats;
+	mutable std::vector< Drawable const * > render_queue; //(reused between frames to avoid allocation)
+	mutable std::vector< Instance > instance_data; //(likewise)
+
 	//..sometimes, you want to draw with a custom projection matrix and/or light space:
 	void draw(glm::mat4 const &world_to_clip, glm::mat4x3 const &world_to_light = glm::mat4x3(1.0f)) const;
 
+	//Ray queries against drawables' bounding boxes (Drawable::min/max, in their transform's frame):
+	struct RayHit {
+		Drawable const *drawable = nullptr;
+		Transform *transform = nullptr; //(== drawable->transform)
+		float t = std::numeric_limits< float >::infinity(); //hit point is origin + t * direction
+	};
+	//find the nearest drawable whose (oriented) box is hit by origin + t * direction for t in [0, max_t]:
+	// returns 'false' (and leaves 'hit' alone) if nothing is hit.
+	// drawables without bounds are ignored.
+	bool ray_cast(glm::vec3 const &origin, glm::vec3 const &direction, RayHit *hit,
+		float max_t = std::numeric_limits< float >::infinity()) const;
+
+	//ray_cast() keeps a BVH over drawables' world-space boxes; each call refits it to the current
+	// transforms, rebuilding only when drawables were added/removed or the tree has grown too loose:
+	void update_bvh() const;
+	mutable BVH bvh;
+	mutable std::vector< Drawable const * > bvh_drawables; //drawable for each BVH item
+	mutable std::vector< BVH::Box > bvh_boxes; //world-space box for each BVH item
+
 	//add transforms/objects/cameras from a scene file to this scene:
 	// the 'on_drawable' callback gives your code a chance to look up mesh data and make Drawables:
 	// throws on file format errors
@@ -1,27 +1,237 @@
 #include "Sound.hpp"
 #include "load_wav.hpp"
 #include "load_opus.hpp"
+#include "pcm_cache.hpp"
+#include "OpusStream.hpp"
+#include "spsc_ring.hpp"
+#include "mix_kernel.hpp"
 
 #include <SDL.h>
 
-#include <list>
 #include <cassert>
 #include <exception>
 #include <iostream>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+
+//apply all queued commands; only call from the mixer, or with the device locked:
+// (defined below, with the other internals)
+void apply_commands();
 
 //local (to this file) data used by the audio system:
 namespace {
 
-	//handy constants:
-	constexpr uint32_t const AUDIO_RATE = 48000; //sampling rate
-	constexpr uint32_t const MIX_SAMPLES = 1024; //number of samples to mix per call of mix_audio callback; n.b. SDL requires this to be a power of two
+	//number of frames to mix at a time (set by init() or init_offline(); a power of two, at most Sound::MaxBlockFrames):
+	// (mix_audio splits longer callbacks into blocks of this size)
+	uint32_t mix_block_frames = Sound::DefaultBlockFrames;
+
+	//round a requested block size to a supported one:
+	uint32_t supported_block_frames(uint32_t requested) {
+		uint32_t frames = Sound::MinBlockFrames;
+		while (frames < requested && frames < Sound::MaxBlockFrames) frames *= 2;
+		if (frames != requested) {
+			std::cerr << "NOTE: audio block size " << requested << " isn't a power of two from " << Sound::MinBlockFrames
+				<< " to " << Sound::MaxBlockFrames << "; using " << frames << "." << std::endl;
+		}
+		return frames;
+	}
 
 	//The audio device:
 	SDL_AudioDeviceID device = 0;
 
-	//list of all currently playing samples:
-	std::list< std::shared_ptr< Sound::PlayingSample > > playing_samples;
+	//(offline mixing) wait for streams' decoders instead of skipping audio they haven't decoded yet:
+	bool wait_for_streams = false;
+
+	//Voice pool -- fixed-capacity storage for all playing samples, laid out as a
+	// structure-of-arrays so the mixer never allocates and walks contiguous memory.
+	//Only the mixer (or the game thread with the device locked) touches the voice state;
+	// 'generation' is also read by the game thread to validate PlayingSample handles.
+	struct Voices {
+		//bumped whenever a voice finishes, invalidating any handles that refer to it:
+		std::atomic< uint32_t > generation[Sound::MaxVoices];
+
+		//sample data being played, in the sample's storage format (Decoded, Int16, or ADPCM):
+		Sound::Sample::Storage storage[Sound::MaxVoices];
+		void const *data[Sound::MaxVoices];
+		uint32_t size[Sound::MaxVoices];
+		uint32_t i[Sound::MaxVoices]; //next frame to read
+		//streamed samples read from a decoder instead ('data', 'size', and 'i' are unused):
+		OpusStream *stream[Sound::MaxVoices];
+
+		bool loop[Sound::MaxVoices]; //should playback loop after data runs out?
+		bool stopping[Sound::MaxVoices]; //is playing stopping?
+		bool is_3D[Sound::MaxVoices]; //pan with position (3D) or with pan (2D)?
+
+		Sound::Ramp< float > volume[Sound::MaxVoices];
+		//2D playback panning control:
+		Sound::Ramp< float > pan[Sound::MaxVoices];
+		//3D playback panning control:
+		Sound::Ramp< glm::vec3 > position[Sound::MaxVoices];
+		Sound::Ramp< float > half_volume_radius[Sound::MaxVoices];
+
+		//voice limiting (see Sound::VoicePolicy):
+		float priority[Sound::MaxVoices]; //user-supplied importance
+		uint32_t age[Sound::MaxVoices]; //samples since voice started
+		float audibility[Sound::MaxVoices]; //loudest channel gain as of the last mix block
+
+		//slots of currently-playing voices, packed at the front of the array:
+		uint32_t active[Sound::MaxVoices];
+		uint32_t active_count = 0;
+		uint32_t stopping_count = 0; //active voices that are fading out
+
+		Voices() {
+			for (uint32_t v = 0; v < Sound::MaxVoices; ++v) {
+				generation[v].store(0, std::memory_order_relaxed);
+			}
+		}
+	} voices;
+
+	//slots that are free to start new voices; produced by the mixer, consumed by the game thread:
+	struct FreeSlots : SPSCRing< uint32_t, Sound::MaxVoices > {
+		FreeSlots() {
+			for (uint32_t v = 0; v < Sound::MaxVoices; ++v) {
+				bool pushed = push(v);
+				assert(pushed);
+				(void)pushed;
+			}
+		}
+	} free_slots;
+
+	//current voice limiting policy (mixer-owned; changed via Sound::set_voice_policy):
+	Sound::VoicePolicy policy;
+
+	//commands from the game thread, applied by the mixer at the start of each block:
+	struct Command {
+		enum Type : uint8_t {
+			Start, //start voice 'slot' playing 'data' at volume 'value' with pan 'value2' (2D) or position 'vec' and radius 'value2' (3D)
+			Stop, //fade out voice 'slot' over 'ramp'
+			SetVolume, //ramp voice 'slot' volume to 'value'
+			SetPan, //ramp voice 'slot' pan to 'value'
+			SetPosition, //ramp voice 'slot' position to 'vec'
+			SetHalfVolumeRadius, //ramp voice 'slot' half-volume radius to 'value'
+			StopAll, //fade out all playing samples
+			SetGlobalVolume, //ramp Sound::volume to 'value'
+			SetListener, //ramp Sound::listener to position 'vec' and right 'vec2'
+			SetVoicePolicy, //replace voice limiting policy with 'policy'
+			Seek, //move voice 'slot' play position to 'value' seconds
+		} type = Start;
+		bool loop = false; //(Start only)
+		bool is_3D = false; //(Start only)
+		uint32_t slot = -1U;
+		uint32_t generation = 0; //commands are ignored if this doesn't match the slot's current generation
+		Sound::Sample::Storage storage = Sound::Sample::Decoded; //(Start only)
+		void const *data = nullptr; //(Start only)
+		uint32_t size = 0; //(Start only)
+		OpusStream *stream = nullptr; //(Start only; streamed samples)
+		glm::vec3 vec = glm::vec3(0.0f);
+		glm::vec3 vec2 = glm::vec3(0.0f);
+		float value = 0.0f;
+		float value2 = 0.0f;
+		float ramp = 0.0f;
+		float priority = 1.0f; //(Start only)
+		Sound::VoicePolicy policy; //(SetVoicePolicy only)
+	};
+	SPSCRing< Command, 1024 > commands;
+
+	//counters behind Sound::stats(); written by the mixer (mix_*, voices, blocks) and by game-thread callers (lock_*, command_ring_full):
+	// (relaxed atomics, since each counter is independent and a snapshot needn't be consistent across counters)
+	struct StatCounters {
+		std::atomic< uint64_t > blocks{0};
+		std::atomic< uint64_t > mix_time_histogram[Sound::Stats::MixTimeBinCount];
+		std::atomic< uint64_t > mix_ns_total{0};
+		std::atomic< uint64_t > mix_ns_max{0};
+		std::atomic< uint32_t > max_active_voices{0};
+		std::atomic< uint32_t > max_mixed_voices{0};
+		std::atomic< uint64_t > overruns{0};
+		std::atomic< uint64_t > late_blocks{0};
+		std::atomic< uint64_t > lock_calls{0};
+		std::atomic< uint64_t > lock_wait_ns_total{0};
+		std::atomic< uint64_t > lock_wait_ns_max{0};
+		std::atomic< uint64_t > command_ring_full{0};
+
+		StatCounters() { reset(); }
+		void reset() {
+			for (auto &bin : mix_time_histogram) bin.store(0, std::memory_order_relaxed);
+			for (auto *counter : { &blocks, &mix_ns_total, &mix_ns_max, &overruns, &late_blocks, &lock_calls, &lock_wait_ns_total, &lock_wait_ns_max, &command_ring_full }) {
+				counter->store(0, std::memory_order_relaxed);
+			}
+			max_active_voices.store(0, std::memory_order_relaxed);
+			max_mixed_voices.store(0, std::memory_order_relaxed);
+		}
+	} stat_counters;
+
+	template< typename T >
+	void store_max(std::atomic< T > &counter, T value) {
+		T seen = counter.load(std::memory_order_relaxed);
+		while (value > seen && !counter.compare_exchange_weak(seen, value, std::memory_order_relaxed)) { }
+	}
+
+	uint64_t ns_since(std::chrono::steady_clock::time_point const &before) {
+		return uint64_t(std::chrono::duration_cast< std::chrono::nanoseconds >(std::chrono::steady_clock::now() - before).count());
+	}
+
+	//streamed and compressed voices are decoded into here before mixing:
+	float decode_scratch[Sound::MaxBlockFrames];
+
+	//queue a command from the game thread:
+	void submit(Command &&command) {
+		if (commands.push(std::move(command))) return;
+		//slow path -- ring is full, so block the mixer and drain the ring ourselves:
+		// (this is safe because the consumer can't be running while the device is locked)
+		stat_counters.command_ring_full.fetch_add(1, std::memory_order_relaxed);
+		Sound::lock();
+		apply_commands();
+		bool pushed = commands.push(std::move(command));
+		assert(pushed && "ring should have room after being drained");
+		(void)pushed;
+		Sound::unlock();
+	}
+
+	//queue a command for the voice referenced by a handle:
+	void submit(Sound::PlayingSample const &handle, Command &&command) {
+		if (handle.slot == -1U) return; //sample never started
+		command.slot = handle.slot;
+		command.generation = handle.generation;
+		submit(std::move(command));
+	}
+
+	//start a sample playing in a free voice (or return a stopped handle if none are free):
+	Sound::PlayingSample start(Sound::Sample const &sample, float play_volume, bool is_3D, float pan, glm::vec3 const &position, float half_volume_radius, bool loop, float priority) {
+		Sound::PlayingSample handle;
+		handle.is_3D = is_3D;
+		if (sample.frames == 0 && !sample.stream) return handle; //nothing to play
+		uint32_t slot;
+		if (!free_slots.pop(&slot)) return handle; //all voices busy
+		handle.slot = slot;
+		handle.generation = voices.generation[slot].load(std::memory_order_acquire);
+
+		Command command;
+		command.type = Command::Start;
+		command.loop = loop;
+		command.is_3D = is_3D;
+		command.storage = sample.storage;
+		if (sample.storage == Sound::Sample::Int16) {
+			command.data = sample.data_int16.data();
+		} else if (sample.storage == Sound::Sample::ADPCM) {
+			command.data = sample.data_adpcm.data();
+		} else {
+			command.data = sample.data.data();
+		}
+		command.size = sample.frames;
+		command.stream = sample.stream.get();
+		command.value = play_volume;
+		command.priority = priority;
+		if (is_3D) {
+			command.vec = position;
+			command.value2 = half_volume_radius;
+		} else {
+			command.value2 = pan;
+		}
+		submit(handle, std::move(command));
+		return handle;
+	}
 
 }
 
@@ -38,22 +248,55 @@ void mix_audio(void *, Uint8 *buffer_, int len);
 
 //------------------------ public-facing --------------------------------
 
-Sound::Sample::Sample(std::string const &filename) {
+Sound::Sample::Sample(std::string const &filename, Storage storage_) : storage(storage_) {
 	if (filename.size() >= 4 && filename.substr(filename.size()-4) == ".wav") {
-		load_wav(filename, &data);
+		if (storage == Streamed) {
+			std::cerr << "WARNING: streaming is only supported for '.opus' files; decoding '" << filename << "' instead." << std::endl;
+			storage = Decoded;
+		}
+		load_pcm_cached(filename, load_wav, &data);
 	} else if (filename.size() >= 5 && filename.substr(filename.size()-5) == ".opus") {
-		load_opus(filename, &data);
+		if (storage == Streamed) {
+			stream = std::make_shared< OpusStream >(filename);
+			return;
+		} else {
+			load_pcm_cached(filename, load_opus, &data);
+		}
 	} else {
 		throw std::runtime_error("Sample '" + filename + "' doesn't end in either \".wav\" or \".opus\" -- unsure how to load.");
 	}
+	store_decoded();
+}
+
+Sound::Sample::Sample(std::vector< float > const &data_, Storage storage_) : storage(storage_), data(data_) {
+	if (storage == Streamed) storage = Decoded;
+	store_decoded();
+}
+
+void Sound::Sample::store_decoded() {
+	assert(storage != Streamed);
+	frames = uint32_t(data.size());
+	if (storage == Int16) {
+		data_int16.resize(data.size());
+		encode_int16(data_int16.data(), data.data(), uint32_t(data.size()));
+	} else if (storage == ADPCM) {
+		encode_adpcm(data.data(), uint32_t(data.size()), &data_adpcm);
+	} else {
+		return; //Decoded -- keep 'data'
+	}
+	//release the float copy:
+	data = std::vector< float >();
 }
 
-Sound::Sample::Sample(std::vector< float > const &data_) : data(data_) {
+size_t Sound::Sample::memory_size() const {
+	return data.size() * sizeof(float) + data_int16.size() * sizeof(int16_t) + data_adpcm.size();
 }
 
 
 
-void Sound::init() {
+void Sound::init(uint32_t requested_block_frames) {
+	mix_block_frames = supported_block_frames(requested_block_frames);
+
 	if (SDL_InitSubSystem(SDL_INIT_AUDIO) != 0) {
 		std::cerr << "Failed to initialize SDL audio subsytem:\n" << SDL_GetError() << std::endl;
 		std::cerr << "  (Will continue without audio.)\n" << std::endl;
@@ -63,20 +306,28 @@ void Sound::init() {
 	//Based on the example on https://wiki.libsdl.org/SDL_OpenAudioDevice
 	SDL_AudioSpec want, have;
 	SDL_zero(want);
-	want.freq = AUDIO_RATE;
+	want.freq = Sound::AudioRate;
 	want.format = AUDIO_F32SYS;
 	want.channels = 2;
-	want.samples = MIX_SAMPLES;
+	want.samples = uint16_t(mix_block_frames);
 	want.callback = mix_audio;
 
-	device = SDL_OpenAudioDevice(nullptr, 0, &want, &have, 0);
+	//the device may pick a different buffer size (SDL converts any other format/rate/channel differences for us):
+	device = SDL_OpenAudioDevice(nullptr, 0, &want, &have, SDL_AUDIO_ALLOW_SAMPLES_CHANGE);
 	if (device == 0) {
 		std::cerr << "Failed to open audio device:\n" << SDL_GetError() << std::endl;
 		std::cerr << "  (Will continue without audio.)\n" << std::endl;
 	} else {
+		if (have.samples != want.samples) {
+			//mix in blocks that match the device's buffer, as far as possible:
+			// (callbacks of any length still work; they are mixed in several blocks)
+			std::cout << "Audio device uses " << have.samples << "-frame buffers (asked for " << want.samples << ")." << std::endl;
+			mix_block_frames = supported_block_frames(have.samples);
+		}
 		//start audio playback:
 		SDL_PauseAudioDevice(device, 0);
-		std::cout << "Audio output initialized." << std::endl;
+		std::cout << "Audio output initialized (" << mix_block_frames << "-frame blocks, "
+			<< (1000.0f * mix_block_frames / Sound::AudioRate) << "ms)." << std::endl;
 	}
 }
 
@@ -91,118 +342,196 @@ void Sound::shutdown() {
 }
 
 
+void Sound::init_offline(uint32_t requested_block_frames) {
+	assert(device == 0 && "init_offline() is instead of init(), not in addition to it");
+	mix_block_frames = supported_block_frames(requested_block_frames);
+}
+
+uint32_t Sound::mix_offline(float *out) {
+	assert(device == 0 && "offline mixing would race the audio device's callback");
+	wait_for_streams = true; //(no deadline to keep, so never skip streamed audio)
+	mix_audio(nullptr, reinterpret_cast< Uint8 * >(out), int(mix_block_frames * 2 * sizeof(float)));
+	return mix_block_frames;
+}
+
+uint32_t Sound::block_frames() {
+	return mix_block_frames;
+}
+
+
 void Sound::lock() {
-	if (device) SDL_LockAudioDevice(device);
+	if (!device) return;
+	auto before = std::chrono::steady_clock::now();
+	SDL_LockAudioDevice(device);
+	uint64_t waited = ns_since(before);
+	stat_counters.lock_calls.fetch_add(1, std::memory_order_relaxed);
+	stat_counters.lock_wait_ns_total.fetch_add(waited, std::memory_order_relaxed);
+	store_max(stat_counters.lock_wait_ns_max, waited);
 }
 
 void Sound::unlock() {
 	if (device) SDL_UnlockAudioDevice(device);
 }
 
-std::shared_ptr< Sound::PlayingSample > Sound::play(Sample const &sample, float play_volume, float pan) {
-	std::shared_ptr< Sound::PlayingSample > playing_sample = std::make_shared< Sound::PlayingSample >(sample, play_volume, pan, false);
-	lock();
-	playing_samples.emplace_back(playing_sample);
-	unlock();
-	return playing_sample;
+Sound::PlayingSample Sound::play(Sample const &sample, float play_volume, float pan, float priority) {
+	return start(sample, play_volume, false, pan, glm::vec3(0.0f), 0.0f, false, priority);
 }
 
-std::shared_ptr< Sound::PlayingSample > Sound::play_3D(Sample const &sample, float play_volume, glm::vec3 const &position, float half_volume_radius) {
-	std::shared_ptr< Sound::PlayingSample > playing_sample = std::make_shared< Sound::PlayingSample >(sample, play_volume, position, half_volume_radius, false);
-	lock();
-	playing_samples.emplace_back(playing_sample);
-	unlock();
-	return playing_sample;
+Sound::PlayingSample Sound::play_3D(Sample const &sample, float play_volume, glm::vec3 const &position, float half_volume_radius, float priority) {
+	return start(sample, play_volume, true, 0.0f, position, half_volume_radius, false, priority);
 }
 
-std::shared_ptr< Sound::PlayingSample > Sound::loop(Sample const &sample, float play_volume, float pan) {
-	std::shared_ptr< Sound::PlayingSample > playing_sample = std::make_shared< Sound::PlayingSample >(sample, play_volume, pan, true);
-	lock();
-	playing_samples.emplace_back(playing_sample);
-	unlock();
-	return playing_sample;
+Sound::PlayingSample Sound::loop(Sample const &sample, float play_volume, float pan, float priority) {
+	return start(sample, play_volume, false, pan, glm::vec3(0.0f), 0.0f, true, priority);
 }
 
+Sound::PlayingSample Sound::loop_3D(Sample const &sample, float play_volume, glm::vec3 const &position, float half_volume_radius, float priority) {
+	return start(sample, play_volume, true, 0.0f, position, half_volume_radius, true, priority);
+}
 
 
-std::shared_ptr< Sound::PlayingSample > Sound::loop_3D(Sample const &sample, float play_volume, glm::vec3 const &position, float half_volume_radius) {
-	std::shared_ptr< Sound::PlayingSample > playing_sample = std::make_shared< Sound::PlayingSample >(sample, play_volume, position, half_volume_radius, true);
-	lock();
-	playing_samples.emplace_back(playing_sample);
-	unlock();
-	return playing_sample;
+Sound::Stats Sound::stats() {
+	Stats ret;
+	ret.block_seconds = double(mix_block_frames) / double(Sound::AudioRate);
+	ret.blocks = stat_counters.blocks.load(std::memory_order_relaxed);
+	for (uint32_t b = 0; b < Stats::MixTimeBinCount; ++b) {
+		ret.mix_time_histogram[b] = stat_counters.mix_time_histogram[b].load(std::memory_order_relaxed);
+	}
+	ret.mix_seconds_total = stat_counters.mix_ns_total.load(std::memory_order_relaxed) * 1e-9;
+	ret.mix_seconds_max = stat_counters.mix_ns_max.load(std::memory_order_relaxed) * 1e-9;
+	ret.max_active_voices = stat_counters.max_active_voices.load(std::memory_order_relaxed);
+	ret.max_mixed_voices = stat_counters.max_mixed_voices.load(std::memory_order_relaxed);
+	ret.overruns = stat_counters.overruns.load(std::memory_order_relaxed);
+	ret.late_blocks = stat_counters.late_blocks.load(std::memory_order_relaxed);
+	ret.lock_calls = stat_counters.lock_calls.load(std::memory_order_relaxed);
+	ret.lock_wait_seconds_total = stat_counters.lock_wait_ns_total.load(std::memory_order_relaxed) * 1e-9;
+	ret.lock_wait_seconds_max = stat_counters.lock_wait_ns_max.load(std::memory_order_relaxed) * 1e-9;
+	ret.command_ring_full = stat_counters.command_ring_full.load(std::memory_order_relaxed);
+	return ret;
 }
 
+void Sound::reset_stats() {
+	stat_counters.reset();
+}
 
-void Sound::stop_all_samples() {
-	lock();
-	for (auto &s : playing_samples) {
-		s->stop();
+void Sound::Stats::print(std::ostream &out) const {
+	auto ms = [](double seconds) { return seconds * 1000.0; };
+	std::ios state(nullptr);
+	state.copyfmt(out);
+	out << std::fixed << std::setprecision(3);
+	out << "Audio: " << blocks << " blocks of " << ms(block_seconds) << "ms";
+	if (blocks) out << "; mix time avg " << ms(mix_seconds_total / blocks) << "ms, max " << ms(mix_seconds_max) << "ms";
+	out << "\n";
+	out << "  mix time (fraction of deadline):";
+	for (uint32_t b = 0; b < MixTimeBinCount; ++b) {
+		if (b + 1 < MixTimeBinCount) {
+			out << " <" << std::setprecision(0) << MixTimeBins[b] * 100.0f << "%: ";
+		} else {
+			out << " over: ";
+		}
+		out << mix_time_histogram[b];
 	}
-	unlock();
+	out << std::setprecision(3) << "\n";
+	out << "  voices: max " << max_active_voices << " playing, " << max_mixed_voices << " mixed\n";
+	out << "  likely underruns: " << overruns << " blocks over deadline, " << late_blocks << " late callbacks\n";
+	out << "  Sound::lock: " << lock_calls << " calls, waited " << ms(lock_wait_seconds_total) << "ms total, " << ms(lock_wait_seconds_max) << "ms max"
+		<< "; command ring full " << command_ring_full << " times" << std::endl;
+	out.copyfmt(state);
+}
+
+void Sound::stop_all_samples() {
+	Command command;
+	command.type = Command::StopAll;
+	command.ramp = 1.0f / 60.0f;
+	submit(std::move(command));
+}
+
+void Sound::set_voice_policy(VoicePolicy const &new_policy) {
+	Command command;
+	command.type = Command::SetVoicePolicy;
+	command.policy = new_policy;
+	command.policy.max_voices = std::max(1U, std::min(Sound::MaxVoices - Sound::FadeReserve, new_policy.max_voices));
+	submit(std::move(command));
 }
 
 void Sound::set_volume(float new_volume, float ramp) {
-	lock();
-	volume.set(new_volume, ramp);
-	unlock();
+	Command command;
+	command.type = Command::SetGlobalVolume;
+	command.value = new_volume;
+	command.ramp = ramp;
+	submit(std::move(command));
 }
 
 //------------------
 
 void Sound::PlayingSample::set_volume(float new_volume, float ramp) {
-	Sound::lock();
-	if (!stopping) {
-		volume.set(new_volume, ramp);
-	}
-	Sound::unlock();
+	Command command;
+	command.type = Command::SetVolume;
+	command.value = new_volume;
+	command.ramp = ramp;
+	submit(*this, std::move(command));
 }
 
 void Sound::PlayingSample::set_pan(float new_pan, float ramp) {
-	if (!(pan.value == pan.value)) return; //ignore if not in '2D' mode
-	Sound::lock();
-	pan.set(new_pan, ramp);
-	Sound::unlock();
+	if (is_3D) return; //ignore if not in '2D' mode
+	Command command;
+	command.type = Command::SetPan;
+	command.value = new_pan;
+	command.ramp = ramp;
+	submit(*this, std::move(command));
 }
 
 void Sound::PlayingSample::set_position(glm::vec3 const &new_position, float ramp) {
-	// if (pan.value == pan.value) return; //ignore if not in '3D' mode
-	Sound::lock();
-	position.set(new_position, ramp);
-	Sound::unlock();
+	// if (!is_3D) return; //ignore if not in '3D' mode
+	Command command;
+	command.type = Command::SetPosition;
+	command.vec = new_position;
+	command.ramp = ramp;
+	submit(*this, std::move(command));
 }
 
 void Sound::PlayingSample::set_half_volume_radius(float new_radius, float ramp) {
-	if (pan.value == pan.value) return; //ignore if not in '3D' mode
-	Sound::lock();
-	half_volume_radius.set(new_radius, ramp);
-	Sound::unlock();
+	if (!is_3D) return; //ignore if not in '3D' mode
+	Command command;
+	command.type = Command::SetHalfVolumeRadius;
+	command.value = new_radius;
+	command.ramp = ramp;
+	submit(*this, std::move(command));
+}
+
+void Sound::PlayingSample::seek(float seconds) {
+	Command command;
+	command.type = Command::Seek;
+	command.value = seconds;
+	submit(*this, std::move(command));
 }
 
 void Sound::PlayingSample::stop(float ramp) {
-	Sound::lock();
-	if (!(stopping || stopped)) {
-		stopping = true;
-		volume.target = 0.0f;
-		volume.ramp = ramp;
-	} else {
-		volume.ramp = std::min(volume.ramp, ramp);
-	}
-	Sound::unlock();
+	Command command;
+	command.type = Command::Stop;
+	command.ramp = ramp;
+	submit(*this, std::move(command));
+}
+
+bool Sound::PlayingSample::stopped() const {
+	if (slot == -1U) return true;
+	return voices.generation[slot].load(std::memory_order_acquire) != generation;
 }
 
 //------------------
 
 void Sound::Listener::set_position_right(glm::vec3 const &new_position, glm::vec3 const &new_right, float ramp) {
-	Sound::lock();
-	position.set(new_position, ramp);
+	Command command;
+	command.type = Command::SetListener;
+	command.vec = new_position;
 	//some extra code to make sure right is always a unit vector:
 	if (new_right == glm::vec3(0.0f)) {
-		right.set(glm::vec3(1.0f, 0.0f, 0.0f), ramp);
+		command.vec2 = glm::vec3(1.0f, 0.0f, 0.0f);
 	} else {
-		right.set(glm::normalize(new_right), ramp);
+		command.vec2 = glm::normalize(new_right);
 	}
-	Sound::unlock();
+	command.ramp = ramp;
+	submit(std::move(command));
 }
 
 //------------------------ internals --------------------------------
@@ -251,34 +580,34 @@ void compute_pan_from_listener_and_position(
 	}
 }
 
-//helper: ramp updates...
-constexpr float const RAMP_STEP = float(MIX_SAMPLES) / float(AUDIO_RATE);
+//helper: ramp updates, advancing 'step' seconds (the length of the block being mixed)...
+// (ramps move linearly in time, so a ramp ends up in the same place whatever the block size)
 
 //helper: ...for single values:
-void step_value_ramp(Sound::Ramp< float > &ramp) {
-	if (ramp.ramp < RAMP_STEP) {
+void step_value_ramp(Sound::Ramp< float > &ramp, float step) {
+	if (ramp.ramp < step) {
 		ramp.value = ramp.target;
 		ramp.ramp = 0.0f;
 	} else {
-		ramp.value += (RAMP_STEP / ramp.ramp) * (ramp.target - ramp.value);
-		ramp.ramp -= RAMP_STEP;
+		ramp.value += (step / ramp.ramp) * (ramp.target - ramp.value);
+		ramp.ramp -= step;
 	}
 }
 
 //helper: ...for 3D positions:
-void step_position_ramp(Sound::Ramp< glm::vec3 > &ramp) {
-	if (ramp.ramp < RAMP_STEP) {
+void step_position_ramp(Sound::Ramp< glm::vec3 > &ramp, float step) {
+	if (ramp.ramp < step) {
 		ramp.value = ramp.target;
 		ramp.ramp = 0.0f;
 	} else {
-		ramp.value = glm::mix(ramp.value, ramp.target, RAMP_STEP / ramp.ramp);
-		ramp.ramp -= RAMP_STEP;
+		ramp.value = glm::mix(ramp.value, ramp.target, step / ramp.ramp);
+		ramp.ramp -= step;
 	}
 }
 
 //helper: ...for 3D directions:
-void step_direction_ramp(Sound::Ramp< glm::vec3 > &ramp) {
-	if (ramp.ramp < RAMP_STEP) {
+void step_direction_ramp(Sound::Ramp< glm::vec3 > &ramp, float step) {
+	if (ramp.ramp < step) {
 		ramp.value = ramp.target;
 		ramp.ramp = 0.0f;
 	} else {
@@ -302,28 +631,231 @@ void step_direction_ramp(Sound::Ramp< glm::vec3 > &ramp) {
 		float angle = std::acos(glm::clamp(glm::dot(ramp.value, ramp.target), -1.0f, 1.0f));
 
 		//figure out new target value by moving angle toward target:
-		angle *= (ramp.ramp - RAMP_STEP) / ramp.ramp;
+		angle *= (ramp.ramp - step) / ramp.ramp;
 
 		ramp.value = ramp.target * std::cos(angle) + perp * std::sin(angle);
-		ramp.ramp -= RAMP_STEP;
+		ramp.ramp -= step;
 	}
 }
 
 
-//The audio callback -- invoked by SDL when it needs more sound to play:
-void mix_audio(void *, Uint8 *buffer_, int len) {
-	assert(buffer_); //should always have some audio buffer
+//helper: fade out a playing voice:
+void stop_voice(uint32_t v, float ramp) {
+	if (!voices.stopping[v]) {
+		voices.stopping[v] = true;
+		voices.stopping_count += 1;
+		voices.volume[v].target = 0.0f;
+		voices.volume[v].ramp = ramp;
+	} else {
+		voices.volume[v].ramp = std::min(voices.volume[v].ramp, ramp);
+	}
+}
 
-	struct LR {
-		float l;
-		float r;
-	};
-	static_assert(sizeof(LR) == 8, "Sample is packed");
-	assert(len == MIX_SAMPLES * sizeof(LR)); //should always have the expected number of samples
-	LR *buffer = reinterpret_cast< LR * >(buffer_);
+//helper: return a slot to the free pool:
+void release_slot(uint32_t v) {
+	//invalidate outstanding handles *before* the slot can be handed out again:
+	voices.generation[v].fetch_add(1, std::memory_order_release);
+	bool pushed = free_slots.push(v);
+	assert(pushed && "free slot ring can hold every voice");
+	(void)pushed;
+}
+
+//helper: remove a voice from the active list and free its slot; 'a' is its index in voices.active:
+void retire_voice(uint32_t a) {
+	assert(a < voices.active_count);
+	uint32_t v = voices.active[a];
+	if (voices.stopping[v]) voices.stopping_count -= 1;
+	release_slot(v);
+	voices.active[a] = voices.active[--voices.active_count];
+}
+
+//helper: voice limiting score (higher is more important to keep):
+float voice_score(uint32_t v) {
+	float age = float(voices.age[v]) / float(Sound::AudioRate);
+	return voices.priority[v] * voices.audibility[v] / (1.0f + policy.age_weight * age);
+}
+
+//voices that lose their place to a more important voice fade out over this long (rather than clicking off):
+constexpr float StealRamp = 0.005f;
+
+//helper: index in voices.active of the lowest-scoring voice that isn't already fading out:
+uint32_t lowest_scoring_voice() {
+	assert(voices.active_count > voices.stopping_count);
+	uint32_t lowest = -1U;
+	float lowest_score = std::numeric_limits< float >::infinity();
+	for (uint32_t a = 0; a < voices.active_count; ++a) {
+		uint32_t v = voices.active[a];
+		if (voices.stopping[v]) continue;
+		float score = voice_score(v);
+		if (lowest == -1U || score < lowest_score) {
+			lowest = a;
+			lowest_score = score;
+		}
+	}
+	return lowest;
+}
+
+//helper: loudest channel gain of a voice at the current listener position:
+float compute_audibility(uint32_t v) {
+	float l, r;
+	if (voices.is_3D[v]) {
+		compute_pan_from_listener_and_position(
+			Sound::listener.position.value, Sound::listener.right.value,
+			voices.position[v].value,
+			voices.half_volume_radius[v].value,
+			&l, &r);
+	} else {
+		compute_pan_weights(voices.pan[v].value, &l, &r);
+	}
+	return std::max(std::abs(l), std::abs(r)) * voices.volume[v].value;
+}
+
+void apply_commands() {
+	Command command;
+	while (commands.pop(&command)) {
+		//commands for voices that have since finished are dropped:
+		if (command.slot != -1U
+		 && voices.generation[command.slot].load(std::memory_order_relaxed) != command.generation) continue;
+		uint32_t v = command.slot;
+		switch (command.type) {
+			case Command::Start: {
+				voices.storage[v] = command.storage;
+				voices.data[v] = command.data;
+				voices.size[v] = command.size;
+				voices.i[v] = 0;
+				voices.stream[v] = command.stream;
+				voices.loop[v] = command.loop;
+				voices.stopping[v] = false;
+				voices.is_3D[v] = command.is_3D;
+				voices.volume[v].set(command.value, 0.0f);
+				if (command.is_3D) {
+					voices.position[v].set(command.vec, 0.0f);
+					voices.half_volume_radius[v].set(command.value2, 0.0f);
+				} else {
+					voices.pan[v].set(command.value2, 0.0f);
+				}
+				voices.priority[v] = command.priority;
+				voices.age[v] = 0;
+				voices.audibility[v] = compute_audibility(v);
+
+				//at the voice cap, the least important of the playing voices and this one has to go:
+				bool dropped = false;
+				while (voices.active_count - voices.stopping_count >= policy.max_voices) {
+					uint32_t lowest = lowest_scoring_voice();
+					if (voice_score(v) <= voice_score(voices.active[lowest])) {
+						dropped = true;
+						break;
+					}
+					stop_voice(voices.active[lowest], StealRamp);
+				}
+				if (dropped) {
+					release_slot(v);
+					break;
+				}
+				assert(voices.active_count < Sound::MaxVoices);
+
+				if (command.stream) {
+					//a stream can only feed one voice, so cut off any voice already using it:
+					for (uint32_t a = 0; a < voices.active_count; ++a) {
+						if (voices.stream[voices.active[a]] == command.stream) {
+							retire_voice(a);
+							break;
+						}
+					}
+					command.stream->start(command.loop);
+				}
+				voices.active[voices.active_count++] = v;
+				break;
+			}
+			case Command::Stop:
+				stop_voice(v, command.ramp);
+				break;
+			case Command::SetVolume:
+				if (!voices.stopping[v]) {
+					voices.volume[v].set(command.value, command.ramp);
+				}
+				break;
+			case Command::SetPan:
+				voices.pan[v].set(command.value, command.ramp);
+				break;
+			case Command::SetPosition:
+				voices.position[v].set(command.vec, command.ramp);
+				break;
+			case Command::SetHalfVolumeRadius:
+				voices.half_volume_radius[v].set(command.value, command.ramp);
+				break;
+			case Command::StopAll:
+				for (uint32_t a = 0; a < voices.active_count; ++a) {
+					stop_voice(voices.active[a], command.ramp);
+				}
+				break;
+			case Command::SetGlobalVolume:
+				Sound::volume.set(command.value, command.ramp);
+				break;
+			case Command::SetListener:
+				Sound::listener.position.set(command.vec, command.ramp);
+				Sound::listener.right.set(command.vec2, command.ramp);
+				break;
+			case Command::SetVoicePolicy:
+				policy = command.policy;
+				while (voices.active_count - voices.stopping_count > policy.max_voices) {
+					stop_voice(voices.active[lowest_scoring_voice()], StealRamp);
+				}
+				break;
+			case Command::Seek: {
+				uint64_t frame = uint64_t(std::max(0.0f, command.value) * Sound::AudioRate);
+				if (OpusStream *stream = voices.stream[v]) {
+					if (!voices.loop[v] && stream->length != 0 && frame >= stream->length) {
+						stop_voice(v, 0.0f);
+					} else {
+						stream->seek(frame);
+					}
+				} else if (voices.loop[v]) {
+					voices.i[v] = uint32_t(frame % voices.size[v]);
+				} else {
+					//(seeking to the end finishes the voice during the next mix)
+					voices.i[v] = uint32_t(std::min< uint64_t >(frame, voices.size[v]));
+				}
+				break;
+			}
+		}
+	}
+}
+
+//helper: frames [i, i + count) of a (non-streamed) voice's sample, as floats:
+// points into the sample itself for Decoded storage; otherwise decodes into decode_scratch (so count <= MaxBlockFrames).
+float const *voice_frames(uint32_t v, uint32_t i, uint32_t count) {
+	assert(count <= Sound::MaxBlockFrames);
+	if (voices.storage[v] == Sound::Sample::Int16) {
+		decode_int16(decode_scratch, static_cast< int16_t const * >(voices.data[v]) + i, count);
+		return decode_scratch;
+	} else if (voices.storage[v] == Sound::Sample::ADPCM) {
+		decode_adpcm(decode_scratch, static_cast< uint8_t const * >(voices.data[v]), i, count);
+		return decode_scratch;
+	} else {
+		return static_cast< float const * >(voices.data[v]) + i;
+	}
+}
+
+//stereo output frame:
+struct LR {
+	float l;
+	float r;
+};
+static_assert(sizeof(LR) == 8, "Sample is packed");
+
+//helper: mix one block of 'frames' (at most mix_block_frames) into 'buffer'; returns the number of voices mixed (not virtual):
+uint32_t mix_block(LR *buffer, uint32_t const frames) {
+	assert(frames <= Sound::MaxBlockFrames);
+	float const step = float(frames) / float(Sound::AudioRate); //ramp time covered by this block
+
+	//bring mixer state up to date with the game thread:
+	apply_commands();
+	store_max(stat_counters.max_active_voices, voices.active_count);
+	uint32_t mixed_voices = 0;
 
 	//zero the output buffer:
-	for (uint32_t s = 0; s < MIX_SAMPLES; ++s) {
+	for (uint32_t s = 0; s < frames; ++s) {
 		buffer[s].l = 0.0f;
 		buffer[s].r = 0.0f;
 	}
@@ -333,106 +865,175 @@ void mix_audio(void *, Uint8 *buffer_, int len) {
 	glm::vec3 start_position =  Sound::listener.position.value;
 	glm::vec3 start_right =  Sound::listener.right.value;
 
-	step_value_ramp(Sound::volume);
-	step_position_ramp( Sound::listener.position);
-	step_direction_ramp( Sound::listener.right);
+	step_value_ramp(Sound::volume, step);
+	step_position_ramp(Sound::listener.position, step);
+	step_direction_ramp(Sound::listener.right, step);
 
 	float end_volume = Sound::volume.value;
 	glm::vec3 end_position =  Sound::listener.position.value;
 	glm::vec3 end_right =  Sound::listener.right.value;
 
-	//add audio from each playing sample into the buffer:
-	for (auto si = playing_samples.begin(); si != playing_samples.end(); /* later */) {
-		Sound::PlayingSample &playing_sample = **si; //much more convenient than writing ** everywhere.
+	//add audio from each playing voice into the buffer:
+	for (uint32_t a = 0; a < voices.active_count; /* later */) {
+		uint32_t v = voices.active[a];
 
 		//Figure out sample panning/volume at start...
 		LR start_pan;
-		if (!(playing_sample.pan.value == playing_sample.pan.value)) {
+		if (voices.is_3D[v]) {
 			//3D panning
 			compute_pan_from_listener_and_position(
 				start_position, start_right,
-				playing_sample.position.value,
-				playing_sample.half_volume_radius.value,
+				voices.position[v].value,
+				voices.half_volume_radius[v].value,
 				&start_pan.l, &start_pan.r);
 
-			step_position_ramp(playing_sample.position);
-			step_value_ramp(playing_sample.half_volume_radius);
+			step_position_ramp(voices.position[v], step);
+			step_value_ramp(voices.half_volume_radius[v], step);
 		} else {
 			//2D panning
-			compute_pan_weights(playing_sample.pan.value, &start_pan.l, &start_pan.r);
+			compute_pan_weights(voices.pan[v].value, &start_pan.l, &start_pan.r);
 
-			step_value_ramp(playing_sample.pan);
+			step_value_ramp(voices.pan[v], step);
 		}
-		start_pan.l *= start_volume * playing_sample.volume.value;
-		start_pan.r *= start_volume * playing_sample.volume.value;
+		start_pan.l *= start_volume * voices.volume[v].value;
+		start_pan.r *= start_volume * voices.volume[v].value;
 
-		step_value_ramp(playing_sample.volume);
+		step_value_ramp(voices.volume[v], step);
 
 		//..and end of the mix period:
 		LR end_pan;
-		if (!(playing_sample.pan.value == playing_sample.pan.value)) {
+		if (voices.is_3D[v]) {
 			//3D panning
 			compute_pan_from_listener_and_position(
 				end_position, end_right,
-				playing_sample.position.value,
-				playing_sample.half_volume_radius.value,
+				voices.position[v].value,
+				voices.half_volume_radius[v].value,
 				&end_pan.l, &end_pan.r);
 		} else {
 			//2D panning
-			compute_pan_weights(playing_sample.pan.value, &end_pan.l, &end_pan.r);
+			compute_pan_weights(voices.pan[v].value, &end_pan.l, &end_pan.r);
 		}
 
-		end_pan.l *= end_volume * playing_sample.volume.value;
-		end_pan.r *= end_volume * playing_sample.volume.value;
+		end_pan.l *= end_volume * voices.volume[v].value;
+		end_pan.r *= end_volume * voices.volume[v].value;
 
 		//figure out a step to add at each sample so that pan will move smoothly from start to end:
-		LR pan = start_pan;
 		LR pan_step;
-		pan_step.l = (end_pan.l - start_pan.l) / MIX_SAMPLES;
-		pan_step.r = (end_pan.r - start_pan.r) / MIX_SAMPLES;
-
-		assert(playing_sample.i < playing_sample.data.size());
-
-		for (uint32_t i = 0; i < MIX_SAMPLES; ++i) {
-			//mix one sample based on current pan values:
-			buffer[i].l += pan.l * playing_sample.data[playing_sample.i];
-			buffer[i].r += pan.r * playing_sample.data[playing_sample.i];
-
-			//update position in sample:
-			playing_sample.i += 1;
-			if (playing_sample.i == playing_sample.data.size()) {
-				if (playing_sample.loop) {
-					playing_sample.i = 0;
+		pan_step.l = (end_pan.l - start_pan.l) / frames;
+		pan_step.r = (end_pan.r - start_pan.r) / frames;
+
+		voices.audibility[v] = std::max(
+			std::max(std::abs(start_pan.l), std::abs(start_pan.r)),
+			std::max(std::abs(end_pan.l), std::abs(end_pan.r))
+		);
+		voices.age[v] += frames;
+		bool const audible = (voices.audibility[v] >= policy.virtual_threshold);
+		mixed_voices += audible;
+
+		bool finished = false;
+		if (OpusStream *stream = voices.stream[v]) {
+			//streamed voice -- read even when virtual, so the stream keeps its place:
+			// (if the decoder has fallen behind, the rest of the block is silent -- except offline, where it's waited for)
+			uint32_t count = stream->read(decode_scratch, frames, wait_for_streams);
+			if (audible) {
+				mix_mono_to_stereo(&buffer[0].l, decode_scratch, count,
+					start_pan.l, start_pan.r, pan_step.l, pan_step.r);
+			}
+			finished = stream->finished();
+		} else {
+			uint32_t const size = voices.size[v];
+			uint32_t i = voices.i[v];
+			assert(i < size || !voices.loop[v]);
+
+			if (!audible) {
+				//virtual voice -- too quiet to hear, so just advance the play position:
+				if (voices.loop[v]) {
+					i = uint32_t((uint64_t(i) + frames) % size);
 				} else {
-					break;
+					i = uint32_t(std::min< uint64_t >(uint64_t(i) + frames, size));
+				}
+			} else {
+				//mix in spans that don't run off the end of the sample data:
+				for (uint32_t s = 0; s < frames; /* later */) {
+					uint32_t count = std::min(frames - s, size - i);
+					mix_mono_to_stereo(&buffer[s].l, voice_frames(v, i, count), count,
+						start_pan.l + float(s) * pan_step.l, start_pan.r + float(s) * pan_step.r,
+						pan_step.l, pan_step.r);
+					s += count;
+
+					//update position in sample:
+					i += count;
+					if (i == size) {
+						if (voices.loop[v]) {
+							i = 0;
+						} else {
+							break;
+						}
+					}
 				}
 			}
-
-			//update pan values:
-			pan.l += pan_step.l;
-			pan.r += pan_step.r;
+			voices.i[v] = i;
+			finished = (i >= size);
 		}
 
-		if (playing_sample.i >= playing_sample.data.size()
-		 || (playing_sample.stopping && playing_sample.volume.value == 0.0f)) { //sample has finished
-		 	playing_sample.stopped = true;
-			//erase from list:
-			auto old = si;
-			++si;
-			playing_samples.erase(old);
+		if (finished
+		 || (voices.stopping[v] && voices.volume[v].value == 0.0f)) { //sample has finished
+			//swap last active voice into this position (so don't advance 'a'):
+			retire_voice(a);
 		} else {
-			++si;
+			++a;
 		}
 	}
 
 	/*//DEBUG: report output power:
 	float max_power = 0.0f;
-	for (uint32_t s = 0; s < MIX_SAMPLES; ++s) {
+	for (uint32_t s = 0; s < frames; ++s) {
 		max_power = std::max(max_power, (buffer[s].l * buffer[s].l + buffer[s].r * buffer[s].r));
 	}
-	std::cout << "Max Power: " << std::sqrt(max_power) << "; playing samples: " << playing_samples.size() << std::endl; //DEBUG
+	std::cout << "Max Power: " << std::sqrt(max_power) << "; playing samples: " << voices.active_count << std::endl; //DEBUG
 	*/
 
+	return mixed_voices;
+}
+
+//The audio callback -- invoked by SDL when it needs more sound to play:
+void mix_audio(void *, Uint8 *buffer_, int len) {
+	assert(buffer_); //should always have some audio buffer
+	assert(len >= 0 && len % sizeof(LR) == 0); //should always be whole stereo frames
+	LR *buffer = reinterpret_cast< LR * >(buffer_);
+	uint32_t const frames = uint32_t(len) / sizeof(LR);
+
+	//callbacks should arrive about one callback's worth of audio apart; a much longer gap means the device was probably starved:
+	// (offline mixing isn't paced, so only check when a device is running)
+	auto const callback_start = std::chrono::steady_clock::now();
+	uint64_t const callback_ns = uint64_t(frames) * 1000000000ULL / Sound::AudioRate;
+	static std::chrono::steady_clock::time_point previous_start;
+	if (device && previous_start != std::chrono::steady_clock::time_point()
+	 && uint64_t(std::chrono::duration_cast< std::chrono::nanoseconds >(callback_start - previous_start).count()) > 2 * callback_ns) {
+		stat_counters.late_blocks.fetch_add(1, std::memory_order_relaxed);
+	}
+	previous_start = callback_start;
+
+	//mix (in blocks of at most mix_block_frames):
+	uint32_t mixed_voices = 0;
+	for (uint32_t s = 0; s < frames; /* later */) {
+		uint32_t count = std::min(mix_block_frames, frames - s);
+		mixed_voices = std::max(mixed_voices, mix_block(buffer + s, count));
+		s += count;
+	}
+
+	//update stats:
+	store_max(stat_counters.max_mixed_voices, mixed_voices);
+	uint64_t mix_ns = ns_since(callback_start);
+	uint32_t bin = 0;
+	while (bin + 1 < Sound::Stats::MixTimeBinCount && !(double(mix_ns) < double(Sound::Stats::MixTimeBins[bin]) * callback_ns)) {
+		++bin;
+	}
+	stat_counters.mix_time_histogram[bin].fetch_add(1, std::memory_order_relaxed);
+	stat_counters.mix_ns_total.fetch_add(mix_ns, std::memory_order_relaxed);
+	store_max(stat_counters.mix_ns_max, mix_ns);
+	if (mix_ns > callback_ns) stat_counters.overruns.fetch_add(1, std::memory_order_relaxed);
+	stat_counters.blocks.fetch_add(1, std::memory_order_relaxed);
 }
 
 
@@ -2,27 +2,64 @@
 
 #include <glm/glm.hpp>
 
-#include <memory>
 #include <vector>
 #include <string>
+#include <memory>
 #include <cmath>
+#include <cstdint>
+#include <iosfwd>
+#include <limits>
+
+struct OpusStream;
 
 //Game audio system. Simplified from f18-base3.
 //Uses 48kHz sampling rate.
+//
+//The public functions below never block on the audio callback; instead, they
+// queue commands that the mixer applies at the start of its next block.
 
 namespace Sound {
 
 //Sample objects hold mono (one-channel) audio.
 struct Sample {
+	//How a sample's audio is kept in memory:
+	enum Storage {
+		Decoded, //decode the whole file when loading (32-bit float; 192kB per second)
+		Streamed, //decode while playing, with constant memory use ('.opus' only; good for long music tracks)
+		Int16, //decode when loading and keep as 16-bit integers (half the memory of Decoded)
+		ADPCM, //decode when loading and keep as 4-bit IMA-ADPCM (about an eighth of the memory of Decoded; slightly lossy)
+	};
+
 	//Load from a '.wav' or '.opus' file.
 	//  will warn and convert if sound is not already 48kHz mono:
-	Sample(std::string const &filename);
+	//  ('.wav' files are always decoded; Streamed is treated as Decoded with a warning)
+	//  decoded audio is cached next to the source file (see pcm_cache.hpp), so later loads skip decoding.
+	Sample(std::string const &filename, Storage storage = Decoded);
 	
-	//Directly supply an audio buffer:
-	Sample(std::vector< float > const &data);
+	//Directly supply an audio buffer (Streamed is treated as Decoded):
+	Sample(std::vector< float > const &data, Storage storage = Decoded);
 
-	//sample data is stored as 48kHz, mono, floating-point:
+	Storage storage = Decoded;
+
+	//decoded sample data is stored as 48kHz, mono, floating-point:
 	std::vector< float > data;
+
+	//Int16 and ADPCM samples are stored in one of these instead of 'data', and decoded a span at a time while mixing:
+	std::vector< int16_t > data_int16;
+	std::vector< uint8_t > data_adpcm; //blocks of ADPCMBlockFrames frames (see mix_kernel.hpp)
+	uint32_t frames = 0; //length in frames of whichever of the above is in use (0 for streamed samples)
+
+	//streamed samples decode into a small ring buffer instead of 'data':
+	// NOTE: a streamed sample can only be played by one voice at a time;
+	//  playing it again restarts the stream (and stops the earlier voice).
+	std::shared_ptr< OpusStream > stream;
+
+	//bytes of memory used by the sample's audio (not counting a stream's decoder):
+	size_t memory_size() const;
+
+	//internals:
+	//move freshly decoded audio from 'data' into the storage 'storage' asks for:
+	void store_decoded();
 };
 
 //Ramp<> manages values that should be smoothly interpolated
@@ -48,9 +85,11 @@ struct Ramp {
 	float ramp = 0.0f;
 };
 
-// 'PlayingSample' objects book-keep samples that are currently playing:
+// 'PlayingSample' handles refer to samples that are currently playing:
+// (the voice itself lives in a fixed-size pool owned by the mixer; handles are
+//  cheap to copy and become harmlessly stale once playback finishes)
 struct PlayingSample {
-	//change the panning or volume of a playing sample (and do proper locking);
+	//change the panning or volume of a playing sample (queued for the mixer thread);
 	// value will change over 'ramp' seconds to avoid creating audible artifacts:
 	void set_volume(float new_volume, float ramp = 1.0f / 60.0f);
 	//set the panning of a sample (use only on samples in "2D" mode; no effect on "3D" samples):
@@ -60,67 +99,85 @@ struct PlayingSample {
 	//set the half-volume radius (use only on "3D" playing sounds):
 	void set_half_volume_radius(float new_radius, float ramp = 1.0f / 60.0f);
 
+	//jump to 'seconds' from the start of the sample (wraps for looping samples; seeking past the end of a non-looping sample ends playback):
+	void seek(float seconds);
+
 	//'stop' will fade sample out over 'ramp' seconds and then remove it from the active samples:
 	void stop(float ramp = 1.0f / 60.0f);
 
+	//was playback stopped (either by running out of sample, by stop(), or because no voice was available)?
+	bool stopped() const;
+
 	//internals:
-	//NOTE: PlayingSample is used in a separate thread; so setting these values directly
-	// may result in bad results. Instead, use the functions above, which perform locking!
-	std::vector< float > const &data; //reference to sample data being played
-	uint32_t i = 0; //next data value to read
-	bool loop = false; //should playback loop after data runs out?
-	bool stopping = false; //is playing stopping?
-	bool stopped = false; //was playback stopped (either by running out of sample, or by stop())?
-
-	Ramp< float > volume = Ramp< float >(1.0f);
-
-	//2D playback panning control: ('NaN' if sound played in 3D mode)
-	Ramp< float > pan = Ramp< float >(std::numeric_limits< float >::quiet_NaN());
-
-	//3D playback panning control: ('NaN' if sound played in 2D mode)
-	Ramp< glm::vec3 > position = Ramp< glm::vec3 >(std::numeric_limits< float >::quiet_NaN());
-	Ramp< float > half_volume_radius = std::numeric_limits< float >::quiet_NaN();
-
-	PlayingSample(Sample const &sample_, float volume_, float pan_, bool loop_)
-		: data(sample_.data), loop(loop_), volume(volume_), pan(pan_) { }
-	PlayingSample(Sample const &sample_, float volume_, glm::vec3 const &position_, float half_volume_radius_, bool loop_)
-		: data(sample_.data), loop(loop_), volume(volume_), position(position_), half_volume_radius(half_volume_radius_) { }
+	//NOTE: the voice is updated in a separate thread; the functions above queue commands for the mixer,
+	// which ignores commands whose generation no longer matches the voice in 'slot'.
+	uint32_t slot = -1U; //index into the mixer's voice pool (-1U for a handle that never played)
+	uint32_t generation = 0; //generation of 'slot' when this sample started playing
+	bool is_3D = false; //was sample played with play_3D/loop_3D?
 };
 
 // ------- global functions -------
 
-void init(); //call Sound::init() from main.cpp before using any member functions
+//The mixer runs at a fixed rate; samples are converted to it as they are loaded:
+constexpr uint32_t const AudioRate = 48000; //frames per second
+
+//The mixer works in blocks of a power-of-two number of frames, from MinBlockFrames to MaxBlockFrames:
+// smaller blocks mean lower latency (64 frames is 1.3ms, 1024 is 21ms) but cost more CPU per second of
+// audio and leave less slack before a slow block is heard as a dropout.
+constexpr uint32_t const MinBlockFrames = 64;
+constexpr uint32_t const MaxBlockFrames = 4096;
+constexpr uint32_t const DefaultBlockFrames = 1024;
+
+//call Sound::init() from main.cpp before using any member functions:
+// (other sizes are rounded to a supported one; if the device insists on a different buffer size, the mixer follows it)
+void init(uint32_t block_frames = DefaultBlockFrames);
 
 void shutdown(); //call Sound::shutdown() from main.cpp to gracefully(-ish) exit
 
+//Offline rendering -- drive the mixer directly instead of from an audio device (e.g., for benchmarks):
+// mix the next block of output into 'out' as interleaved stereo (left, right, left, ...) floats,
+// applying any queued commands first; returns the number of stereo frames written (always block_frames()).
+// Streamed samples are waited for rather than skipped when their decoder is behind, so output is repeatable.
+// Only call when no device is open (that is, instead of init()).
+uint32_t mix_offline(float *out);
+//set the block size for offline mixing (optional; call instead of init()):
+void init_offline(uint32_t block_frames = DefaultBlockFrames);
+//stereo frames per mix block:
+uint32_t block_frames();
+
 //Call 'Sound::play' to play a sample once.
 //  if you hang on to the return value, you can change the panning, volume, or stop playback early.
-std::shared_ptr< PlayingSample > play(
+//  'priority' scales how important the sample is when voices must be culled (see VoicePolicy).
+PlayingSample play(
 	Sample const &sample,
 	float volume = 1.0f,
-	float pan = 0.0f //-1.0f == hard left, 1.0f == hard right
+	float pan = 0.0f, //-1.0f == hard left, 1.0f == hard right
+	float priority = 1.0f
 );
 //The play_3D version will play a sample in '3D' mode (that is, panning determined by listener position):
-std::shared_ptr< PlayingSample > play_3D(
+PlayingSample play_3D(
 	Sample const &sample,
 	float volume,
 	glm::vec3 const &position,
-	float half_volume_radius = std::numeric_limits< float >::infinity()
+	float half_volume_radius = std::numeric_limits< float >::infinity(),
+	float priority = 1.0f
 );
 
 //Call 'Sound::loop' to play a sample ~forever~.
 //  if you hang on to the return value, you can change the panning, volume, or stop playback.
-std::shared_ptr< PlayingSample > loop(
+PlayingSample loop(
 	Sample const &sample,
 	float volume = 1.0f,
-	float pan = 0.0f //-1.0f == hard left, 1.0f == hard right
+	float pan = 0.0f, //-1.0f == hard left, 1.0f == hard right
+	float priority = 1.0f
 );
 //The loop_3D version will loop a sample in '3D' mode (that is, panning determined by listener position):
-std::shared_ptr< PlayingSample > loop_3D(
+PlayingSample loop_3D(
 	Sample const &sample,
 	float volume,
 	glm::vec3 const &position,
-	float half_volume_radius = std::numeric_limits< float >::infinity()
+	float half_volume_radius = std::numeric_limits< float >::infinity(),
+	float priority = 1.0f
 );
 
 //Listener controls the panning of "3D" samples (ones played using the "position" version of the play functions):
@@ -133,6 +190,65 @@ struct Listener {
 };
 extern struct Listener listener;
 
+//maximum number of samples that can be playing at once:
+// (play/loop return a stopped handle if all voices are busy)
+constexpr uint32_t const MaxVoices = 256;
+//voice slots kept beyond VoicePolicy::max_voices for voices that are fading out:
+constexpr uint32_t const FadeReserve = 32;
+
+//VoicePolicy controls how the mixer limits its work when many samples are playing.
+//Each voice gets a score every mix block:
+//   score = priority * audibility / (1 + age_weight * age)
+// where 'audibility' is the loudest channel gain after volume and 3D attenuation,
+// and 'age' is the time (in seconds) since the voice started.
+struct VoicePolicy {
+	//when a sample starts and this many voices are already playing, the lowest-scoring
+	// of them and the new voice loses: an existing voice is quickly faded out to make room
+	// (fading voices don't count against the cap), or the new voice is never started.
+	//(clamped to MaxVoices - FadeReserve, so faded-out voices always have slots to finish in)
+	uint32_t max_voices = 64;
+	//voices with audibility below this are 'virtual' -- their play position keeps
+	// advancing, but they aren't mixed:
+	float virtual_threshold = 1.0e-3f;
+	//how quickly older voices lose score:
+	float age_weight = 0.5f;
+};
+void set_voice_policy(VoicePolicy const &policy);
+
+//Stats are counters describing how the mixer is keeping up (see Sound::stats()):
+struct Stats {
+	double block_seconds = 0.0; //duration of one mix block -- the mixer's deadline for producing it
+	uint64_t blocks = 0; //device callbacks (or mix_offline calls) handled; each usually mixes one block
+
+	//time spent in each callback, as a histogram over fractions of the audio it produced:
+	// bin b counts callbacks with mix time below MixTimeBins[b] * (callback duration) (and at or above the previous bin's limit);
+	// the last bin counts callbacks that took longer than their deadline.
+	static constexpr uint32_t MixTimeBinCount = 8;
+	static constexpr float MixTimeBins[MixTimeBinCount] = { 0.05f, 0.1f, 0.2f, 0.3f, 0.5f, 0.75f, 1.0f, std::numeric_limits< float >::infinity() };
+	uint64_t mix_time_histogram[MixTimeBinCount] = {};
+	double mix_seconds_total = 0.0;
+	double mix_seconds_max = 0.0;
+
+	uint32_t max_active_voices = 0; //most voices playing during any block
+	uint32_t max_mixed_voices = 0; //most voices actually mixed (not virtual) during any block
+
+	//likely underruns -- the device ran out of audio, which is heard as a click or dropout:
+	uint64_t overruns = 0; //blocks that took longer to mix than they take to play
+	uint64_t late_blocks = 0; //callbacks that arrived more than two blocks after the previous one (device was probably starved)
+
+	//game-thread stalls:
+	uint64_t lock_calls = 0; //calls to Sound::lock() (including those made when the command ring was full)
+	double lock_wait_seconds_total = 0.0; //time spent waiting for the mixer in Sound::lock()
+	double lock_wait_seconds_max = 0.0;
+	uint64_t command_ring_full = 0; //commands that had to wait for the ring to be drained
+
+	//write a human-readable summary:
+	void print(std::ostream &out) const;
+};
+//snapshot of counters gathered since startup (or the last reset_stats()); cheap, and safe to call at any time:
+Stats stats();
+void reset_stats();
+
 //"panic button" to shut off all currently playing sounds:
 void stop_all_samples();
 
@@ -141,8 +257,8 @@ void set_volume(float new_volume, float ramp = 1.0f / 60.0f);
 extern Ramp< float > volume;
 
 //the audio callback doesn't run between Sound::lock() and Sound::unlock()
-// the set_*/stop/play/... functions already use these helpers, so you shouldn't need
-// to call them unless your code is modifying values directly:
+// the set_*/stop/play/... functions queue commands instead of locking, so you shouldn't need
+// to call these unless your code is modifying values directly:
 void lock();
 void unlock();
 
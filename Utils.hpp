@@ -11,15 +11,15 @@ inline std::string find_suffix_in_scene(const std::string& name, const std::stri
 {
     std::string suffix = "";
     bool found_name = false;
-    for (auto& transform : scene.transforms) {
+    for (const std::string& transform_name : scene.transforms.names) {
         if (!found_name) {
-            if (transform.name == name) {
+            if (transform_name == name) {
                 found_name = true;
             }
         } else {
-            if (transform.name.find(prefix) != std::string::npos) {
-                auto const pos = transform.name.find_last_of('.');
-                suffix = transform.name.substr(pos + 1);
+            if (transform_name.find(prefix) != std::string::npos) {
+                auto const pos = transform_name.find_last_of('.');
+                suffix = transform_name.substr(pos + 1);
                 if (suffix == prefix) {
                     suffix = ""; // "." not found
                 } else {
@@ -0,0 +1,289 @@
+#include "VehicleSystem.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #include <emmintrin.h>
+    #define VEHICLE_SYSTEM_SSE2
+#endif
+
+namespace {
+
+constexpr float Pi = float(M_PI);
+constexpr float HalfPi = 0.5f * float(M_PI);
+constexpr float TwoPi = 2.f * float(M_PI);
+
+// Taylor coefficients for sin and cos on [-pi/2, pi/2] (error below 1e-7 at the ends):
+constexpr float S3 = -1.f / 6.f, S5 = 1.f / 120.f, S7 = -1.f / 5040.f, S9 = 1.f / 362880.f, S11 = -1.f / 39916800.f;
+constexpr float C2 = -1.f / 2.f, C4 = 1.f / 24.f, C6 = -1.f / 720.f, C8 = 1.f / 40320.f, C10 = -1.f / 3628800.f, C12 = 1.f / 479001600.f;
+
+// sin and cos of a in [-pi, pi], without libm calls: angles past +-pi/2 are mirrored into
+// [-pi/2, pi/2] (which keeps sin and flips the sign of cos) and then fed to the series.
+// step_sse2() repeats these operations in the same order, so both paths round identically
+// (unless the compiler is allowed to contract the scalar code into fused multiply-adds).
+void sin_cos(float a, float* s, float* c)
+{
+    const bool fold = std::abs(a) > HalfPi;
+    const float x = fold ? std::copysign(Pi, a) - a : a;
+    const float x2 = x * x;
+    *s = x * (1.f + x2 * (S3 + x2 * (S5 + x2 * (S7 + x2 * (S9 + x2 * S11)))));
+    const float cx = 1.f + x2 * (C2 + x2 * (C4 + x2 * (C6 + x2 * (C8 + x2 * (C10 + x2 * C12)))));
+    *c = fold ? -cx : cx;
+}
+
+} // namespace
+
+uint32_t VehicleSystem::add(const glm::vec3& pos, const glm::vec3& rot)
+{
+    // keep angles in -pi : pi (like normalize() in Utils.hpp)
+    auto wrap = [](float a) {
+        return std::remainder(a, 2.f * float(M_PI));
+    };
+
+    const uint32_t slot = uint32_t(size());
+    pos_x.push_back(pos.x);
+    pos_y.push_back(pos.y);
+    pos_z.push_back(pos.z);
+    vel_x.push_back(0.f);
+    vel_y.push_back(0.f);
+    vel_z.push_back(0.f);
+    yaw.push_back(wrap(rot.z));
+    yaw_rate.push_back(0.f);
+    roll.push_back(wrap(rot.x));
+    pitch.push_back(wrap(rot.y));
+    throttle.push_back(0.f);
+    brake.push_back(0.f);
+    steer.push_back(0.f);
+    force_x.push_back(0.f);
+    force_y.push_back(0.f);
+    force_z.push_back(0.f);
+    woggle.push_back(0.f);
+    wheel_rot.push_back(0.f);
+    active.push_back(1);
+    return slot;
+}
+
+void VehicleSystem::step(const float dt, const uint32_t begin, const uint32_t end)
+{
+    assert(begin <= end && end <= size());
+    uint32_t i = begin;
+#if defined(VEHICLE_SYSTEM_SSE2)
+    // groups of four start at slots that are multiples of four, so a slot takes the same path
+    // however the caller splits the range (as long as the splits are also multiples of four)
+    i = step_scalar(dt, begin, std::min(end, (begin + 3u) & ~3u));
+    i = step_sse2(dt, i, end);
+#endif
+    step_scalar(dt, i, end);
+}
+
+uint32_t VehicleSystem::step_scalar(const float dt, const uint32_t begin, const uint32_t end)
+{
+    // inspiration for this physics update was taken from this code:
+    // https://github.com/winstxnhdw/KinematicBicycleModel
+
+    const Params p = params; // (local copy, so the compiler knows it doesn't alias the arrays)
+
+    float* __restrict px = pos_x.data();
+    float* __restrict py = pos_y.data();
+    float* __restrict pz = pos_z.data();
+    float* __restrict vx = vel_x.data();
+    float* __restrict vy = vel_y.data();
+    float* __restrict vz = vel_z.data();
+    float* __restrict yw = yaw.data();
+    float* __restrict yr = yaw_rate.data();
+    const float* __restrict th = throttle.data();
+    const float* __restrict br = brake.data();
+    const float* __restrict st = steer.data();
+    float* __restrict fx = force_x.data();
+    float* __restrict fy = force_y.data();
+    float* __restrict fz = force_z.data();
+    float* __restrict wg = woggle.data();
+    float* __restrict wr = wheel_rot.data();
+    const uint8_t* __restrict on = active.data();
+
+    // one straight-line pass over all vehicles (no branches or libm calls other than sqrt);
+    // this is the reference that step_sse2() must match bit for bit
+    for (uint32_t i = begin; i < end; ++i) {
+        const float h = on[i] ? dt : 0.f; // (inactive vehicles take zero-length steps)
+
+        const float w = wg[i] + 2.f * h;
+        wg[i] = (w >= 1.f ? w - 1.f : w);
+
+        // heading (rotated a quarter turn from yaw, since the models face +y)
+        float sin_yaw, cos_yaw;
+        sin_cos(yw[i], &sin_yaw, &cos_yaw);
+        const float hx = -sin_yaw;
+        const float hy = cos_yaw;
+
+        // forward speed (signed by whether the vehicle is moving forward or backward)
+        const float along = vx[i] * hx + vy[i] * hy;
+        const float speed = std::sqrt(vx[i] * vx[i] + vy[i] * vy[i]);
+        const float signed_speed = (along == 0.f ? 0.f : std::copysign(speed, along));
+
+        wr[i] -= h * signed_speed;
+
+        const bool ground = pz[i] <= 0.f;
+
+        // on the ground: drive force minus friction, velocity locked to heading, yaw from steering
+        const float drive = p.throttle_force * th[i] - p.brake_force * br[i];
+        const float friction = signed_speed * (p.c_r + p.c_a * signed_speed);
+        const float gax = std::min(std::max(hx * drive - vx[i] * friction, -p.max_accel), p.max_accel);
+        const float gay = std::min(std::max(hy * drive - vy[i] * friction, -p.max_accel), p.max_accel);
+        const float ax = ground ? gax : 0.f;
+        const float ay = ground ? gay : 0.f;
+        const float vx0 = ground ? signed_speed * hx : vx[i];
+        const float vy0 = ground ? signed_speed * hy : vy[i];
+        float sin_steer, cos_steer;
+        sin_cos(p.steer_force * st[i], &sin_steer, &cos_steer);
+        const float turn = signed_speed * (sin_steer / cos_steer) / p.wheel_diameter_m;
+        yr[i] = ground ? turn : yr[i];
+
+        // integrate
+        const float nvx = vx0 + h * (ax + fx[i]);
+        const float nvy = vy0 + h * (ay + fy[i]);
+        float nvz = vz[i] + h * (p.gravity + fz[i]);
+        nvz = ground ? std::max(0.f, nvz) : nvz; // downward velocity is 0 when on the ground
+        fx[i] = 0.f;
+        fy[i] = 0.f;
+        fz[i] = 0.f;
+        vx[i] = nvx;
+        vy[i] = nvy;
+        vz[i] = nvz;
+
+        px[i] += h * nvx;
+        py[i] += h * nvy;
+        pz[i] = std::max(0.f, pz[i] + h * nvz);
+
+        float y = yw[i] + h * yr[i];
+        y = (y > Pi ? y - TwoPi : y);
+        y = (y < -Pi ? y + TwoPi : y);
+        yw[i] = y;
+    }
+    return end;
+}
+
+#if defined(VEHICLE_SYSTEM_SSE2)
+
+namespace {
+
+// mask ? a : b
+inline __m128 select(__m128 mask, __m128 a, __m128 b)
+{
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+void sin_cos(__m128 a, __m128* s, __m128* c)
+{
+    const __m128 sign = _mm_set1_ps(-0.f);
+    const __m128 fold = _mm_cmpgt_ps(_mm_andnot_ps(sign, a), _mm_set1_ps(HalfPi));
+    const __m128 mirrored = _mm_sub_ps(_mm_or_ps(_mm_and_ps(sign, a), _mm_set1_ps(Pi)), a);
+    const __m128 x = select(fold, mirrored, a);
+    const __m128 x2 = _mm_mul_ps(x, x);
+
+    __m128 sp = _mm_add_ps(_mm_set1_ps(S9), _mm_mul_ps(x2, _mm_set1_ps(S11)));
+    sp = _mm_add_ps(_mm_set1_ps(S7), _mm_mul_ps(x2, sp));
+    sp = _mm_add_ps(_mm_set1_ps(S5), _mm_mul_ps(x2, sp));
+    sp = _mm_add_ps(_mm_set1_ps(S3), _mm_mul_ps(x2, sp));
+    sp = _mm_add_ps(_mm_set1_ps(1.f), _mm_mul_ps(x2, sp));
+    *s = _mm_mul_ps(x, sp);
+
+    __m128 cp = _mm_add_ps(_mm_set1_ps(C10), _mm_mul_ps(x2, _mm_set1_ps(C12)));
+    cp = _mm_add_ps(_mm_set1_ps(C8), _mm_mul_ps(x2, cp));
+    cp = _mm_add_ps(_mm_set1_ps(C6), _mm_mul_ps(x2, cp));
+    cp = _mm_add_ps(_mm_set1_ps(C4), _mm_mul_ps(x2, cp));
+    cp = _mm_add_ps(_mm_set1_ps(C2), _mm_mul_ps(x2, cp));
+    cp = _mm_add_ps(_mm_set1_ps(1.f), _mm_mul_ps(x2, cp));
+    *c = _mm_xor_ps(cp, _mm_and_ps(fold, sign));
+}
+
+} // namespace
+
+uint32_t VehicleSystem::step_sse2(const float dt, const uint32_t begin, const uint32_t end)
+{
+    // four vehicles at a time, mirroring step_scalar() operation for operation
+    // (note that std::max(a, b) is _mm_max_ps(b, a), and likewise for min, including for NaN)
+
+    const Params p = params;
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 sign = _mm_set1_ps(-0.f);
+    const __m128 one = _mm_set1_ps(1.f);
+    const __m128 pi = _mm_set1_ps(Pi);
+    const __m128 two_pi = _mm_set1_ps(TwoPi);
+    const __m128 step = _mm_set1_ps(dt);
+    const __m128 max_accel = _mm_set1_ps(p.max_accel);
+    const __m128 min_accel = _mm_set1_ps(-p.max_accel);
+
+    uint32_t i = begin;
+    for (; i + 4 <= end; i += 4) {
+        int32_t on4;
+        std::memcpy(&on4, active.data() + i, 4);
+        const __m128i on8 = _mm_cvtsi32_si128(on4);
+        const __m128i on32 = _mm_unpacklo_epi16(_mm_unpacklo_epi8(on8, _mm_setzero_si128()), _mm_setzero_si128());
+        const __m128 off = _mm_castsi128_ps(_mm_cmpeq_epi32(on32, _mm_setzero_si128()));
+        const __m128 h = _mm_andnot_ps(off, step);
+
+        const __m128 w = _mm_add_ps(_mm_loadu_ps(woggle.data() + i), _mm_add_ps(h, h));
+        _mm_storeu_ps(woggle.data() + i, select(_mm_cmpge_ps(w, one), _mm_sub_ps(w, one), w));
+
+        __m128 sin_yaw, cos_yaw;
+        const __m128 yw = _mm_loadu_ps(yaw.data() + i);
+        sin_cos(yw, &sin_yaw, &cos_yaw);
+        const __m128 hx = _mm_xor_ps(sin_yaw, sign);
+        const __m128 hy = cos_yaw;
+
+        const __m128 vx = _mm_loadu_ps(vel_x.data() + i);
+        const __m128 vy = _mm_loadu_ps(vel_y.data() + i);
+        const __m128 along = _mm_add_ps(_mm_mul_ps(vx, hx), _mm_mul_ps(vy, hy));
+        const __m128 speed = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(vx, vx), _mm_mul_ps(vy, vy)));
+        const __m128 signed_speed = _mm_and_ps(_mm_cmpneq_ps(along, zero),
+            _mm_or_ps(_mm_andnot_ps(sign, speed), _mm_and_ps(sign, along)));
+
+        _mm_storeu_ps(wheel_rot.data() + i, _mm_sub_ps(_mm_loadu_ps(wheel_rot.data() + i), _mm_mul_ps(h, signed_speed)));
+
+        const __m128 pz = _mm_loadu_ps(pos_z.data() + i);
+        const __m128 ground = _mm_cmple_ps(pz, zero);
+
+        const __m128 drive = _mm_sub_ps(
+            _mm_mul_ps(_mm_set1_ps(p.throttle_force), _mm_loadu_ps(throttle.data() + i)),
+            _mm_mul_ps(_mm_set1_ps(p.brake_force), _mm_loadu_ps(brake.data() + i)));
+        const __m128 friction = _mm_mul_ps(signed_speed,
+            _mm_add_ps(_mm_set1_ps(p.c_r), _mm_mul_ps(_mm_set1_ps(p.c_a), signed_speed)));
+        const __m128 gax = _mm_min_ps(max_accel, _mm_max_ps(min_accel, _mm_sub_ps(_mm_mul_ps(hx, drive), _mm_mul_ps(vx, friction))));
+        const __m128 gay = _mm_min_ps(max_accel, _mm_max_ps(min_accel, _mm_sub_ps(_mm_mul_ps(hy, drive), _mm_mul_ps(vy, friction))));
+        const __m128 ax = _mm_and_ps(ground, gax);
+        const __m128 ay = _mm_and_ps(ground, gay);
+        const __m128 vx0 = select(ground, _mm_mul_ps(signed_speed, hx), vx);
+        const __m128 vy0 = select(ground, _mm_mul_ps(signed_speed, hy), vy);
+        __m128 sin_steer, cos_steer;
+        sin_cos(_mm_mul_ps(_mm_set1_ps(p.steer_force), _mm_loadu_ps(steer.data() + i)), &sin_steer, &cos_steer);
+        const __m128 turn = _mm_div_ps(_mm_mul_ps(signed_speed, _mm_div_ps(sin_steer, cos_steer)), _mm_set1_ps(p.wheel_diameter_m));
+        const __m128 yr = select(ground, turn, _mm_loadu_ps(yaw_rate.data() + i));
+        _mm_storeu_ps(yaw_rate.data() + i, yr);
+
+        const __m128 nvx = _mm_add_ps(vx0, _mm_mul_ps(h, _mm_add_ps(ax, _mm_loadu_ps(force_x.data() + i))));
+        const __m128 nvy = _mm_add_ps(vy0, _mm_mul_ps(h, _mm_add_ps(ay, _mm_loadu_ps(force_y.data() + i))));
+        __m128 nvz = _mm_add_ps(_mm_loadu_ps(vel_z.data() + i), _mm_mul_ps(h, _mm_add_ps(_mm_set1_ps(p.gravity), _mm_loadu_ps(force_z.data() + i))));
+        nvz = select(ground, _mm_max_ps(nvz, zero), nvz);
+        _mm_storeu_ps(force_x.data() + i, zero);
+        _mm_storeu_ps(force_y.data() + i, zero);
+        _mm_storeu_ps(force_z.data() + i, zero);
+        _mm_storeu_ps(vel_x.data() + i, nvx);
+        _mm_storeu_ps(vel_y.data() + i, nvy);
+        _mm_storeu_ps(vel_z.data() + i, nvz);
+
+        _mm_storeu_ps(pos_x.data() + i, _mm_add_ps(_mm_loadu_ps(pos_x.data() + i), _mm_mul_ps(h, nvx)));
+        _mm_storeu_ps(pos_y.data() + i, _mm_add_ps(_mm_loadu_ps(pos_y.data() + i), _mm_mul_ps(h, nvy)));
+        _mm_storeu_ps(pos_z.data() + i, _mm_max_ps(_mm_add_ps(pz, _mm_mul_ps(h, nvz)), zero));
+
+        __m128 y = _mm_add_ps(yw, _mm_mul_ps(h, yr));
+        y = select(_mm_cmpgt_ps(y, pi), _mm_sub_ps(y, two_pi), y);
+        y = select(_mm_cmplt_ps(y, _mm_xor_ps(pi, sign)), _mm_add_ps(y, two_pi), y);
+        _mm_storeu_ps(yaw.data() + i, y);
+    }
+    return i;
+}
+
+#endif
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <vector>
+
+// Batched vehicle kinematics: the state of every vehicle lives in structure-of-arrays form
+// and step() advances all of them with the same kinematic bicycle model in one loop.
+//
+// Each FourWheeledVehicle owns a slot in the system. Per physics step, vehicles write
+// their controls into their slot, step() runs, and vehicles read their new state back out
+// (to update their bounds and scene transforms).
+struct VehicleSystem {
+    // tuning shared by all vehicles:
+    struct Params {
+        float throttle_force = 10.f;
+        float brake_force = 5.f; // brake or reverse?
+        float steer_force = 1.f;
+        float wheel_diameter_m = 1.0f;
+        float c_r = 0.02f; // coefficient of resistance
+        float c_a = 0.025f; // drag coefficient
+        float max_accel = 100.f; // ground acceleration limit (per axis)
+        float gravity = -9.8f;
+    } params;
+
+    // add a vehicle at rest; returns its slot
+    uint32_t add(const glm::vec3& pos, const glm::vec3& rot);
+    // advance every active vehicle by dt seconds
+    void step(float dt) { step(dt, 0, uint32_t(size())); }
+    // advance active vehicles in slots [begin, end) by dt seconds
+    // (slots are independent, so disjoint ranges can be stepped on different threads;
+    //  splitting at multiples of four gives the same results as stepping the whole range)
+    void step(float dt, uint32_t begin, uint32_t end);
+
+    size_t size() const { return pos_x.size(); }
+
+    // --- state, one entry per slot ---
+    // kinematics:
+    std::vector<float> pos_x, pos_y, pos_z;
+    std::vector<float> vel_x, vel_y, vel_z;
+    std::vector<float> yaw, yaw_rate; // radians, radians/second
+    std::vector<float> roll, pitch; // constant (only yaw is simulated)
+    // controls (set before step()):
+    // throttle and brake are between 0..1, steer is between -PI/4..PI/4
+    std::vector<float> throttle, brake, steer;
+    std::vector<float> force_x, force_y, force_z; // collision response; cleared by step()
+    // animation:
+    std::vector<float> woggle, wheel_rot;
+    // inactive (dead) vehicles are kept in place but no longer move:
+    std::vector<uint8_t> active;
+
+private:
+    // step() runs aligned groups of four vehicles with SSE2 where available and the rest with the
+    // scalar loop; both evaluate the same operations in the same order. Each returns the slot it stopped at.
+    uint32_t step_scalar(float dt, uint32_t begin, uint32_t end);
+    uint32_t step_sse2(float dt, uint32_t begin, uint32_t end);
+};
@@ -0,0 +1,292 @@
+//Micro-benchmarks for engine hot paths; run without a window or audio device:
+// $ ./bench [name ...]
+//With no arguments, runs every benchmark.
+
+#include "mix_kernel.hpp"
+#include "BBox.hpp"
+#include "VehicleSystem.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+//run 'fn' repeatedly for about 'seconds'; returns average seconds per call:
+double time_per_call(std::function< void() > const &fn, double seconds = 0.5) {
+	fn(); //warm up
+	uint32_t calls = 0;
+	auto before = std::chrono::high_resolution_clock::now();
+	double elapsed = 0.0;
+	do {
+		fn();
+		++calls;
+		elapsed = std::chrono::duration< double >(std::chrono::high_resolution_clock::now() - before).count();
+	} while (elapsed < seconds);
+	return elapsed / calls;
+}
+
+//----- mixer kernel -----
+// mixes 'voices' one-second mono samples into a 1024-frame stereo block,
+// the same work Sound's mix_audio callback does per block.
+void bench_mix() {
+	constexpr uint32_t Frames = 1024;
+	constexpr uint32_t Voices = 64;
+
+	std::mt19937 mt(0x15466);
+	std::uniform_real_distribution< float > dist(-1.0f, 1.0f);
+	std::vector< std::vector< float > > samples(Voices);
+	for (auto &sample : samples) {
+		sample.resize(48000);
+		for (auto &s : sample) s = dist(mt);
+	}
+	std::vector< float > block(2 * Frames);
+
+	//check that the vectorized kernel matches the reference:
+	{
+		std::vector< float > reference(2 * Frames, 0.0f);
+		std::vector< float > vectorized(2 * Frames, 0.0f);
+		//odd offset + count to exercise unaligned and leftover paths:
+		mix_mono_to_stereo_scalar(reference.data() + 2, samples[0].data() + 3, Frames - 3, 0.25f, 0.75f, 1e-4f, -1e-4f);
+		mix_mono_to_stereo(vectorized.data() + 2, samples[0].data() + 3, Frames - 3, 0.25f, 0.75f, 1e-4f, -1e-4f);
+		float max_error = 0.0f;
+		for (uint32_t i = 0; i < reference.size(); ++i) {
+			max_error = std::max(max_error, std::abs(reference[i] - vectorized[i]));
+		}
+		std::cout << "  max difference vs. scalar reference: " << max_error << (max_error < 1e-4f ? " (ok)" : " (MISMATCH)") << std::endl;
+	}
+
+	auto run = [&](char const *name, decltype(&mix_mono_to_stereo) kernel) {
+		uint32_t offset = 0;
+		double per_block = time_per_call([&](){
+			for (auto &b : block) b = 0.0f;
+			for (uint32_t v = 0; v < Voices; ++v) {
+				kernel(block.data(), samples[v].data() + offset, Frames, 0.5f, 0.5f, 1e-5f, -1e-5f);
+			}
+			offset = (offset + Frames) % (48000 - Frames);
+		});
+		double voices_per_ms = Voices / (per_block * 1000.0);
+		std::cout << "  " << name << ": " << (per_block * 1e6) << " us per " << Voices << "-voice block; "
+			<< voices_per_ms << " voices/ms (" << (voices_per_ms * 1000.0 * Frames / 48000.0) << " voices in real time)" << std::endl;
+	};
+	run("scalar", mix_mono_to_stereo_scalar);
+	run(mix_kernel_name(), mix_mono_to_stereo);
+}
+
+//----- compressed sample storage -----
+// stores the same audio as float, int16, and IMA-ADPCM, then reports memory use, error, and
+// the cost of decoding + mixing 64 voices per 1024-frame block (as Sound's mix_audio does).
+void bench_sample_storage() {
+	constexpr uint32_t Frames = 1024;
+	constexpr uint32_t Voices = 64;
+	constexpr uint32_t Length = 10 * 48000;
+
+	//a few seconds of "ambience": detuned tones plus filtered noise, with a slow swell:
+	std::mt19937 mt(0x15466);
+	std::uniform_real_distribution< float > dist(-1.0f, 1.0f);
+	std::vector< float > audio(Length);
+	float noise = 0.0f;
+	for (uint32_t i = 0; i < Length; ++i) {
+		float t = float(i) / 48000.0f;
+		noise = 0.95f * noise + 0.05f * dist(mt);
+		float swell = 0.6f + 0.4f * std::sin(6.2831853f * 0.2f * t);
+		audio[i] = swell * (0.3f * std::sin(6.2831853f * 220.0f * t) + 0.2f * std::sin(6.2831853f * 331.0f * t) + 0.8f * noise);
+	}
+
+	std::vector< int16_t > int16(Length);
+	encode_int16(int16.data(), audio.data(), Length);
+	std::vector< uint8_t > adpcm;
+	encode_adpcm(audio.data(), Length, &adpcm);
+
+	//decoders with the same shape as Sound's voice_frames():
+	std::vector< float > scratch(Frames);
+	auto frames_float = [&](uint32_t i, uint32_t count) -> float const * {
+		(void)count;
+		return audio.data() + i;
+	};
+	auto frames_int16 = [&](uint32_t i, uint32_t count) -> float const * {
+		decode_int16(scratch.data(), int16.data() + i, count);
+		return scratch.data();
+	};
+	auto frames_adpcm = [&](uint32_t i, uint32_t count) -> float const * {
+		decode_adpcm(scratch.data(), adpcm.data(), i, count);
+		return scratch.data();
+	};
+
+	//voices start at scattered (unaligned) positions:
+	std::vector< uint32_t > starts(Voices);
+	for (auto &start : starts) start = mt() % (Length - Frames);
+	std::vector< float > block(2 * Frames);
+
+	auto run = [&](char const *name, size_t bytes, std::function< float const *(uint32_t, uint32_t) > const &frames) {
+		//accuracy over the whole sample:
+		double error2 = 0.0, signal2 = 0.0;
+		float max_error = 0.0f;
+		for (uint32_t i = 0; i < Length; i += Frames) {
+			uint32_t count = std::min(Frames, Length - i);
+			float const *decoded = frames(i, count);
+			for (uint32_t k = 0; k < count; ++k) {
+				float e = decoded[k] - audio[i + k];
+				error2 += double(e) * e;
+				signal2 += double(audio[i + k]) * audio[i + k];
+				max_error = std::max(max_error, std::abs(e));
+			}
+		}
+		double snr = (error2 > 0.0 ? 10.0 * std::log10(signal2 / error2) : std::numeric_limits< double >::infinity());
+
+		uint32_t offset = 0;
+		double per_block = time_per_call([&](){
+			for (auto &b : block) b = 0.0f;
+			for (uint32_t v = 0; v < Voices; ++v) {
+				uint32_t i = (starts[v] + offset) % (Length - Frames);
+				mix_mono_to_stereo(block.data(), frames(i, Frames), Frames, 0.5f, 0.5f, 1e-5f, -1e-5f);
+			}
+			offset += Frames;
+		});
+		std::cout << "  " << name << ": " << (bytes / 1024.0 / (Length / 48000.0)) << " kB/s of audio ("
+			<< (double(Length * sizeof(float)) / bytes) << "x smaller than float); SNR " << snr << " dB, max error " << max_error
+			<< "; " << (per_block * 1e6) << " us per " << Voices << "-voice block (" << (100.0 * per_block * 48000.0 / Frames) << "% of real time)" << std::endl;
+	};
+	run("float", audio.size() * sizeof(float), frames_float);
+	run("int16", int16.size() * sizeof(int16_t), frames_int16);
+	run("adpcm", adpcm.size(), frames_adpcm);
+}
+
+//----- vehicle box collision -----
+// tests random pairs of yawed, car-sized boxes with the old point-containment test (both directions,
+// as PlayMode used it) and with the separating-axis test, against a densely sampled reference.
+void bench_bbox() {
+	constexpr uint32_t Pairs = 4096;
+
+	std::mt19937 mt(0x15466);
+	std::uniform_real_distribution< float > pos(-6.0f, 6.0f);
+	std::uniform_real_distribution< float > yaw(-3.14159f, 3.14159f);
+	std::uniform_real_distribution< float > size(0.5f, 4.0f);
+	std::vector< BBox > boxes;
+	boxes.reserve(2 * Pairs);
+	for (uint32_t i = 0; i < 2 * Pairs; ++i) {
+		glm::vec3 half = glm::vec3(0.5f * size(mt), size(mt), 0.75f);
+		boxes.emplace_back(-half, half);
+		boxes.back().update(glm::vec3(pos(mt), pos(mt), 0.0f), yaw(mt));
+	}
+
+	//reference: does any point of a fine grid over one box land inside the other?
+	auto inside = [](BBox const &box, glm::vec3 const &pt) {
+		glm::vec3 d = pt - box.midpt;
+		float c = std::cos(box.rot.z), s = std::sin(box.rot.z);
+		glm::vec3 local = glm::vec3(c * d.x + s * d.y, -s * d.x + c * d.y, d.z);
+		glm::vec3 half = box.extent / 2.0f;
+		return std::abs(local.x) <= half.x && std::abs(local.y) <= half.y && std::abs(local.z) <= half.z;
+	};
+	auto sampled = [&](BBox const &a, BBox const &b) {
+		constexpr int Steps = 24;
+		float c = std::cos(a.rot.z), s = std::sin(a.rot.z);
+		for (int i = 0; i <= Steps; ++i) {
+			for (int j = 0; j <= Steps; ++j) {
+				glm::vec2 local = (glm::vec2(i, j) / float(Steps) - 0.5f) * glm::vec2(a.extent);
+				glm::vec3 pt = a.midpt + glm::vec3(c * local.x - s * local.y, s * local.x + c * local.y, 0.0f);
+				if (inside(b, pt)) return true;
+			}
+		}
+		return false;
+	};
+
+	{ //correctness:
+		uint32_t reference_hits = 0, points_wrong = 0, sat_wrong = 0;
+		for (uint32_t i = 0; i < Pairs; ++i) {
+			BBox const &a = boxes[2*i], &b = boxes[2*i+1];
+			bool reference = sampled(a, b) || sampled(b, a);
+			bool points = a.collides_with(b) || b.collides_with(a);
+			bool sat = a.overlaps(b);
+			reference_hits += reference;
+			points_wrong += (points != reference);
+			sat_wrong += (sat != reference);
+		}
+		std::cout << "  " << reference_hits << " of " << Pairs << " pairs overlap (sampled reference)" << std::endl;
+		std::cout << "  point containment disagrees on " << points_wrong << " pairs" << std::endl;
+		std::cout << "  separating axis disagrees on " << sat_wrong << " pairs (grazing contacts the sampling can miss)" << std::endl;
+	}
+
+	auto run = [&](char const *name, std::function< bool(BBox const &, BBox const &) > const &test) {
+		uint32_t hits = 0; //(printed, so the tests can't be optimized away)
+		double per_pass = time_per_call([&](){
+			hits = 0;
+			for (uint32_t i = 0; i < Pairs; ++i) {
+				hits += test(boxes[2*i], boxes[2*i+1]);
+			}
+		});
+		std::cout << "  " << name << ": " << (per_pass * 1e9 / Pairs) << " ns per pair; "
+			<< (Pairs / (per_pass * 1e6)) << " pairs/us (" << hits << " hits)" << std::endl;
+	};
+	run("point containment", [](BBox const &a, BBox const &b) { return a.collides_with(b) || b.collides_with(a); });
+	run("separating axis", [](BBox const &a, BBox const &b) { return a.overlaps(b); });
+	run("separating axis + contact", [](BBox const &a, BBox const &b) {
+		BBox::Contact contact;
+		return a.overlaps(b, &contact) && contact.depth >= 0.0f;
+	});
+}
+
+//----- vehicle kinematics -----
+// steps a large batch of driving vehicles, as PlayMode's physics step does.
+void bench_vehicles() {
+	constexpr uint32_t Vehicles = 16384;
+	constexpr float Step = 1.0f / 120.0f;
+
+	std::mt19937 mt(0x15466);
+	std::uniform_real_distribution< float > pos(-200.0f, 200.0f);
+	std::uniform_real_distribution< float > unit(0.0f, 1.0f);
+	VehicleSystem system;
+	for (uint32_t i = 0; i < Vehicles; ++i) {
+		uint32_t slot = system.add(glm::vec3(pos(mt), pos(mt), 0.0f), glm::vec3(0.0f, 0.0f, 6.28f * unit(mt)));
+		system.throttle[slot] = unit(mt);
+		system.steer[slot] = 0.78f * (2.0f * unit(mt) - 1.0f);
+		system.vel_x[slot] = 5.0f * unit(mt); //(some start moving; the rest start at rest)
+	}
+
+	double per_step = time_per_call([&](){
+		system.step(Step);
+	});
+	double vehicles_per_ms = Vehicles / (per_step * 1000.0);
+	std::cout << "  " << (per_step * 1e6) << " us per step of " << Vehicles << " vehicles; "
+		<< vehicles_per_ms << " vehicle-steps/ms" << std::endl;
+}
+
+struct Benchmark {
+	char const *name;
+	char const *description;
+	void (*run)();
+};
+
+Benchmark const benchmarks[] = {
+	{"mix", "Sound mixer inner loop (mono -> stereo with pan ramp)", bench_mix},
+	{"samples", "Sample storage formats (decode + mix cost, memory, error)", bench_sample_storage},
+	{"bbox", "Vehicle box-vs-box collision tests", bench_bbox},
+	{"vehicles", "Batched vehicle kinematics (VehicleSystem::step)", bench_vehicles},
+};
+
+} //namespace
+
+int main(int argc, char **argv) {
+	std::vector< std::string > wanted(argv + 1, argv + argc);
+	bool ran_any = false;
+	for (auto const &benchmark : benchmarks) {
+		if (!wanted.empty() && std::find(wanted.begin(), wanted.end(), benchmark.name) == wanted.end()) continue;
+		std::cout << "--- " << benchmark.name << ": " << benchmark.description << " ---" << std::endl;
+		benchmark.run();
+		ran_any = true;
+	}
+	if (!ran_any) {
+		std::cerr << "Unknown benchmark; available benchmarks are:" << std::endl;
+		for (auto const &benchmark : benchmarks) {
+			std::cerr << "  " << benchmark.name << " - " << benchmark.description << std::endl;
+		}
+		return 1;
+	}
+	return 0;
+}
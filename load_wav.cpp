@@ -1,12 +1,14 @@
 #include "load_wav.hpp"
 
+#include "Sound.hpp"
+
 #include <SDL.h>
 
+#include <fstream>
 #include <iostream>
 #include <cassert>
 #include <algorithm>
-
-constexpr uint32_t AUDIO_RATE = 48000;
+#include <cstring>
 
 void load_wav(std::string const &filename, std::vector< float > *data_) {
 	assert(data_);
@@ -23,9 +25,9 @@ void load_wav(std::string const &filename, std::vector< float > *data_) {
 
 	//based on the SDL_AudioCVT example in the docs: https://wiki.libsdl.org/SDL_AudioCVT
 	SDL_AudioCVT cvt;
-	SDL_BuildAudioCVT(&cvt, have->format, have->channels, have->freq, AUDIO_F32SYS, 1, AUDIO_RATE);
+	SDL_BuildAudioCVT(&cvt, have->format, have->channels, have->freq, AUDIO_F32SYS, 1, Sound::AudioRate);
 	if (cvt.needed) {
-		std::cout << "WAV file '" + filename + "' didn't load as " + std::to_string(AUDIO_RATE) + " Hz, float32, mono; converting." << std::endl;
+		std::cout << "WAV file '" + filename + "' didn't load as " + std::to_string(Sound::AudioRate) + " Hz, float32, mono; converting." << std::endl;
 		cvt.len = audio_len;
 		cvt.buf = (Uint8 *)SDL_malloc(cvt.len * cvt.len_mult);
 		SDL_memcpy(cvt.buf, audio_buf, audio_len);
@@ -48,3 +50,56 @@ void load_wav(std::string const &filename, std::vector< float > *data_) {
 	}
 	std::cout << "Range: " << min << ", " << max << std::endl;
 }
+
+void save_wav(std::string const &filename, std::vector< float > const &data, uint32_t channels, uint32_t rate) {
+	assert(channels > 0 && data.size() % channels == 0);
+
+	std::ofstream out(filename, std::ios::binary);
+	if (!out) {
+		throw std::runtime_error("Failed to open '" + filename + "' for writing.");
+	}
+
+	//RIFF fields are little-endian:
+	auto write_u32 = [&out](uint32_t v) {
+		char bytes[4] = { char(v & 0xff), char((v >> 8) & 0xff), char((v >> 16) & 0xff), char((v >> 24) & 0xff) };
+		out.write(bytes, 4);
+	};
+	auto write_u16 = [&out](uint16_t v) {
+		char bytes[2] = { char(v & 0xff), char((v >> 8) & 0xff) };
+		out.write(bytes, 2);
+	};
+
+	uint32_t data_bytes = uint32_t(data.size() * sizeof(float));
+	uint32_t frames = uint32_t(data.size() / channels);
+
+	out.write("RIFF", 4);
+	write_u32(4 + (8 + 18) + (8 + 4) + (8 + data_bytes));
+	out.write("WAVE", 4);
+
+	//(non-PCM formats carry a cbSize field and a 'fact' chunk)
+	out.write("fmt ", 4);
+	write_u32(18);
+	write_u16(3); //WAVE_FORMAT_IEEE_FLOAT
+	write_u16(uint16_t(channels));
+	write_u32(rate);
+	write_u32(rate * channels * uint32_t(sizeof(float))); //bytes per second
+	write_u16(uint16_t(channels * sizeof(float))); //bytes per frame
+	write_u16(32); //bits per sample
+	write_u16(0); //cbSize
+
+	out.write("fact", 4);
+	write_u32(4);
+	write_u32(frames);
+
+	out.write("data", 4);
+	write_u32(data_bytes);
+	for (float f : data) {
+		uint32_t bits;
+		std::memcpy(&bits, &f, sizeof(bits));
+		write_u32(bits);
+	}
+
+	if (!out) {
+		throw std::runtime_error("Failed to write WAV file '" + filename + "'.");
+	}
+}
@@ -1,7 +1,11 @@
 #pragma once
 
+#include <cstdint>
 #include <string>
 #include <vector>
 
 //Load a WAV file as 48kHz floating-point mono; throws on error:
 void load_wav(std::string const &filename, std::vector< float > *data);
+
+//Save interleaved floating-point audio (e.g., left, right, left, right, ...) as a 32-bit float WAV file; throws on error:
+void save_wav(std::string const &filename, std::vector< float > const &data, uint32_t channels, uint32_t rate);
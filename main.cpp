@@ -13,18 +13,62 @@
 //GL.hpp will include a non-namespace-polluting set of opengl prototypes:
 #include "GL.hpp"
 
+//for timing zones and the profiler overlay:
+#include "Profiler.hpp"
+
 //for screenshots:
 #include "load_save_png.hpp"
 
+//for offline audio renders:
+#include "load_wav.hpp"
+
+//for the streamed track used by --render-audio:
+#include "data_path.hpp"
+#include "OpusStream.hpp"
+
 //Includes for libSDL:
 #include <SDL.h>
 
 //...and for c++ standard library functions:
 #include <chrono>
+#include <cstring>
+#include <iomanip>
 #include <iostream>
 #include <stdexcept>
 #include <memory>
 #include <algorithm>
+#include <string>
+#include <functional>
+#include <cmath>
+
+//Run the game simulation with no window, OpenGL context, or audio device, and report timings:
+// (sounds are still played, and mixed offline at the pace of simulated time)
+// vehicles: total vehicle count (0: just the scene's cars); threads: if non-zero, run once at each of 1 .. threads
+//  threads, report the physics speedup, and fail unless every run ends in the same state
+static int run_headless(uint32_t steps, uint32_t seed, uint32_t vehicles, uint32_t threads);
+
+//Run a scripted sequence of sound events through the mixer (no audio device), write the output to a WAV, and report mix timings:
+static int run_render_audio(std::string const &filename);
+
+//Command-line options (anything else is ignored):
+static char const *Usage =
+	"Options:\n"
+	"  --headless <steps> : simulate <steps> physics steps without a window and print timings\n"
+	"  --seed <seed> : seed for gameplay randomness (same seed + same input => same game)\n"
+	"  --vehicles <count> : (with --headless) simulate this many vehicles, copying the scene's cars as needed\n"
+	"  --threads <count> : (with --headless) run once per thread count from 1 to <count>, compare speed and final states\n"
+	"  --render-audio <file.wav> : mix a scripted sequence of sounds offline, write it out, and print mix timings\n"
+	"  --audio-block <frames> : mix audio in blocks of this many frames (power of two, 64-4096; smaller is lower latency)\n";
+
+//Parse a whole decimal number that fits in 32 bits (no sign, no surrounding text); returns false if 'str' isn't one:
+static bool parse_uint(char const *str, uint32_t *value);
+
+//FNV-1a hash of the bit patterns of 'count' floats (each least significant byte first):
+// (used to fingerprint results, so runs can be checked for bit-exactness)
+static uint64_t hash_floats(float const *data, size_t count);
+
+//Print a hash as 16 hex digits:
+static void print_hash(std::ostream &out, uint64_t hash);
 
 #ifdef _WIN32
 extern "C" { uint32_t GetACP(); }
@@ -45,6 +89,49 @@ int main(int argc, char **argv) {
 	try {
 #endif
 
+	//------------  command line ------------
+	// (options are listed in 'Usage', above)
+	std::string render_audio;
+	uint32_t audio_block = Sound::DefaultBlockFrames;
+	uint32_t headless_steps = 0;
+	bool headless = false;
+	uint32_t seed = 0;
+	bool have_seed = false;
+	uint32_t vehicles = 0;
+	uint32_t threads = 0;
+	//read the number after option argv[i] into *value (and step past it), or complain:
+	auto number_option = [&](int &i, uint32_t *value) {
+		++i;
+		if (parse_uint(argv[i], value)) return true;
+		std::cerr << "Expected a whole number (0-4294967295) after '" << argv[i-1] << "', not '" << argv[i] << "'.\n" << Usage << std::flush;
+		return false;
+	};
+	for (int i = 1; i < argc; ++i) {
+		if (std::strcmp(argv[i], "--headless") == 0 && i + 1 < argc) {
+			headless = true;
+			if (!number_option(i, &headless_steps)) return 1;
+		} else if (std::strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+			have_seed = true;
+			if (!number_option(i, &seed)) return 1;
+		} else if (std::strcmp(argv[i], "--vehicles") == 0 && i + 1 < argc) {
+			if (!number_option(i, &vehicles)) return 1;
+		} else if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+			if (!number_option(i, &threads)) return 1;
+		} else if (std::strcmp(argv[i], "--render-audio") == 0 && i + 1 < argc) {
+			render_audio = argv[++i];
+		} else if (std::strcmp(argv[i], "--audio-block") == 0 && i + 1 < argc) {
+			if (!number_option(i, &audio_block)) return 1;
+		}
+	}
+	if (!render_audio.empty()) {
+		Sound::init_offline(audio_block);
+		return run_render_audio(render_audio);
+	}
+	if (headless) {
+		Sound::init_offline(audio_block);
+		return run_headless(headless_steps, have_seed ? seed : 0x15466, vehicles, threads);
+	}
+
 	//------------  initialization ------------
 
 	//Initialize SDL library:
@@ -106,13 +193,17 @@ int main(int argc, char **argv) {
 	//SDL_ShowCursor(SDL_DISABLE);
 
 	//------------ init sound --------------
-	Sound::init();
+	Sound::init(audio_block);
 
 	//------------ load assets --------------
 	call_load_functions();
 
 	//------------ create game mode + make current --------------
-	Mode::set_current(std::make_shared< PlayMode >());
+	if (have_seed) {
+		Mode::set_current(std::make_shared< PlayMode >(seed));
+	} else {
+		Mode::set_current(std::make_shared< PlayMode >());
+	}
 
 	//------------ main loop ------------
 
@@ -131,12 +222,16 @@ int main(int argc, char **argv) {
 	};
 	on_resize();
 
+	//F3 toggles the profiler overlay, F9 writes recent profile zones to a trace file, F10 prints audio mixer stats:
+	bool show_profiler = false;
+
 	//This will loop until the current mode is set to null:
 	while (Mode::current) {
 		//every pass through the game loop creates one frame of output
 		//  by performing three steps:
 
 		{ //(1) process any events that are pending
+			PROFILE_ZONE("events");
 			static SDL_Event evt;
 			while (SDL_PollEvent(&evt) == 1) {
 				//handle resizing:
@@ -144,7 +239,14 @@ int main(int argc, char **argv) {
 					on_resize();
 				}
 				//handle input:
-				if (Mode::current && Mode::current->handle_event(evt, window_size)) {
+				// (profiler keys are checked first, since modes may claim every key press)
+				if (evt.type == SDL_KEYDOWN && evt.key.repeat == 0 && evt.key.keysym.sym == SDLK_F3) {
+					show_profiler = !show_profiler;
+				} else if (evt.type == SDL_KEYDOWN && evt.key.repeat == 0 && evt.key.keysym.sym == SDLK_F9) {
+					Profiler::write_chrome_trace("profile.json");
+				} else if (evt.type == SDL_KEYDOWN && evt.key.repeat == 0 && evt.key.keysym.sym == SDLK_F10) {
+					Sound::stats().print(std::cout);
+				} else if (Mode::current && Mode::current->handle_event(evt, window_size)) {
 					// mode handled it; great
 				} else if (evt.type == SDL_QUIT) {
 					Mode::set_current(nullptr);
@@ -169,6 +271,7 @@ int main(int argc, char **argv) {
 		}
 
 		{ //(2) call the current mode's "update" function to deal with elapsed time:
+			PROFILE_ZONE("update");
 			auto current_time = std::chrono::high_resolution_clock::now();
 			static auto previous_time = current_time;
 			float elapsed = std::chrono::duration< float >(current_time - previous_time).count();
@@ -183,12 +286,17 @@ int main(int argc, char **argv) {
 		}
 
 		{ //(3) call the current mode's "draw" function to produce output:
-		
+			PROFILE_ZONE("draw");
 			Mode::current->draw(drawable_size);
+			if (show_profiler) Profiler::draw_overlay(drawable_size);
 		}
 
-		//Wait until the recently-drawn frame is shown before doing it all again:
-		SDL_GL_SwapWindow(window);
+		{ //Wait until the recently-drawn frame is shown before doing it all again:
+			PROFILE_ZONE("swap");
+			SDL_GL_SwapWindow(window);
+		}
+
+		Profiler::end_frame();
 	}
 
 
@@ -213,3 +321,255 @@ int main(int argc, char **argv) {
 	}
 #endif
 }
+
+bool parse_uint(char const *str, uint32_t *value) {
+	uint64_t result = 0;
+	if (*str == '\0') return false;
+	for (char const *c = str; *c != '\0'; ++c) {
+		if (*c < '0' || *c > '9') return false;
+		result = result * 10 + uint64_t(*c - '0');
+		if (result > 0xffffffffULL) return false;
+	}
+	*value = uint32_t(result);
+	return true;
+}
+
+uint64_t hash_floats(float const *data, size_t count) {
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < count; ++i) {
+		uint32_t bits;
+		std::memcpy(&bits, &data[i], sizeof(bits));
+		for (uint32_t b = 0; b < 4; ++b) {
+			hash = (hash ^ ((bits >> (8 * b)) & 0xff)) * 1099511628211ULL;
+		}
+	}
+	return hash;
+}
+
+void print_hash(std::ostream &out, uint64_t hash) {
+	out << std::hex << std::setw(16) << std::setfill('0') << hash << std::dec << std::setfill(' ');
+}
+
+//One headless simulation, and what it measured:
+struct HeadlessRun {
+	uint32_t vehicles = 0;
+	uint32_t threads = 0;
+	PlayMode::StepTimings step_timings;
+	double cue_seconds = 0.0;
+	double mix_seconds = 0.0;
+	double total = 0.0;
+	uint64_t hash = 0; //fingerprint of the final state, to check that runs with the same seed agree
+};
+
+static HeadlessRun simulate_headless(uint32_t steps, uint32_t seed, uint32_t vehicles, uint32_t threads) {
+	HeadlessRun run;
+
+	PlayMode play(seed, vehicles, threads);
+	run.vehicles = uint32_t(play.vehicle_map.size());
+	run.threads = play.jobs->thread_count();
+
+	//collision cues are played once per 60Hz "frame", as update() would; audio is mixed whenever a block's worth of time has been simulated:
+	constexpr uint32_t StepsPerFrame = 2;
+	std::vector< float > mix_buffer(2 * Sound::block_frames());
+	uint64_t mixed_frames = 0;
+
+	auto before = std::chrono::steady_clock::now();
+	for (uint32_t step = 0; step < steps; ++step) {
+		play.step_physics(PlayMode::PhysicsStep);
+
+		auto phase_start = std::chrono::steady_clock::now();
+		if ((step + 1) % StepsPerFrame == 0) {
+			play.play_collision_cues();
+		}
+		auto cues_end = std::chrono::steady_clock::now();
+		uint64_t simulated_frames = uint64_t(double(step + 1) * PlayMode::PhysicsStep * Sound::AudioRate);
+		while (mixed_frames + Sound::block_frames() <= simulated_frames) {
+			mixed_frames += Sound::mix_offline(mix_buffer.data());
+		}
+		auto mix_end = std::chrono::steady_clock::now();
+		run.cue_seconds += std::chrono::duration< double >(cues_end - phase_start).count();
+		run.mix_seconds += std::chrono::duration< double >(mix_end - cues_end).count();
+	}
+	run.total = std::chrono::duration< double >(std::chrono::steady_clock::now() - before).count();
+	run.step_timings = play.step_timings;
+
+	std::vector< float > state;
+	for (FourWheeledVehicle const *FWV : play.vehicle_map) {
+		state.insert(state.end(), { FWV->pos.x, FWV->pos.y, FWV->pos.z, FWV->rot.z });
+	}
+	run.hash = hash_floats(state.data(), state.size());
+
+	return run;
+}
+
+int run_headless(uint32_t steps, uint32_t seed, uint32_t vehicles, uint32_t threads) {
+	std::cout << "Headless run: " << steps << " steps of " << PlayMode::PhysicsStep << "s, seed " << seed << "." << std::endl;
+
+	//only the background parts of loading (file reading, decoding) -- nothing that needs OpenGL:
+	call_load_functions(LoadWithoutGL);
+
+	if (threads != 0) {
+		//thread sweep: the same game at 1 .. threads threads; physics should speed up, and always end in the same state:
+		std::cout << "  " << std::setw(8) << "threads" << std::setw(12) << "physics ms" << std::setw(10) << "speedup" << std::setw(18) << "final state" << "\n";
+		std::cout << std::fixed << std::setprecision(3);
+		HeadlessRun first;
+		bool agree = true;
+		for (uint32_t t = 1; t <= threads; ++t) {
+			HeadlessRun run = simulate_headless(steps, seed, vehicles, t);
+			PlayMode::StepTimings const &timings = run.step_timings;
+			double physics = timings.ai + timings.physics + timings.collision + timings.response;
+			if (t == 1) first = run;
+			double first_physics = first.step_timings.ai + first.step_timings.physics + first.step_timings.collision + first.step_timings.response;
+			std::cout << "  " << std::setw(8) << run.threads
+				<< std::setw(12) << (physics * 1000.0)
+				<< std::setw(9) << (physics > 0.0 ? first_physics / physics : 0.0) << "x"
+				<< "  ";
+			print_hash(std::cout, run.hash);
+			std::cout << "\n";
+			agree = agree && (run.hash == first.hash);
+		}
+		std::cout << std::defaultfloat << std::setprecision(6);
+		std::cout << first.vehicles << " vehicles." << std::endl;
+		if (!agree) {
+			std::cerr << "ERROR: the final state depends on the thread count." << std::endl;
+			return 1;
+		}
+		return 0;
+	}
+
+	HeadlessRun run = simulate_headless(steps, seed, vehicles, 0);
+	std::cout << run.vehicles << " vehicles, " << run.threads << " threads." << std::endl;
+
+	//report:
+	auto row = [&](char const *name, double seconds) {
+		std::cout << "  " << std::setw(10) << name
+			<< std::setw(12) << (seconds * 1000.0)
+			<< std::setw(12) << (steps ? seconds * 1e6 / steps : 0.0)
+			<< std::setw(8) << (run.total > 0.0 ? 100.0 * seconds / run.total : 0.0) << "%\n";
+	};
+	std::cout << std::fixed << std::setprecision(3);
+	std::cout << "  " << std::setw(10) << "phase" << std::setw(12) << "total ms" << std::setw(12) << "us/step" << std::setw(9) << "share" << "\n";
+	row("ai", run.step_timings.ai);
+	row("physics", run.step_timings.physics);
+	row("collision", run.step_timings.collision);
+	row("response", run.step_timings.response);
+	row("cues", run.cue_seconds);
+	row("mixing", run.mix_seconds);
+	row("total", run.total);
+	std::cout << std::defaultfloat << std::setprecision(6);
+	Sound::stats().print(std::cout);
+
+	std::cout << "Final state hash: ";
+	print_hash(std::cout, run.hash);
+	std::cout << std::endl;
+
+	return 0;
+}
+
+int run_render_audio(std::string const &filename) {
+	constexpr float Seconds = 12.0f;
+
+	//synthesized samples, so the render mostly doesn't depend on asset files:
+	auto synthesize = [](float seconds, std::function< float(float t) > const &fn) {
+		std::vector< float > data(uint32_t(seconds * Sound::AudioRate));
+		for (uint32_t i = 0; i < data.size(); ++i) {
+			data[i] = fn(float(i) / Sound::AudioRate);
+		}
+		return Sound::Sample(data);
+	};
+	constexpr float Tau = 6.2831853f;
+	//one second of a soft chord (loops cleanly, since every partial is a whole number of Hz):
+	Sound::Sample drone = synthesize(1.0f, [&](float t) {
+		return 0.3f * std::sin(Tau * 110.0f * t) + 0.2f * std::sin(Tau * 165.0f * t) + 0.1f * std::sin(Tau * 220.0f * t);
+	});
+	//short decaying downward chirp:
+	Sound::Sample pew = synthesize(0.25f, [&](float t) {
+		return std::exp(-12.0f * t) * std::sin(Tau * (1200.0f * t - 1600.0f * t * t));
+	});
+	//one second of (deterministic) noise:
+	uint32_t noise_state = 0x1234567;
+	Sound::Sample noise = synthesize(1.0f, [&](float) {
+		noise_state = noise_state * 1664525U + 1013904223U; //LCG
+		return 0.25f * (float(noise_state >> 8) / float(1 << 24) * 2.0f - 1.0f);
+	});
+	//the one sample read from disk -- a streamed track, so stream looping, seeking, and restarts are covered too:
+	// (mix_offline waits for the decoder, so this is as repeatable as the rest)
+	Sound::Sample music(data_path("dusty-floor.opus"), Sound::Sample::Streamed);
+	float const music_length = float(music.stream->length) / Sound::AudioRate;
+
+	//the script -- events sorted by time; each runs just before the first block that starts at or after its time:
+	Sound::PlayingSample drone_voice, noise_voice, music_voice;
+	struct Cue {
+		float time;
+		std::function< void() > fn;
+	};
+	std::vector< Cue > script;
+	script.push_back({0.0f, [&](){ drone_voice = Sound::loop(drone, 0.5f, -0.5f); }});
+	script.push_back({0.5f, [&](){ music_voice = Sound::loop(music, 0.3f, 0.0f); }});
+	script.push_back({1.0f, [&](){ drone_voice.set_pan(0.5f, 4.0f); }});
+	script.push_back({4.0f, [&](){ music_voice.seek(music_length - 0.5f); }}); //wraps around to the start half a second later
+	script.push_back({7.0f, [&](){ music_voice = Sound::play(music, 0.3f, 0.25f); }}); //restarts the stream, cutting off the looping voice
+	script.push_back({7.5f, [&](){ music_voice.seek(30.0f); }});
+	for (uint32_t i = 0; i < 16; ++i) { //steady 3D shots circling the listener
+		float t = 1.0f + 0.25f * i;
+		float ang = 0.4f * i;
+		script.push_back({t, [&pew, ang](){ Sound::play_3D(pew, 1.0f, glm::vec3(10.0f * std::cos(ang), 10.0f * std::sin(ang), 0.0f), 5.0f); }});
+	}
+	script.push_back({3.0f, [](){ Sound::listener.set_position_right(glm::vec3(5.0f, 0.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f), 2.0f); }});
+	script.push_back({5.0f, [&](){ //a burst well past the voice cap, so stealing and virtual voices get exercised
+		for (uint32_t i = 0; i < 200; ++i) {
+			float ang = 0.1f * i;
+			float dist = 2.0f + 0.5f * i;
+			Sound::play_3D(pew, 0.2f, glm::vec3(dist * std::cos(ang), dist * std::sin(ang), 1.0f), 3.0f, 1.0f + (i % 3));
+		}
+	}});
+	script.push_back({6.0f, [&](){ noise_voice = Sound::loop_3D(noise, 0.5f, glm::vec3(0.0f, 20.0f, 0.0f), 10.0f); }});
+	script.push_back({6.5f, [&](){ noise_voice.set_position(glm::vec3(0.0f, -20.0f, 0.0f), 3.0f); }});
+	script.push_back({8.0f, [&](){ noise_voice.seek(0.5f); drone_voice.set_volume(0.1f, 1.0f); }});
+	script.push_back({9.0f, [](){ Sound::set_volume(0.5f, 0.5f); }});
+	script.push_back({10.0f, [&](){ drone_voice.stop(0.5f); }});
+	script.push_back({11.0f, [](){ Sound::stop_all_samples(); }});
+	std::stable_sort(script.begin(), script.end(), [](Cue const &a, Cue const &b) { return a.time < b.time; });
+
+	//mix:
+	uint32_t const block = Sound::block_frames();
+	uint32_t const blocks = uint32_t(std::ceil(Seconds * Sound::AudioRate / block));
+	std::vector< float > output(size_t(blocks) * block * 2);
+	std::vector< double > block_seconds(blocks);
+	size_t next_cue = 0;
+	for (uint32_t b = 0; b < blocks; ++b) {
+		float now = float(b) * block / Sound::AudioRate;
+		while (next_cue < script.size() && script[next_cue].time <= now) {
+			script[next_cue].fn();
+			++next_cue;
+		}
+		auto before = std::chrono::steady_clock::now();
+		Sound::mix_offline(output.data() + size_t(b) * block * 2);
+		block_seconds[b] = std::chrono::duration< double >(std::chrono::steady_clock::now() - before).count();
+	}
+
+	save_wav(filename, output, 2, Sound::AudioRate);
+
+	//report:
+	double total = 0.0;
+	for (double s : block_seconds) total += s;
+	std::vector< double > sorted = block_seconds;
+	std::sort(sorted.begin(), sorted.end());
+	double block_length = double(block) / Sound::AudioRate;
+	std::cout << "Rendered " << blocks << " blocks of " << block << " frames (" << blocks * block_length << "s) to '" << filename << "'." << std::endl;
+	std::cout << std::fixed << std::setprecision(3);
+	std::cout << "  mix time per block (us): mean " << total * 1e6 / blocks
+		<< ", median " << sorted[blocks / 2] * 1e6
+		<< ", 99th " << sorted[std::min(blocks - 1, blocks * 99 / 100)] * 1e6
+		<< ", max " << sorted.back() * 1e6 << "\n";
+	std::cout << "  real-time factor: " << (total > 0.0 ? blocks * block_length / total : 0.0) << "x" << std::endl;
+	std::cout << std::defaultfloat << std::setprecision(6);
+	Sound::stats().print(std::cout);
+
+	//fingerprint of the output, so mixer changes can be checked for bit-exactness:
+	std::cout << "Output hash: ";
+	print_hash(std::cout, hash_floats(output.data(), output.size()));
+	std::cout << std::endl;
+
+	return 0;
+}
@@ -0,0 +1,270 @@
+#include "mix_kernel.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+#if defined(__AVX__)
+	#include <immintrin.h>
+	#define MIX_KERNEL_AVX
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#include <emmintrin.h>
+	#define MIX_KERNEL_SSE2
+#endif
+
+void mix_mono_to_stereo_scalar(float *dst, float const *src, uint32_t count,
+	float left, float right, float left_step, float right_step) {
+	for (uint32_t k = 0; k < count; ++k) {
+		//compute gain from the start of the span (rather than accumulating) to avoid drift:
+		float l = left + float(k) * left_step;
+		float r = right + float(k) * right_step;
+		dst[2*k+0] += l * src[k];
+		dst[2*k+1] += r * src[k];
+	}
+}
+
+#if defined(MIX_KERNEL_AVX)
+
+void mix_mono_to_stereo(float *dst, float const *src, uint32_t count,
+	float left, float right, float left_step, float right_step) {
+	uint32_t k = 0;
+
+	//gain for frames k .. k+3, as (l0, r0, l1, r1 | l2, r2, l3, r3):
+	__m256 gain = _mm256_setr_ps(
+		left, right,
+		left + left_step, right + right_step,
+		left + 2.0f * left_step, right + 2.0f * right_step,
+		left + 3.0f * left_step, right + 3.0f * right_step
+	);
+	__m256 gain_step = _mm256_setr_ps(
+		4.0f * left_step, 4.0f * right_step, 4.0f * left_step, 4.0f * right_step,
+		4.0f * left_step, 4.0f * right_step, 4.0f * left_step, 4.0f * right_step
+	);
+
+	for (; k + 4 <= count; k += 4) {
+		//(s0, s1, s2, s3) -> (s0, s0, s1, s1 | s2, s2, s3, s3):
+		__m128 s = _mm_loadu_ps(src + k);
+		__m128 lo = _mm_unpacklo_ps(s, s);
+		__m128 hi = _mm_unpackhi_ps(s, s);
+		__m256 s2 = _mm256_insertf128_ps(_mm256_castps128_ps256(lo), hi, 1);
+
+		__m256 d = _mm256_loadu_ps(dst + 2*k);
+		d = _mm256_add_ps(d, _mm256_mul_ps(gain, s2));
+		_mm256_storeu_ps(dst + 2*k, d);
+
+		gain = _mm256_add_ps(gain, gain_step);
+	}
+
+	//leftover frames:
+	mix_mono_to_stereo_scalar(dst + 2*k, src + k, count - k,
+		left + float(k) * left_step, right + float(k) * right_step, left_step, right_step);
+}
+
+char const *mix_kernel_name() { return "avx"; }
+
+#elif defined(MIX_KERNEL_SSE2)
+
+void mix_mono_to_stereo(float *dst, float const *src, uint32_t count,
+	float left, float right, float left_step, float right_step) {
+	uint32_t k = 0;
+
+	//gain for frames k .. k+1 and k+2 .. k+3, as (l0, r0, l1, r1) and (l2, r2, l3, r3):
+	__m128 gain_a = _mm_setr_ps(left, right, left + left_step, right + right_step);
+	__m128 gain_b = _mm_setr_ps(left + 2.0f * left_step, right + 2.0f * right_step, left + 3.0f * left_step, right + 3.0f * right_step);
+	__m128 gain_step = _mm_setr_ps(4.0f * left_step, 4.0f * right_step, 4.0f * left_step, 4.0f * right_step);
+
+	for (; k + 4 <= count; k += 4) {
+		//(s0, s1, s2, s3) -> (s0, s0, s1, s1) and (s2, s2, s3, s3):
+		__m128 s = _mm_loadu_ps(src + k);
+		__m128 lo = _mm_unpacklo_ps(s, s);
+		__m128 hi = _mm_unpackhi_ps(s, s);
+
+		__m128 da = _mm_loadu_ps(dst + 2*k);
+		__m128 db = _mm_loadu_ps(dst + 2*k + 4);
+		da = _mm_add_ps(da, _mm_mul_ps(gain_a, lo));
+		db = _mm_add_ps(db, _mm_mul_ps(gain_b, hi));
+		_mm_storeu_ps(dst + 2*k, da);
+		_mm_storeu_ps(dst + 2*k + 4, db);
+
+		gain_a = _mm_add_ps(gain_a, gain_step);
+		gain_b = _mm_add_ps(gain_b, gain_step);
+	}
+
+	//leftover frames:
+	mix_mono_to_stereo_scalar(dst + 2*k, src + k, count - k,
+		left + float(k) * left_step, right + float(k) * right_step, left_step, right_step);
+}
+
+char const *mix_kernel_name() { return "sse2"; }
+
+#else
+
+void mix_mono_to_stereo(float *dst, float const *src, uint32_t count,
+	float left, float right, float left_step, float right_step) {
+	mix_mono_to_stereo_scalar(dst, src, count, left, right, left_step, right_step);
+}
+
+char const *mix_kernel_name() { return "scalar"; }
+
+#endif
+
+//----- compressed sample storage -----
+
+void encode_int16(int16_t *dst, float const *src, uint32_t count) {
+	for (uint32_t k = 0; k < count; ++k) {
+		float s = std::max(-1.0f, std::min(1.0f, src[k]));
+		dst[k] = int16_t(std::lround(s * 32767.0f));
+	}
+}
+
+void decode_int16(float *dst, int16_t const *src, uint32_t count) {
+	uint32_t k = 0;
+#if defined(MIX_KERNEL_AVX) || defined(MIX_KERNEL_SSE2)
+	//(AVX has no 256-bit integer ops, so both builds use the SSE2 path here)
+	__m128 const scale = _mm_set1_ps(1.0f / 32767.0f);
+	for (; k + 8 <= count; k += 8) {
+		__m128i s = _mm_loadu_si128(reinterpret_cast< __m128i const * >(src + k));
+		//sign-extend to 32 bits by placing each value in the high half of a lane and shifting down:
+		__m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16);
+		__m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(s, s), 16);
+		_mm_storeu_ps(dst + k, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+		_mm_storeu_ps(dst + k + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+	}
+#endif
+	for (; k < count; ++k) {
+		dst[k] = float(src[k]) * (1.0f / 32767.0f);
+	}
+}
+
+namespace {
+	int16_t const ADPCMSteps[89] = {
+		7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+		50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+		253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+		1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+		3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487,
+		12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+	};
+	int8_t const ADPCMIndexAdjust[8] = { -1, -1, -1, -1, 2, 4, 6, 8 };
+
+	//magnitude of the predictor change for each step index and 3-bit code, precomputed so decoding doesn't branch:
+	// (step/8 + (bit 2 ? step : 0) + (bit 1 ? step/2 : 0) + (bit 0 ? step/4 : 0), as in the IMA reference decoder)
+	struct ADPCMDiffs {
+		int32_t diff[89][8];
+		ADPCMDiffs() {
+			for (uint32_t index = 0; index < 89; ++index) {
+				int32_t step = ADPCMSteps[index];
+				for (uint32_t code = 0; code < 8; ++code) {
+					diff[index][code] = (step >> 3)
+						+ ((code & 4) ? step : 0)
+						+ ((code & 2) ? (step >> 1) : 0)
+						+ ((code & 1) ? (step >> 2) : 0);
+				}
+			}
+		}
+	};
+	ADPCMDiffs const adpcm_diffs;
+
+	//apply one 4-bit code to the decoder state (shared by encoder and decoder so they can't drift apart):
+	inline void adpcm_step(uint32_t code, int32_t &predictor, int32_t &index) {
+		int32_t diff = adpcm_diffs.diff[index][code & 7];
+		predictor += (code & 8) ? -diff : diff;
+		predictor = std::max(-32768, std::min(32767, predictor));
+		index = std::max(0, std::min(88, index + ADPCMIndexAdjust[code & 7]));
+	}
+}
+
+namespace {
+	//encode one block of 16-bit targets, starting from (and updating) the given state; returns the squared error
+	// (or, once the error reaches 'give_up', stops early and returns it -- for trial encodes that can't win):
+	uint64_t encode_adpcm_block(int32_t const *targets, uint8_t *block, int32_t &predictor, int32_t &index, uint64_t give_up = -1ULL) {
+		block[0] = uint8_t(predictor & 0xff);
+		block[1] = uint8_t((predictor >> 8) & 0xff);
+		block[2] = uint8_t(index);
+		block[3] = 0;
+		std::fill(block + 4, block + ADPCMBlockBytes, uint8_t(0));
+		uint64_t error2 = 0;
+		for (uint32_t k = 0; k < ADPCMBlockFrames; ++k) {
+			//pick the code whose step lands closest to the target:
+			int32_t step = ADPCMSteps[index];
+			int32_t diff = targets[k] - predictor;
+			uint32_t code = 0;
+			if (diff < 0) {
+				code = 8;
+				diff = -diff;
+			}
+			if (diff >= step) { code |= 4; diff -= step; }
+			if (diff >= (step >> 1)) { code |= 2; diff -= (step >> 1); }
+			if (diff >= (step >> 2)) { code |= 1; }
+
+			adpcm_step(code, predictor, index);
+			block[4 + k / 2] |= uint8_t(code << (4 * (k % 2)));
+			int64_t e = targets[k] - predictor;
+			error2 += uint64_t(e * e);
+			if (error2 >= give_up) break;
+		}
+		return error2;
+	}
+}
+
+void encode_adpcm(float const *src, uint32_t count, std::vector< uint8_t > *dst_) {
+	assert(dst_);
+	auto &dst = *dst_;
+	uint32_t blocks = (count + ADPCMBlockFrames - 1) / ADPCMBlockFrames;
+	dst.assign(size_t(blocks) * ADPCMBlockBytes, 0);
+
+	int32_t predictor = 0;
+	int32_t index = 0;
+	int32_t targets[ADPCMBlockFrames];
+	for (uint32_t b = 0; b < blocks; ++b) {
+		for (uint32_t k = 0; k < ADPCMBlockFrames; ++k) {
+			uint32_t i = b * ADPCMBlockFrames + k;
+			float s = (i < count ? std::max(-1.0f, std::min(1.0f, src[i])) : 0.0f);
+			targets[k] = int32_t(std::lround(s * 32767.0f));
+		}
+		uint8_t *block = dst.data() + size_t(b) * ADPCMBlockBytes;
+
+		//the step size takes a while to adapt from any fixed start (smearing sharp onsets),
+		// so each block starts from whichever step index encodes it best (blocks store their own start state):
+		// (the index carried over from the last block is usually close, so it's tried first -- then most trials stop early)
+		uint8_t trial[ADPCMBlockBytes];
+		uint64_t best_error2 = -1ULL;
+		int32_t best_index = index;
+		for (int32_t t = -1; t <= 88; ++t) {
+			if (t == index) continue;
+			int32_t trial_predictor = predictor;
+			int32_t trial_index = (t < 0 ? index : t);
+			uint64_t error2 = encode_adpcm_block(targets, trial, trial_predictor, trial_index, best_error2);
+			if (error2 < best_error2) {
+				best_error2 = error2;
+				best_index = (t < 0 ? index : t);
+			}
+		}
+		index = best_index;
+		encode_adpcm_block(targets, block, predictor, index);
+	}
+}
+
+void decode_adpcm(float *dst, uint8_t const *blocks, uint32_t first_frame, uint32_t count) {
+	for (uint32_t k = 0; k < count; /* later */) {
+		uint32_t block = (first_frame + k) / ADPCMBlockFrames;
+		uint32_t first = (first_frame + k) % ADPCMBlockFrames;
+		uint32_t n = std::min(count - k, ADPCMBlockFrames - first);
+		decode_adpcm_block(dst + k, blocks + size_t(block) * ADPCMBlockBytes, first, n);
+		k += n;
+	}
+}
+
+void decode_adpcm_block(float *dst, uint8_t const *block, uint32_t first, uint32_t count) {
+	assert(first + count <= ADPCMBlockFrames);
+	int32_t predictor = int16_t(uint16_t(block[0]) | (uint16_t(block[1]) << 8));
+	int32_t index = std::min< int32_t >(88, block[2]);
+	uint8_t const *codes = block + 4;
+	for (uint32_t k = 0; k < first; ++k) {
+		adpcm_step((codes[k / 2] >> (4 * (k % 2))) & 0xf, predictor, index);
+	}
+	for (uint32_t k = first; k < first + count; ++k) {
+		adpcm_step((codes[k / 2] >> (4 * (k % 2))) & 0xf, predictor, index);
+		dst[k - first] = float(predictor) * (1.0f / 32767.0f);
+	}
+}
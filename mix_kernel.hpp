@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+//Inner mixing loops used by Sound's audio callback.
+//
+//mix_mono_to_stereo adds 'count' mono samples from 'src' into the interleaved
+// stereo (left, right, left, right, ...) buffer 'dst'.
+//The gain applied to sample k is (left + k * left_step, right + k * right_step),
+// so a linear pan/volume ramp can be applied over the whole span.
+//
+//The span must not wrap -- the caller is responsible for splitting at the end of
+// looping samples -- which lets the loop run without per-sample branches.
+void mix_mono_to_stereo(float *dst, float const *src, uint32_t count,
+	float left, float right, float left_step, float right_step);
+
+//Reference (one sample at a time) version of the above;
+// the mixer uses the vectorized version when built with SSE2 or AVX:
+void mix_mono_to_stereo_scalar(float *dst, float const *src, uint32_t count,
+	float left, float right, float left_step, float right_step);
+
+//name of the instruction set mix_mono_to_stereo was built for ("avx", "sse2", or "scalar"):
+char const *mix_kernel_name();
+
+//----- compressed sample storage -----
+//Samples may be kept in memory as 16-bit integers or IMA-ADPCM and decoded a span at a time
+// (into a float scratch buffer) just before mixing.
+
+//convert 'count' floats to 16-bit integers (clamping to [-1,1]) and back:
+void encode_int16(int16_t *dst, float const *src, uint32_t count);
+void decode_int16(float *dst, int16_t const *src, uint32_t count); //(vectorized with SSE2/AVX builds)
+
+//IMA-ADPCM is stored in independent blocks, so decoding can start at any block:
+// |pr|ed|ix|00| <-- predictor (int16, little-endian) and step index before the block's first frame
+// |nn|nn|...|   <-- ADPCMBlockFrames 4-bit codes, low nibble first
+constexpr uint32_t ADPCMBlockFrames = 256;
+constexpr uint32_t ADPCMBlockBytes = 4 + ADPCMBlockFrames / 2;
+
+//encode 'count' floats as ADPCM blocks (the last block is padded with silence):
+void encode_adpcm(float const *src, uint32_t count, std::vector< uint8_t > *dst);
+//decode frames [first_frame, first_frame + count) of a sample stored as consecutive blocks:
+void decode_adpcm(float *dst, uint8_t const *blocks, uint32_t first_frame, uint32_t count);
+//decode frames [first, first + count) of one block (first + count <= ADPCMBlockFrames):
+// (each code depends on the one before, so the frames before 'first' are decoded and discarded)
+void decode_adpcm_block(float *dst, uint8_t const *block, uint32_t first, uint32_t count);
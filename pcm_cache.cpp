@@ -0,0 +1,105 @@
+#include "pcm_cache.hpp"
+
+#include "MappedFile.hpp"
+#include "read_write_chunk.hpp"
+
+#include <cassert>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <memory>
+
+namespace {
+	//bump whenever decoding changes in a way that should invalidate existing caches
+	// (e.g., different downmixing or resampling):
+	constexpr uint32_t PCMCacheVersion = 1;
+
+	//stored in the cache's 'pcmk' chunk; must match the current source for the cache to be used:
+	struct Key {
+		uint64_t source_hash = 0; //FNV-1a of the source file's bytes
+		uint64_t source_size = 0;
+		uint32_t version = PCMCacheVersion;
+		uint32_t rate = 48000;
+	};
+	static_assert(sizeof(Key) == 24, "Key is packed");
+
+	bool operator==(Key const &a, Key const &b) {
+		return a.source_hash == b.source_hash && a.source_size == b.source_size
+		    && a.version == b.version && a.rate == b.rate;
+	}
+
+	Key make_key(MappedFile const &source) {
+		Key key;
+		key.source_size = source.size;
+		uint64_t hash = 14695981039346656037ULL; //FNV-1a
+		for (size_t i = 0; i < source.size; ++i) {
+			hash = (hash ^ source.data[i]) * 1099511628211ULL;
+		}
+		key.source_hash = hash;
+		return key;
+	}
+
+	//returns true (and fills 'data') if 'cache_filename' holds PCM for 'key':
+	bool read_cache(std::string const &cache_filename, Key const &key, std::vector< float > *data) {
+		std::shared_ptr< MappedFile const > file;
+		try {
+			file = std::make_shared< MappedFile const >(cache_filename);
+		} catch (std::exception &) {
+			return false; //no cache yet
+		}
+		try {
+			ChunkReader reader(file);
+			Span< Key > stored = reader.read< Key >("pcmk");
+			if (stored.size != 1 || !(stored[0] == key)) return false; //source (or decoder) has changed
+			Span< float > pcm = reader.read< float >("f32m");
+			data->assign(pcm.begin(), pcm.end());
+		} catch (std::exception &e) {
+			std::cerr << "WARNING: ignoring unreadable audio cache '" << cache_filename << "': " << e.what() << std::endl;
+			return false;
+		}
+		return true;
+	}
+
+	void write_cache(std::string const &cache_filename, Key const &key, std::vector< float > const &data) {
+		//write to a temporary file and then move it into place, so an interrupted write never leaves a
+		// truncated cache (and a concurrent reader never sees a partial one):
+		std::string temp_filename = cache_filename + ".tmp";
+		{
+			std::ofstream out(temp_filename, std::ios::binary);
+			write_chunk("pcmk", std::vector< Key >{ key }, &out);
+			write_chunk("f32m", data, &out);
+			if (!out) {
+				std::cerr << "WARNING: failed to write audio cache '" << temp_filename << "'." << std::endl;
+				out.close();
+				std::remove(temp_filename.c_str());
+				return;
+			}
+		}
+		std::remove(cache_filename.c_str()); //(rename won't replace an existing file on windows)
+		if (std::rename(temp_filename.c_str(), cache_filename.c_str()) != 0) {
+			std::cerr << "WARNING: failed to move audio cache into place at '" << cache_filename << "'." << std::endl;
+			std::remove(temp_filename.c_str());
+		}
+	}
+}
+
+void load_pcm_cached(
+	std::string const &filename,
+	std::function< void(std::string const &filename, std::vector< float > *data) > const &decode,
+	std::vector< float > *data_) {
+
+	assert(data_);
+	auto &data = *data_;
+
+	Key key;
+	{ //hash the source (throws if it can't be opened, just as decoding it would):
+		MappedFile source(filename);
+		key = make_key(source);
+	}
+
+	std::string cache_filename = filename + ".pcm";
+	if (read_cache(cache_filename, key, &data)) return;
+
+	decode(filename, &data);
+	write_cache(cache_filename, key, data);
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+
+//Load decoded 48kHz mono floating-point audio for 'filename' through an on-disk cache:
+// the cache lives next to the source file (as 'filename' + ".pcm") and is keyed by a hash of the
+// source file's contents, so editing or replacing the source invalidates it.
+//On a cache miss, 'decode' is called (e.g., load_opus) and the result is written to the cache;
+// failing to write the cache is only a warning.
+//Throws if the source can't be read or decoding fails.
+void load_pcm_cached(
+	std::string const &filename,
+	std::function< void(std::string const &filename, std::vector< float > *data) > const &decode,
+	std::vector< float > *data
+);
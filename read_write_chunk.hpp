@@ -1,9 +1,15 @@
 #pragma once
 
+#include "MappedFile.hpp"
+
 #include <iostream>
 #include <vector>
 #include <stdexcept>
 #include <cassert>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <type_traits>
 
 //helper function that reads an array of structures preceded by a simple header:
 //Expected format:
@@ -63,3 +69,72 @@ void write_chunk(std::string const &magic, std::vector< T > const &from, std::os
 	to.write(reinterpret_cast< const char * >(&header), sizeof(header));
 	to.write(reinterpret_cast< const char * >(from.data()), from.size() * sizeof(T));
 }
+
+
+//Span is a read-only view of an array of T, along with whatever storage keeps that array alive:
+template< typename T >
+struct Span {
+	T const *data = nullptr;
+	size_t size = 0;
+	std::shared_ptr< void const > storage; //mapped file (or aligned copy) that 'data' points into
+
+	T const *begin() const { return data; }
+	T const *end() const { return data + size; }
+	T const &operator[](size_t i) const { assert(i < size); return data[i]; }
+	bool empty() const { return size == 0; }
+};
+
+//helper that reads chunks (in the same format as read_chunk) directly from a memory-mapped file:
+// chunk data that is suitably aligned for T is returned as a span into the mapping (no copy);
+// misaligned data (e.g. following a 'str0' chunk of odd length) is copied to aligned storage.
+struct ChunkReader {
+	ChunkReader(std::shared_ptr< MappedFile const > const &file_) : file(file_) {
+		assert(file);
+	}
+
+	template< typename T >
+	Span< T > read(std::string const &magic) {
+		static_assert(std::is_trivially_copyable< T >::value, "chunk elements must be trivially copyable");
+		static_assert(alignof(T) <= alignof(std::max_align_t), "chunk elements must not be over-aligned");
+		assert(magic.size() == 4);
+
+		if (remaining() < 8) {
+			throw std::runtime_error("Failed to read chunk header from '" + file->filename + "'");
+		}
+		uint8_t const *header = file->data + offset;
+		if (std::memcmp(header, magic.data(), 4) != 0) {
+			throw std::runtime_error("Unexpected magic number in chunk of '" + file->filename + "' (expected '" + magic + "')");
+		}
+		uint32_t size;
+		std::memcpy(&size, header + 4, 4);
+		if (size % sizeof(T) != 0) {
+			throw std::runtime_error("Size of chunk not divisible by element size");
+		}
+		if (size > remaining() - 8) {
+			throw std::runtime_error("Chunk '" + magic + "' runs past the end of '" + file->filename + "'");
+		}
+		uint8_t const *bytes = header + 8;
+		offset += 8 + size;
+
+		Span< T > span;
+		span.size = size / sizeof(T);
+		if (reinterpret_cast< uintptr_t >(bytes) % alignof(T) == 0) {
+			span.data = reinterpret_cast< T const * >(bytes);
+			span.storage = file;
+		} else {
+			size_t words = (size + sizeof(std::max_align_t) - 1) / sizeof(std::max_align_t);
+			std::shared_ptr< std::max_align_t > copy(new std::max_align_t[words], std::default_delete< std::max_align_t[] >());
+			std::memcpy(copy.get(), bytes, size);
+			span.data = reinterpret_cast< T const * >(copy.get());
+			span.storage = copy;
+		}
+		return span;
+	}
+
+	//bytes not yet read:
+	size_t remaining() const { return file->size - offset; }
+	uint8_t const *current() const { return file->data + offset; }
+
+	std::shared_ptr< MappedFile const > file;
+	size_t offset = 0; //position of next chunk header
+};
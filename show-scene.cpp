@@ -117,9 +117,7 @@ int main(int argc, char **argv) {
 				drawable.pipeline = show_scene_program_pipeline;
 
 				drawable.pipeline.vao = buffer_vao;
-				drawable.pipeline.type = mesh.type;
-				drawable.pipeline.start = mesh.start;
-				drawable.pipeline.count = mesh.count;
+				drawable.set_mesh(mesh);
 
 			});
 		} catch (std::exception &e) {
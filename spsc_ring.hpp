@@ -0,0 +1,53 @@
+#pragma once
+
+/*
+ * SPSCRing< T, Capacity > is a fixed-capacity, single-producer/single-consumer ring buffer.
+ *
+ * Exactly one thread may call push() and exactly one (other) thread may call pop().
+ * Neither call blocks or allocates, so it is safe to use from real-time contexts
+ *  (e.g., handing commands from the game thread to the audio callback).
+ *
+ */
+
+#include <atomic>
+#include <cstdint>
+#include <utility>
+
+template< typename T, uint32_t Capacity >
+struct SPSCRing {
+	static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0, "SPSCRing capacity must be a power of two.");
+
+	//(producer) add a value to the ring; returns false (leaving value untouched) if the ring is full:
+	bool push(T &&value) {
+		uint32_t t = tail.load(std::memory_order_relaxed);
+		if (t - head.load(std::memory_order_acquire) == Capacity) return false;
+		slots[t & (Capacity - 1)] = std::move(value);
+		tail.store(t + 1, std::memory_order_release);
+		return true;
+	}
+	bool push(T const &value) {
+		T copy = value;
+		return push(std::move(copy));
+	}
+
+	//(consumer) remove the oldest value from the ring; returns false if the ring is empty:
+	bool pop(T *value) {
+		uint32_t h = head.load(std::memory_order_relaxed);
+		if (h == tail.load(std::memory_order_acquire)) return false;
+		*value = std::move(slots[h & (Capacity - 1)]);
+		head.store(h + 1, std::memory_order_release);
+		return true;
+	}
+
+	//(either thread) approximate number of values in the ring:
+	uint32_t size() const {
+		return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+	}
+	bool empty() const { return size() == 0; }
+
+	//internals:
+	T slots[Capacity];
+	//head and tail live on separate cache lines so producer and consumer don't fight over them:
+	alignas(64) std::atomic< uint32_t > head{0}; //index of next slot to read (written by consumer)
+	alignas(64) std::atomic< uint32_t > tail{0}; //index of next slot to write (written by producer)
+};